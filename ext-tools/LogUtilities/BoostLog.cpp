@@ -48,16 +48,31 @@ void CBoostLog::logDump(const std::string& prefix, const std::vector<uint8_t>& d
 void CBoostLog::logDump(LogLevel msgLevel, const std::string& prefix, 
                         const std::vector<uint8_t>& data, int startIndex, int length) 
 {
-   std::ostringstream output;
    if (length == -1) { length = data.size() - startIndex; }
+   logDump(msgLevel, prefix, data.empty() ? NULL : &data[0] + startIndex, length);
+}
+
+void CBoostLog::logDump(LogLevel msgLevel, const std::string& prefix, 
+                        const uint8_t* data, size_t length) 
+{
+   // dumps are expensive to format, skip them when they would be filtered out
+   if (!isEnabled(msgLevel)) {
+      return;
+   }
 
+   std::ostringstream output;
    output << prefix << " [len=" << std::dec << length << "]:\n";
-   for (size_t i = startIndex; i < length; i++) {
+   for (size_t i = 0; i < length; i++) {
       output << std::hex << (int)data[i] << " ";
    }
    getInstance().logMsg(msgLevel, output.str());
 }
 
+bool CBoostLog::isEnabled(LogLevel msgLevel)
+{
+   return getInstance().willLog(msgLevel);
+}
+
 
 CBoostLog& CBoostLog::getInstance() 
 {
@@ -141,13 +156,18 @@ void CBoostLog::logMsg(LogLevel msgLevel, const std::string& msg)
    boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
 
    // filter by severity
-   if (msgLevel >= m_logLevel || msgLevel == LOG_ALWAYS) {
+   if (willLog(msgLevel)) {
       std::ostringstream logmsg;
       logmsg << now << LOG_FIELD_SEPARATOR << msg;
       m_msgQueue.push(logmsg.str());
    }
 }
 
+bool CBoostLog::willLog(LogLevel msgLevel) const
+{
+   return msgLevel >= m_logLevel || msgLevel == LOG_ALWAYS;
+}
+
 void CBoostLog::writeMsg(const std::string& msg)
 {
    bool rotateOk = true;
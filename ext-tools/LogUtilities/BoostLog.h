@@ -57,6 +57,13 @@ public:
    static void logDump(LogLevel msgLevel, const std::string& prefix, 
                        const std::vector<uint8_t>& data, int startIndex = 0, int length = -1);
 
+   static void logDump(LogLevel msgLevel, const std::string& prefix, 
+                       const uint8_t* data, size_t length);
+
+   // Whether a message with the specified level would be written.
+   // Lets callers skip formatting messages that are filtered out.
+   static bool isEnabled(LogLevel msgLevel);
+
 
    static CBoostLog& getInstance();
 
@@ -83,6 +90,8 @@ public:
    // Write a message with the specified log level
    void logMsg(LogLevel msgLevel, const std::string& msg);
 
+   bool willLog(LogLevel msgLevel) const;
+
 private:
    // Returns: whether the rotate operation succeeded
    bool rotateLogs();
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef ApiFrame_H_
+#define ApiFrame_H_
+
+#pragma once
+
+#include "Common.h"
+
+#include <assert.h>
+#include <stdexcept>
+
+
+namespace DustSerialMux {
+
+   /**
+    * Read-only view of a range of bytes
+    *
+    * The view does not own the data: it's valid as long as the buffer it
+    * points into, e.g. for the duration of an IPicardCallback call.
+    */
+   class CByteView {
+   public:
+      CByteView() : m_data(NULL), m_len(0) { ; }
+      CByteView(const uint8_t* data, size_t len) : m_data(data), m_len(len) { ; }
+      explicit CByteView(const ByteVector& data)
+         : m_data(data.empty() ? NULL : &data[0]), m_len(data.size())
+      { ; }
+
+      const uint8_t* data() const { return m_data; }
+      size_t size() const { return m_len; }
+      bool empty() const { return m_len == 0; }
+
+      const uint8_t* begin() const { return m_data; }
+      const uint8_t* end() const { return m_data + m_len; }
+
+      uint8_t operator[](size_t i) const
+      {
+         assert(i < m_len);
+         return m_data[i];
+      }
+
+      // Throws: std::out_of_range if i is past the end of the view
+      uint8_t at(size_t i) const
+      {
+         if (i >= m_len) {
+            throw std::out_of_range("CByteView::at");
+         }
+         return m_data[i];
+      }
+
+      // Returns: the view from offset to the end, empty if offset is past the end
+      CByteView from(size_t offset) const
+      {
+         return offset < m_len ? CByteView(m_data + offset, m_len - offset) : CByteView();
+      }
+
+      // copy the bytes, for callers that keep them
+      ByteVector toVector() const { return ByteVector(begin(), end()); }
+
+   private:
+      const uint8_t* m_data;
+      size_t m_len;
+   };
+
+
+   /**
+    * View of a Serial API frame: control, type, sequence number, length,
+    * followed by the payload
+    */
+   class CApiFrame {
+   public:
+      static const size_t HEADER_LEN = 4;
+
+      // control flags
+      enum {
+         CONTROL_RESPONSE = 0x1, // response (ACK), otherwise request (DATA)
+         CONTROL_RELIABLE = 0x2,
+      };
+
+      CApiFrame(const uint8_t* frame, size_t len) : m_frame(frame), m_len(len) { ; }
+
+      // Returns: whether the frame holds a complete header and exactly the
+      // payload length the header announces
+      bool isValid() const
+      {
+         return m_len >= HEADER_LEN && m_frame[3] + HEADER_LEN == m_len;
+      }
+
+      // the header accessors return 0 for a frame that's too short
+      uint8_t control() const { return header(0); }
+      uint8_t type() const    { return header(1); }
+      uint8_t seqNo() const   { return header(2); }
+      uint8_t length() const  { return header(3); }
+
+      bool isResponse() const { return (control() & CONTROL_RESPONSE) != 0; }
+      bool isReliable() const { return (control() & CONTROL_RELIABLE) != 0; }
+
+      // Returns: the bytes after the header
+      CByteView payload() const { return CByteView(m_frame, m_len).from(HEADER_LEN); }
+
+   private:
+      uint8_t header(size_t i) const { return i < m_len ? m_frame[i] : 0; }
+
+      const uint8_t* m_frame;
+      size_t m_len;
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! ApiFrame_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef AtomicSeqNo_H_
+#define AtomicSeqNo_H_
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#pragma intrinsic(_InterlockedCompareExchange)
+#endif
+
+
+namespace DustSerialMux {
+
+   /**
+    * Serial API sequence number shared between threads
+    *
+    * Every operation is a single atomic compare-and-swap (or a loop of them)
+    * with a full memory barrier, so the sequence numbers can be read and
+    * updated from the Picard read thread and the command thread without a
+    * lock. Arithmetic wraps at 256 like the sequence numbers on the wire.
+    */
+   class CAtomicSeqNo {
+   public:
+      explicit CAtomicSeqNo(uint8_t value = 0) : m_value(value) { ; }
+
+      uint8_t load() const { return (uint8_t)compareAndSwap(0, 0); }
+
+      void store(uint8_t value) { exchange(value); }
+
+      // Returns: the previous value
+      uint8_t exchange(uint8_t value)
+      {
+         long current = compareAndSwap(0, 0);
+         long previous;
+         while ((previous = compareAndSwap(current, value)) != current) {
+            current = previous;
+         }
+         return (uint8_t)previous;
+      }
+
+      // Set the value to desired if it is equal to expected
+      // Returns: whether the value was set, expected is updated to the
+      // value found
+      bool compareExchange(uint8_t& expected, uint8_t desired)
+      {
+         long previous = compareAndSwap(expected, desired);
+         bool swapped = (previous == expected);
+         expected = (uint8_t)previous;
+         return swapped;
+      }
+
+   private:
+      // Returns: the value before the operation
+      long compareAndSwap(long expected, long desired) const
+      {
+#ifdef _MSC_VER
+         return _InterlockedCompareExchange(&m_value, desired, expected);
+#else
+         return __sync_val_compare_and_swap(&m_value, expected, desired);
+#endif
+      }
+
+      // not copyable
+      CAtomicSeqNo(const CAtomicSeqNo&);
+      CAtomicSeqNo& operator=(const CAtomicSeqNo&);
+
+      // only the low 8 bits are used, the interlocked operations work on longs
+      mutable volatile long m_value;
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! AtomicSeqNo_H_ */
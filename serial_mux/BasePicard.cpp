@@ -8,27 +8,39 @@
 #include "BoostLog.h"
 #include "HDLC.h"
 
-#include "serial_mux.h"    // for resetConnection
+#include <boost/thread/thread.hpp>
+
+#include <iomanip>
+#include <algorithm>
 
-#include <boost/date_time/posix_time/posix_time.hpp>
-using namespace boost::posix_time;
 
 
 namespace DustSerialMux {
 
-   const int SERIAL_API_HEADER_LEN = 4;
    const int READ_TIMEOUT = 1000; // milliseconds to wait for read completion
 
-   CBasePicardIO::CBasePicardIO()
-      : m_isRunning(false),
+   CBasePicardIO::CBasePicardIO(size_t maxFrameLen, int statsInterval)
+      : m_callback(NULL),
+        m_reconnect(),
+        m_hdlc(NULL),
+        m_maxFrameLen(maxFrameLen),
+        m_statsInterval(statsInterval),
+        m_impairment(NULL),
+        m_session(NULL),
+        m_isRunning(false),
+        m_softReset(false),
         m_connected(false),
         m_connectMutex(),
         m_connect(),
-        m_callback(NULL),
-        m_hdlc(NULL),
+        m_startTime(0),
+        m_timeToConnect(0),
+        m_hellos(0),
+        m_helloResponses(0),
+        m_inputLock(),
+        m_lastInput(0),
         m_protocolVersion(0),
         m_seqNo(0),
-        m_mgrSeqNo(0)
+        m_batchFrames(0)
    { ; }
 
    CBasePicardIO::~CBasePicardIO()
@@ -41,6 +53,10 @@ namespace DustSerialMux {
    {
       m_connected = false;
       
+      if (m_hdlc) {
+         logLinkStats(LOG_ALWAYS, "session");
+      }
+      logNotifStats(LOG_ALWAYS, "session");
       delete m_hdlc; 
       m_hdlc = NULL;
    }
@@ -56,6 +72,59 @@ namespace DustSerialMux {
       m_callback = handler;
    }
 
+   void CBasePicardIO::resetConnection()
+   {
+      if (m_session) {
+         m_session->resetConnection();
+      }
+   }
+
+   void CBasePicardIO::resetPicardConnection()
+   {
+      if (m_session) {
+         m_session->resetPicardConnection();
+      }
+   }
+
+   void CBasePicardIO::start()
+   {
+      m_startTime = monotonicMicroseconds();
+      m_timeToConnect = 0;
+      m_hellos = 0;
+      {
+         boost::lock_guard<boost::mutex> guard(m_connectMutex);
+         m_isRunning = true;
+      }
+      boost::lock_guard<boost::mutex> guard(m_inputLock);
+      m_lastInput = m_startTime;
+   }
+
+   void CBasePicardIO::stop()
+   {
+      boost::lock_guard<boost::mutex> guard(m_connectMutex);
+      m_isRunning = false;
+      // a probe in progress gives up
+      m_connect.notify_all();
+   }
+
+   bool CBasePicardIO::isRunning() const
+   {
+      boost::lock_guard<boost::mutex> guard(m_connectMutex);
+      return m_isRunning;
+   }
+
+   uint64_t CBasePicardIO::getLastInput() const
+   {
+      boost::lock_guard<boost::mutex> guard(m_inputLock);
+      return m_lastInput;
+   }
+
+   void CBasePicardIO::inputReceived()
+   {
+      boost::lock_guard<boost::mutex> guard(m_inputLock);
+      m_lastInput = monotonicMicroseconds();
+   }
+
    // -----------------------------------------------
    // base class interface methods
 
@@ -64,55 +133,135 @@ namespace DustSerialMux {
     */
    uint8_t CBasePicardIO::sendCommand(const CMuxMessage& cmd, uint8_t& seqNo, bool retransmit) 
    {
-      // TODO: lock b/c we access a member variable (seqNo)
-      
-      uint8_t cmdLen = cmd.size() & 0xFF;
-      std::vector<uint8_t> buf(cmdLen + SERIAL_API_HEADER_LEN);
-      
-      // prefix the control byte
-      uint8_t control = 2; // Request (DATA) | RELIABLE
-      size_t index = 0;
-      buf[index++] = control;    // control
-      buf[index++] = cmd.type(); // type
-      buf[index++] = m_seqNo;
-      buf[index++] = cmdLen;     // length
+      uint8_t buf[MAX_SERIAL_API_FRAME_LEN];
+      uint8_t cmdSeqNo = buildCommandHeader(cmd, retransmit, buf);
+      size_t index = SERIAL_API_HEADER_LEN;
       // copy the command to the temporary buffer
-      for (int i = 0; i < cmdLen; i++) {
+      for (int i = 0; i < buf[3]; i++) {
          buf[index++] = cmd.m_data[i];
       }
 
-      if (retransmit) {
-         std::ostringstream msg;
-         msg << "sendCmd: retransmit seq=" << (int)m_seqNo;
-         CBoostLog::log(msg.str());
-      }
-
       // set the sequence number for the caller before we write 
       // in case the response comes back *really* fast
-      seqNo = m_seqNo; 
+      seqNo = cmdSeqNo;
       // note: we shouldn't get any other commands until this one has responded
 
-      sendRaw(buf);
-      return m_seqNo;
+      sendRaw(buf, index);
+      return cmdSeqNo;
+   }
+
+   uint8_t CBasePicardIO::buildCommandHeader(const CMuxMessage& cmd, bool retransmit, uint8_t* header)
+   {
+      // the read thread advances the sequence number when a response arrives,
+      // take one value for the whole frame
+      uint8_t cmdSeqNo = m_seqNo.load();
+
+      // prefix the control byte
+      uint8_t control = 2; // Request (DATA) | RELIABLE
+      header[0] = control;            // control
+      header[1] = cmd.type();         // type
+      header[2] = cmdSeqNo;
+      header[3] = cmd.size() & 0xFF;  // length
+
+      if (retransmit) {
+         std::ostringstream msg;
+         msg << "sendCmd: retransmit seq=" << (int)cmdSeqNo;
+         CBoostLog::log(msg.str());
+      }
+      return cmdSeqNo;
    }
 
    void CBasePicardIO::sendAck(uint8_t type, uint8_t seqNo)
    {
-      // TODO: lock b/c we access a member variable (mgrSeq)
-      
-      std::vector<uint8_t> buf;
+      sendAckFrame(type, seqNo);
+   }
+
+   void CBasePicardIO::sendAckFrame(uint8_t type, uint8_t seqNo)
+   {
+      uint8_t buf[SERIAL_API_HEADER_LEN + 1];
+      size_t index = 0;
 
       // prefix the control byte
       uint8_t control = 3;  // Response (ACK) | RELIABLE
-      buf.push_back(control);
-      buf.push_back(type);   // type
-      buf.push_back(seqNo);  // sequence number
-      buf.push_back(1);      // length
+      buf[index++] = control;
+      buf[index++] = type;   // type
+      buf[index++] = seqNo;  // sequence number
+      buf[index++] = 1;      // length
       
-      buf.push_back(0);      // response code
-      m_mgrSeqNo = seqNo+1;  // next expected sequence number
+      buf[index++] = 0;      // response code
+
+      sendRaw(buf, index);
+   }
+
+   bool CBasePicardIO::probe(int timeout)
+   {
+      uint32_t responses;
+      {
+         boost::lock_guard<boost::mutex> guard(m_connectMutex);
+         responses = m_helloResponses;
+      }
+      // the Hello is written without the lock, the read thread takes it to
+      // signal the Hello Response
+      sendHello(0);
+      CBoostLog::log("sent hello (probe)");
+
+      boost::unique_lock<boost::mutex> lock(m_connectMutex);
+      boost::system_time deadline = boost::get_system_time() +
+         boost::posix_time::milliseconds(timeout);
+      while (m_helloResponses == responses && m_isRunning &&
+             m_connect.timed_wait(lock, deadline)) {
+         ;
+      }
+      return m_helloResponses != responses;
+   }
+
+   bool CBasePicardIO::getLinkStats(SHDLCStats& stats) const
+   {
+      if (m_hdlc == NULL) {
+         return false;
+      }
+      stats = m_hdlc->getStats();
+      return true;
+   }
+
+   void CBasePicardIO::logLinkStats(LogLevel level, const std::string& context) const
+   {
+      SHDLCStats stats;
+      if (!getLinkStats(stats)) {
+         return;
+      }
 
-      sendRaw(buf);
+      std::ostringstream msg;
+      msg << "link stats (" << context << "): good=" << stats.goodFrames
+          << " fcs-errors=" << stats.fcsErrors
+          << " runts=" << stats.runtFrames
+          << " aborts=" << stats.aborts
+          << " oversize=" << stats.oversizeFrames
+          << " bytes=" << stats.bytesReceived
+          << " discarded=" << stats.discardedBytes
+          << " escape-overhead=" << std::fixed << std::setprecision(2)
+          << stats.escapeOverhead() * 100 << "%"
+          << " sizes=";
+      for (int i = 0; i < SHDLCStats::SIZE_BUCKETS; i++) {
+         msg << (i ? "," : "") << stats.sizeHistogram[i];
+      }
+      CBoostLog::log(level, msg.str());
+   }
+
+   void CBasePicardIO::logNotifStats(LogLevel level, const std::string& context) const
+   {
+      SNotifStats stats = getNotifStats();
+      if (stats.reliable == 0) {
+         return;
+      }
+
+      std::ostringstream msg;
+      msg << "notif stats (" << context << "): reliable=" << stats.reliable
+          << " duplicates=" << stats.duplicates
+          << " gaps=" << stats.gaps
+          << " missing=" << stats.missing
+          << " out-of-order=" << stats.outOfOrder;
+      CBoostLog::log(level, msg.str());
    }
 
    // Returns: whether or not there is a connection
@@ -156,34 +305,92 @@ namespace DustSerialMux {
          requestedVersion = KNOWN_API_PROTOCOL_VERSIONS[0];
       }
       
-      std::vector<uint8_t> buf;
+      uint8_t helloSeqNo = m_seqNo.load();
+      uint8_t buf[SERIAL_API_HEADER_LEN + 3];
+      size_t index = 0;
 
       // prefix the control byte
       uint8_t control = 0;  // Request (DATA) | UNRELIABLE
-      buf.push_back(control);
-      buf.push_back(HELLO);
-      buf.push_back(m_seqNo);  // sequence number
-      buf.push_back(3);        // length
-      buf.push_back(requestedVersion);
-      buf.push_back(m_seqNo);  // (client) sequence number
-      buf.push_back(0);        // reserved (mode)
+      buf[index++] = control;
+      buf[index++] = HELLO;
+      buf[index++] = helloSeqNo; // sequence number
+      buf[index++] = 3;          // length
+      buf[index++] = requestedVersion;
+      buf[index++] = helloSeqNo; // (client) sequence number
+      buf[index++] = 0;          // reserved (mode)
       //m_seqNo++;
-      sendRaw(buf);
+      sendRaw(buf, index);
    }
 
    // handle a complete message from Picard 
-   void CBasePicardIO::frameComplete(const std::vector<uint8_t>& frame)
+   void CBasePicardIO::frameComplete(const uint8_t* frame, size_t frameLen)
    {
-      if (frame.size() > SERIAL_API_HEADER_LEN) {
-         // parse the Serial API frame
-         uint8_t control = frame[0];
-         uint8_t type    = frame[1];
-         uint8_t seqNo   = frame[2];
-         uint8_t len     = frame[3];
-
-         // check payload length
-         if (len + SERIAL_API_HEADER_LEN != frame.size()) {
-            return;
+      if (m_impairment != NULL) {
+         impairFrame(frame, frameLen);
+      } else {
+         handleFrame(frame, frameLen);
+      }
+      // duplicates, ACKs and short frames use up the decoder's frames too
+      if (!m_notifs.empty() && ++m_batchFrames >= FRAME_POOL_SIZE - 1) {
+         flushNotifs();
+      }
+   }
+
+   void CBasePicardIO::impairFrame(const uint8_t* frame, size_t len)
+   {
+      m_impairBuffer.assign(frame, frame + len);
+      uint8_t* data = m_impairBuffer.empty() ? NULL : &m_impairBuffer[0];
+      switch (m_impairment->impair(CLinkImpairment::IMPAIR_RX, data, len,
+                                   monotonicMicroseconds())) {
+      case CLinkImpairment::IMPAIR_DROP:
+         break;
+      case CLinkImpairment::IMPAIR_CORRUPT:
+         // the FCS check of the HDLC decoder would have discarded the frame,
+         // the UDP transport has no check
+         if (m_hdlc == NULL) {
+            receiveImpaired(data, len, 0);
+         }
+         break;
+      case CLinkImpairment::IMPAIR_DUPLICATE:
+         receiveImpaired(data, len, 0);
+         receiveImpaired(data, len, 0);
+         break;
+      case CLinkImpairment::IMPAIR_DELAY:
+         receiveImpaired(data, len, m_impairment->getDelay());
+         break;
+      default:
+         receiveImpaired(data, len, 0);
+         break;
+      }
+      // the notifications point into m_impairBuffer, the next frame
+      // overwrites it
+      flushNotifs();
+   }
+
+   void CBasePicardIO::receiveImpaired(const uint8_t* frame, size_t len, uint64_t delay)
+   {
+      if (delay > 0) {
+         // what was received before the delayed frame goes to the clients first
+         flushNotifs();
+         boost::this_thread::sleep(boost::posix_time::microseconds(delay));
+      }
+      handleFrame(frame, len);
+   }
+
+   void CBasePicardIO::handleFrame(const uint8_t* frame, size_t frameLen)
+   {
+      CApiFrame apiFrame(frame, frameLen);
+      // check payload length, every frame we handle has a payload
+      if (apiFrame.isValid() && apiFrame.length() > 0) {
+         uint8_t control = apiFrame.control();
+         uint8_t type    = apiFrame.type();
+         uint8_t seqNo   = apiFrame.seqNo();
+         uint8_t len     = apiFrame.length();
+         CByteView payload = apiFrame.payload();
+
+         // notifications go to the clients in order with everything else
+         if (type != NOTIFICATION) {
+            flushNotifs();
          }
 
          // handle input based on command type
@@ -196,25 +403,44 @@ namespace DustSerialMux {
             //   uint8_t  mode;     // reserved for compatibility, must be 0
             //}
             // control = 0, type = HELLO_RESP, success code = OK
-            uint8_t successCode = frame[SERIAL_API_HEADER_LEN];
-            uint8_t version     = frame[SERIAL_API_HEADER_LEN + 1];
-            uint8_t mgrSeqNo    = frame[SERIAL_API_HEADER_LEN + 2];
-            uint8_t cliSeqNo    = frame[SERIAL_API_HEADER_LEN + 3];
+            uint8_t successCode = payload[0];
+            uint8_t version     = payload[1];
+            uint8_t cliSeqNo    = payload[3];
 
             // record the protocol version if we recognize it (with any successCode)
             if (checkProtocol(version)) {
                m_protocolVersion = version;
             }
             if (control == 0 && successCode == 0) {
-               // handle sequence numbers
-               m_mgrSeqNo = mgrSeqNo;
-               m_seqNo = cliSeqNo + 1; // increment our sequence number
+               // handle sequence numbers, the Manager's start a new window below
+               m_seqNo.store(cliSeqNo + 1); // increment our sequence number
+               // a new Manager session starts a new notification sequence
+               logNotifStats(LOG_ALWAYS, "previous Manager session");
+               m_notifWindow.reset();
+               m_notifWindow.resetStats();
                
                if (!m_connected) {
+                  m_timeToConnect = std::max<uint64_t>(monotonicMicroseconds() - m_startTime, 1);
+                  std::ostringstream msg;
+                  msg << "connected to Picard in " << m_timeToConnect / 1000 << " ms, "
+                      << m_hellos << " hello(s)";
+                  CBoostLog::log(LOG_ALWAYS, msg.str());
+               }
+
+               bool wasConnected;
+               {
                   boost::lock_guard<boost::mutex> guard(m_connectMutex);
+                  wasConnected = m_connected;
                   m_connected = true;
+                  m_helloResponses++;
                   m_connect.notify_all();
                }
+               if (!wasConnected && m_softReset && m_callback != NULL) {
+                  m_callback->linkStateChanged(true);
+               }
+               else if (wasConnected && m_callback != NULL) {
+                  m_callback->sessionRestarted();
+               }
             } else {
                CBoostLog::log("Bad Hello Response");
             }
@@ -225,72 +451,157 @@ namespace DustSerialMux {
             //   uint8_t  mode;     // reserved for compatibility, must be 0
             //}
             // record the protocol version if we recognize it
-            if (checkProtocol(frame[SERIAL_API_HEADER_LEN])) {
-               m_protocolVersion = frame[SERIAL_API_HEADER_LEN];
+            if (checkProtocol(payload[0])) {
+               m_protocolVersion = payload[0];
             }
             // reset when a MGR_HELLO is received, i.e. Picard has reset
-            if (m_connected) {
+            if (m_connected && m_softReset) {
+               restartSession();
+            }
+            else if (m_connected) {
                resetConnection();
                // Don't clear m_connected. We want everything to be torn down and restarted.
                // If m_connected is false, the read loop might send a new hello
             }
          }
-         else if (type == NOTIFICATION && (control & 0x1) == 0 && len > 1) {
+         else if (type == NOTIFICATION && !apiFrame.isResponse() && len > 1) {
             // send ack if this notification is reliable, send ack before notif callback 
-            bool isReliable = (control & 0x2);
+            bool isReliable = apiFrame.isReliable();
+            bool isDuplicate = false;
             if (isReliable) {
+               // a retransmission (our ACK was lost) is acknowledged again
+               // but not passed on
+               isDuplicate = !m_notifWindow.accept(seqNo);
                sendAck(type, seqNo);
             }
 
             // notif type is the first byte after the header
-            uint8_t notifType = frame[SERIAL_API_HEADER_LEN];
-            // notif payload is the rest
-            std::vector<uint8_t> notif(frame.begin()+SERIAL_API_HEADER_LEN+1, frame.end());
+            uint8_t notifType = payload[0];
+            // notif payload is the rest, passed on without a copy
+            CByteView notif = payload.from(1);
 
-            // we expect seqNo = m_mgrSeqNo + 1
             // always send notifications if unreliable, otherwise (if reliable),
             // filter out duplicates, but don't validate sequence number
-            if (m_callback != NULL && (!isReliable || (m_mgrSeqNo != seqNo))) {
-               m_callback->handleNotif(notifType, notif);
+            if (m_callback != NULL && !isDuplicate) {
+               m_notifs.push(notifType, notif);
+               if (m_notifs.full()) {
+                  flushNotifs();
+               }
             }
-            m_mgrSeqNo = seqNo;
          }
          // ensure this is a command response with command type in the right range
          // control == 3 means Response (ACK) | RELIABLE
          else if (type > NOTIFICATION && len >= 1 && control == 3) {
-            // update the next expected sequence number
-            m_seqNo = seqNo + 1;
+            // the response to the current command moves on to the next
+            // sequence number, a late response to an earlier command doesn't
+            uint8_t currentSeqNo = seqNo;
+            m_seqNo.compareExchange(currentSeqNo, seqNo + 1);
             // response code is the first byte after the header
-            uint8_t respCode = frame[SERIAL_API_HEADER_LEN];
+            uint8_t respCode = payload[0];
             // response payload is the rest
-            std::vector<uint8_t> payload(frame.begin()+SERIAL_API_HEADER_LEN+1, frame.end());
             if (m_callback != NULL) {
-               m_callback->commandComplete(type, seqNo, respCode, payload);
+               m_callback->commandComplete(type, seqNo, respCode, payload.from(1));
             }
          }
       }
    }
 
+   // The decoder is instantiated here, next to frameComplete, so the whole
+   // decode path is compiled as one piece
+   void CBasePicardIO::decode(const uint8_t* data, size_t len)
+   {
+      inputReceived();
+      if (m_hdlc) {
+         m_hdlc->addBytes(data, len);
+      }
+      flushNotifs();
+   }
+
+   void CBasePicardIO::flushNotifs()
+   {
+      if (!m_notifs.empty()) {
+         if (m_callback != NULL) {
+            m_callback->handleNotifs(m_notifs);
+         }
+         m_notifs.clear();
+      }
+      m_batchFrames = 0;
+   }
+
+   void CBasePicardIO::createDecoder()
+   {
+      delete m_hdlc;
+      // the notifications of a batch point into the decoder's frames: a
+      // frame is valid until the pool size - 1 more frames are complete,
+      // and frameComplete passes the batch on before that
+      m_hdlc = new Decoder(this, m_maxFrameLen, FRAME_POOL_SIZE);
+   }
+
+   void CBasePicardIO::restartSession()
+   {
+      CBoostLog::log(LOG_ALWAYS, "Manager reset, restarting the Serial API session");
+      {
+         boost::lock_guard<boost::mutex> guard(m_connectMutex);
+         m_connected = false;
+      }
+      m_startTime = monotonicMicroseconds();
+      m_timeToConnect = 0;
+      m_hellos = 0;
+
+      // commands in progress won't get a response from the new session
+      if (m_callback != NULL) {
+         m_callback->linkStateChanged(false);
+      }
+      startHellos();
+   }
+
+   bool CBasePicardIO::sendHelloIfNeeded()
+   {
+      if (m_connected) {
+         return false;
+      }
+      // note: send should catch exceptions
+      sendHello(0);
+      m_hellos++;
+      CBoostLog::log(LOG_TRACE, "sent hello");
+      return true;
+   }
+
    void CBasePicardIO::threadMain() 
    {
       // start a new parser
-      m_hdlc = new CHDLC(INPUT_BUFFER_LEN, this);
-      // init the hello to something in the past
-      ptime lastHello = second_clock::universal_time() - seconds(2*PICARD_HELLO_INTERVAL);
+      createDecoder();
+      // the first hello goes out right away
+      // note: the Hellos can't be more frequent than the read timeout
+      uint64_t nextHello = monotonicMicroseconds();
+      int helloInterval = m_reconnect.initialInterval;
+      bool wasConnected = false;
+      uint64_t lastStats = monotonicMicroseconds();
       try {
-         while (m_isRunning) {
-            ptime now = second_clock::universal_time();
-            if (!m_connected && (now - lastHello) > seconds(PICARD_HELLO_INTERVAL)) {
-               // note: send should catch exceptions
-               std::ostringstream msg;
-               msg << "sending hello? lastHello=" << lastHello << " now=" << now;
-               CBoostLog::log(LOG_TRACE, msg.str());
-               sendHello(0);
-               CBoostLog::log(LOG_TRACE, "sent hello");
-               lastHello = second_clock::universal_time();
+         while (isRunning()) {
+            uint64_t now = monotonicMicroseconds();
+            // after a soft reset, the Hellos start over
+            if (wasConnected && !m_connected) {
+               nextHello = now;
+               helloInterval = m_reconnect.initialInterval;
+            }
+            wasConnected = m_connected;
+            if (now >= nextHello && sendHelloIfNeeded()) {
+               nextHello = now + (uint64_t)helloInterval * 1000;
+               helloInterval = m_reconnect.nextInterval(helloInterval);
             }
             // the PicardIO main loop always reads
             read("read loop", READ_TIMEOUT);
+
+            if (m_statsInterval > 0 &&
+                monotonicMicroseconds() - lastStats >= (uint64_t)m_statsInterval * 1000000) {
+               logLinkStats(LOG_ALWAYS, "periodic");
+               logNotifStats(LOG_ALWAYS, "periodic");
+               if (m_impairment != NULL) {
+                  m_impairment->logStats(LOG_ALWAYS, "periodic");
+               }
+               lastStats = monotonicMicroseconds();
+            }
          }
       }
       catch (const std::exception& ex) {
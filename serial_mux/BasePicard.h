@@ -11,6 +11,11 @@
 #include "PicardInterfaces.h"
 #include "MuxMessageParser.h"
 #include "HDLC.h"
+#include "AtomicSeqNo.h"
+#include "SeqWindow.h"
+#include "LinkImpairment.h"
+#include "BoostLog.h"
+#include "serial_mux.h"
 
 #include <boost/thread/condition_variable.hpp>
 
@@ -20,7 +25,34 @@ namespace DustSerialMux {
    // list of known API versions -- the first entry is the version we request
    // if the Manager hasn't sent us a MgrHello
    const uint8_t KNOWN_API_PROTOCOL_VERSIONS[] = { 4, 3 };
-   const int  PICARD_HELLO_INTERVAL = 6; // seconds
+   const int  PICARD_HELLO_INTERVAL = 6; // seconds, the longest interval between Hellos
+
+   const int SERIAL_API_HEADER_LEN = CApiFrame::HEADER_LEN;
+   // largest Serial API frame: header + 255 byte payload
+   const int MAX_SERIAL_API_FRAME_LEN = SERIAL_API_HEADER_LEN + 255;
+
+
+   /**
+    * Hello schedule while there's no connection to Picard
+    *
+    * The first Hello is sent as soon as the port is open, the next after
+    * initialInterval, and the interval doubles up to maxInterval.
+    */
+   struct SReconnectPolicy {
+      SReconnectPolicy(int initial = PICARD_HELLO_INTERVAL * 1000,
+                       int max = PICARD_HELLO_INTERVAL * 1000)
+         : initialInterval(initial), maxInterval(max)
+      { ; }
+
+      // Returns: the interval that follows interval
+      int nextInterval(int interval) const
+      {
+         return (interval < maxInterval / 2) ? interval * 2 : maxInterval;
+      }
+
+      int initialInterval; // milliseconds
+      int maxInterval;     // milliseconds
+   };
 
 
    /**
@@ -32,30 +64,68 @@ namespace DustSerialMux {
     *
     */
    // The output class 
-   class CBasePicardIO : public IPicardIO, public IHDLCParser {
+   class CBasePicardIO : public IPicardIO {
    public:
       static const int INPUT_BUFFER_LEN = 1024;
+      // the decoder lends a full notification batch and the frame being
+      // decoded
+      static const int FRAME_POOL_SIZE = CNotifBatch::MAX_NOTIFS + 1;
 
-      CBasePicardIO();
+      // maxFrameLen limits the size of HDLC frames accepted from Picard
+      // statsInterval is the number of seconds between link statistics log
+      // messages, 0 to disable
+      CBasePicardIO(size_t maxFrameLen = INPUT_BUFFER_LEN, int statsInterval = 0);
 
       virtual ~CBasePicardIO();
       // cleanup should be called before restarting the read loop
       // in the serial mux main loop, we destroy and recreate all components
       void cleanup();
       
-      void start() { m_isRunning = true; }
-      void stop() { m_isRunning = false; }
+      // Transports that read asynchronously on the io_service start their
+      // reads in start(). stop() may be called from any thread.
+      virtual void start();
+      virtual void stop();
+
+      // Returns: whether threadMain must run in its own thread to read
+      // from Picard
+      virtual bool needsReadThread() const { return true; }
 
       void registerCallback(IPicardCallback* handler);
 
+      // set before start()
+      void setReconnectPolicy(const SReconnectPolicy& policy) { m_reconnect = policy; }
+
+      // In soft reset mode, a Manager reset (MgrHello) is handled by sending
+      // Hellos on the same link and reporting the link state to the callback
+      // instead of resetting the whole Serial Mux. Set before start().
+      void setSoftReset(bool softReset) { m_softReset = softReset; }
+
+      // impair the frames to and from Picard, NULL for none; the
+      // impairment is owned by the caller and outlives the Picard I/O
+      void setImpairment(CLinkImpairment* impairment) { m_impairment = impairment; }
+
+      // the Manager session reset on fatal link errors, NULL for none;
+      // set before start()
+      void setSession(IMuxSession* session) { m_session = session; }
+
+      // Returns: microseconds from start() to the Hello Response, 0 if there's
+      // no connection yet
+      uint64_t getTimeToConnect() const { return m_timeToConnect; }
+
+      // Returns: monotonic microseconds when the last input from Picard
+      // arrived, or when the Picard I/O started
+      uint64_t getLastInput() const;
+
       // -----------------------------------------------
       // base class interface methods
 
       virtual uint8_t sendCommand(const CMuxMessage& cmd, uint8_t& seqNo, bool retransmit);
       virtual void sendAck(uint8_t type, uint8_t seqNo);
+      // called from the command thread
+      virtual bool probe(int timeout);
 
       
-      // read loop for input from Picard
+      // read loop for input from Picard, for transports that poll
       void threadMain();
 
       // wait for a connection from Picard
@@ -66,35 +136,165 @@ namespace DustSerialMux {
       
       uint8_t getVersion() const { return m_protocolVersion; }
 
-      // callback for complete messsage from Picard
-      virtual void frameComplete(const ByteVector& packet);
+      // Returns: false if the transport does not use HDLC framing
+      bool getLinkStats(SHDLCStats& stats) const;
+
+      void logLinkStats(LogLevel level, const std::string& context) const;
+
+      // reliable notification counters since the last Hello Response
+      SNotifStats getNotifStats() const { return m_notifWindow.getStats(); }
+
+      void logNotifStats(LogLevel level, const std::string& context) const;
+
+      // callback for complete messsage from Picard, notifications are
+      // collected until flushNotifs()
+      void frameComplete(const uint8_t* frame, size_t len);
+
+      // pass on the notifications collected since the last call, called at
+      // the end of each read
+      void flushNotifs();
 
    protected:
       bool checkProtocol(uint8_t version);
       
       void sendHello(uint8_t seqNo);
 
-      virtual void sendRaw(const ByteVector& data) = 0;
+      // send a Hello while there's no connection to Picard
+      // Returns: whether a Hello was sent
+      bool sendHelloIfNeeded();
+
+      bool isRunning() const;
+
+      // (re)start sending Hellos after a soft reset, polled transports send
+      // them from threadMain
+      virtual void startHellos() { ; }
+
+      void createDecoder();
+
+      // fill in the Serial API header of a command, the sequence number is
+      // taken once for the whole frame
+      // Returns: the command's sequence number
+      uint8_t buildCommandHeader(const CMuxMessage& cmd, bool retransmit, uint8_t* header);
+
+      // send a Serial API frame, the caller owns the data
+      virtual void sendRaw(const uint8_t* data, size_t len) = 0;
+
+      // send the ACK frame for a reliable notification, transports that
+      // queue their output override this to send ACKs first
+      virtual void sendAckFrame(uint8_t type, uint8_t seqNo);
       
-      virtual void read(const std::string& context, int timeout) = 0;
+      // polled transports wait up to timeout milliseconds for input
+      virtual void read(const std::string& context, int timeout) { ; }
+
+      // handle a frame from Picard, after the impairment
+      void handleFrame(const uint8_t* frame, size_t len);
+
+      // pass on a frame that got through the impairment, after delay
+      // microseconds; the frames behind a delayed frame wait for it. Polled
+      // transports have a read thread of their own and stall it, transports
+      // that read on the io_service override this
+      virtual void receiveImpaired(const uint8_t* frame, size_t len, uint64_t delay);
+
+      // feed input from Picard to the HDLC decoder
+      void decode(const uint8_t* data, size_t len);
+
+      // record the arrival of input from Picard, once for each read
+      void inputReceived();
+
+      // reset the session this Picard I/O belongs to
+      void resetConnection();
+      void resetPicardConnection();
       
       // handler for input from Picard
       IPicardCallback* m_callback;
-      CHDLC* m_hdlc;
+      SReconnectPolicy m_reconnect;
+      // the decoder calls frameComplete directly, see decode()
+      typedef CHDLCDecoder<CBasePicardIO> Decoder;
+      Decoder* m_hdlc;
+      size_t m_maxFrameLen;
+      int    m_statsInterval;
+      CLinkImpairment* m_impairment;
+      IMuxSession*     m_session;
 
    private:
-      bool m_isRunning;
+      // soft reset: start a new session with the Manager on the same link
+      void restartSession();
+
+      void impairFrame(const uint8_t* frame, size_t len);
+
+      bool m_isRunning; // under m_connectMutex, stop() may be called from any thread
+      bool m_softReset;
 
       bool m_connected;
-      boost::mutex m_connectMutex;
+      mutable boost::mutex m_connectMutex;
       boost::condition_variable m_connect;
+      uint64_t m_startTime;     // monotonic microseconds
+      uint64_t m_timeToConnect; // microseconds
+      int      m_hellos;        // Hellos sent before the connection
+      uint32_t m_helloResponses; // good Hello Responses, for probe()
+      // read by the session thread, for its liveness check
+      mutable boost::mutex m_inputLock;
+      uint64_t m_lastInput;     // monotonic microseconds
 
       uint8_t m_protocolVersion;
-      uint8_t m_seqNo;    // next sequence number to send
-      uint8_t m_mgrSeqNo; // last sequence number received
+      // the sequence number is updated by the Picard read thread and read by
+      // the command thread, without a lock
+      CAtomicSeqNo m_seqNo;    // next sequence number to send
+      // reliable notifications received (the Manager's sequence numbers),
+      // only used by the read thread
+      CSeqWindow m_notifWindow;
+      // notifications of the current read, only used by the read thread
+      CNotifBatch m_notifs;
+      // frames completed since the first notification of the batch, the
+      // batch is passed on before the decoder reuses that frame
+      int m_batchFrames;
+      // received frame being impaired, only used by the read thread
+      ByteVector m_impairBuffer;
       
    };
 
+
+   /**
+    * Picard I/O with the transport resolved at compile time
+    *
+    * Transport derives from CPicardIO<Transport> and provides
+    *   void writeFrame(const uint8_t* header, size_t headerLen,
+    *                   const uint8_t* payload, size_t payloadLen)
+    * to send one Serial API frame given in two pieces. A command goes from
+    * the client's message to writeFrame without an intermediate copy or a
+    * virtual call, so the frame build, the HDLC encoding and the write can
+    * be inlined into sendCommand. The IPicardIO and CBasePicardIO virtual
+    * interfaces work as before: sendRaw passes its frame to writeFrame.
+    */
+   template <class Transport>
+   class CPicardIO : public CBasePicardIO {
+   public:
+      CPicardIO(size_t maxFrameLen = INPUT_BUFFER_LEN, int statsInterval = 0)
+         : CBasePicardIO(maxFrameLen, statsInterval)
+      { ; }
+
+      virtual uint8_t sendCommand(const CMuxMessage& cmd, uint8_t& seqNo, bool retransmit)
+      {
+         uint8_t header[SERIAL_API_HEADER_LEN];
+         uint8_t cmdSeqNo = buildCommandHeader(cmd, retransmit, header);
+         // set the sequence number for the caller before we write
+         // in case the response comes back *really* fast
+         seqNo = cmdSeqNo;
+         transport().writeFrame(header, SERIAL_API_HEADER_LEN,
+                                cmd.m_data.empty() ? NULL : &cmd.m_data[0], header[3]);
+         return cmdSeqNo;
+      }
+
+   protected:
+      virtual void sendRaw(const uint8_t* data, size_t len)
+      {
+         transport().writeFrame(data, len, NULL, 0);
+      }
+
+   private:
+      Transport& transport() { return static_cast<Transport&>(*this); }
+   };
+
 } // namespace DustSerialMux
 
 #endif  /* ! BasePicardIO_H_ */
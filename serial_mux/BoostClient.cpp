@@ -156,8 +156,8 @@ namespace DustSerialMux
 
       // first time: start an auth timeout timer
       m_authTimeout.expires_from_now(boost::posix_time::seconds(AUTH_TIMEOUT));
-      m_authTimeout.async_wait(boost::bind(&CBoostClient::handleAuthTimeout, this, 
-                                           boost::asio::placeholders::error));
+      m_authTimeout.async_wait(m_strand.wrap(boost::bind(&CBoostClient::handleAuthTimeout, this,
+                                                         boost::asio::placeholders::error)));
       
       asyncRead();
    }
@@ -166,9 +166,10 @@ namespace DustSerialMux
    void CBoostClient::asyncRead() 
    {
       m_socket.async_read_some(boost::asio::buffer(m_input),
-                               boost::bind(&CBoostClient::handle_read, shared_from_this(),
-                                           boost::asio::placeholders::error,
-                                           boost::asio::placeholders::bytes_transferred));
+                               m_strand.wrap(boost::bind(&CBoostClient::handle_read,
+                                                         shared_from_this(),
+                                                         boost::asio::placeholders::error,
+                                                         boost::asio::placeholders::bytes_transferred)));
    }
    
 
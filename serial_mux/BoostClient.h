@@ -16,6 +16,7 @@
 #include "SerialMuxOptions.h"  // for AUTHENTICATION_LEN
 
 #include "Subscriber.h"
+#include "IoStrand.h"
 
 #include <boost/smart_ptr.hpp>
 #include <boost/thread.hpp>
@@ -46,12 +47,13 @@ namespace DustSerialMux
    public:
       typedef boost::shared_ptr<CBoostClient> pointer;
       
-      static pointer create(boost::asio::io_service& io_service, 
+      // the client's handlers run on the listener's strand
+      static pointer create(CIoStrand& strand,
                             ISimpleClientList& clientMgr,
                             const uint8_t* authToken,
                             uint8_t protocolVersion)
       {
-         return pointer(new CBoostClient(io_service, clientMgr,
+         return pointer(new CBoostClient(strand, clientMgr,
                                          authToken, protocolVersion));
       }
 
@@ -95,18 +97,19 @@ namespace DustSerialMux
          CLOSED
       };
       
-      CBoostClient(boost::asio::io_service& io_service,
+      CBoostClient(CIoStrand& strand,
                    ISimpleClientList& clientMgr,
                    const uint8_t* authToken,
                    uint8_t protocolVersion)
-       : m_socket(io_service),
+       : m_strand(strand),
+         m_socket(strand.get_io_service()),
          m_initState(WAITING),
          m_parser((ICommandCallback*)this),
          m_clientMgr(clientMgr),
          m_expectedAuth(authToken),
          m_protocolVersion(protocolVersion),
          m_input(256),
-         m_authTimeout(io_service)
+         m_authTimeout(strand.get_io_service())
       { ; }
 
       bool badInit() const {
@@ -118,6 +121,7 @@ namespace DustSerialMux
       int parseHello(const ByteVector& data, int length);
       ByteVector buildHelloResponse(int result);
       
+      CIoStrand&  m_strand;
       tcp::socket m_socket;
       InitState   m_initState;
       CMuxParser  m_parser;
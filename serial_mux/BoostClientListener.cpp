@@ -10,7 +10,7 @@
 namespace DustSerialMux 
 {
 
-   CBoostClientListener::CBoostClientListener(boost::asio::io_service& io_svc,
+   CBoostClientListener::CBoostClientListener(CIoStrand& strand,
                                               uint16_t port, bool useLocalhost,
                                               ISimpleClientList& clients,
                                               const uint8_t* authToken,
@@ -19,7 +19,7 @@ namespace DustSerialMux
         m_isListening(false),
         m_clients(clients),
         m_protocolVersion(protocolVersion),
-        m_io_service(io_svc)
+        m_strand(strand)
    {
       if (useLocalhost) {
          m_listenerEndpoint = tcp::endpoint(boost::asio::ip::address_v4::loopback(), m_listenerPort);
@@ -27,7 +27,7 @@ namespace DustSerialMux
       else {
          m_listenerEndpoint = tcp::endpoint(tcp::v4(), m_listenerPort);
       }
-      m_acceptor = new tcp::acceptor(m_io_service, m_listenerEndpoint);
+      m_acceptor = new tcp::acceptor(m_strand.get_io_service(), m_listenerEndpoint);
 
       // the expected auth array is fixed size (pre-allocated)
       std::copy(authToken, authToken + AUTHENTICATION_LEN, 
@@ -70,13 +70,13 @@ namespace DustSerialMux
       CBoostLog::log("listening for connections");
 
       CBoostClient::pointer new_connection =
-         CBoostClient::create(m_acceptor->get_io_service(), m_clients,
+         CBoostClient::create(m_strand, m_clients,
                               m_expectedAuth, m_protocolVersion);
 
       m_acceptor->async_accept(new_connection->socket(),
-                               boost::bind(&CBoostClientListener::handleAccept, this,
-                                           new_connection,
-                                           boost::asio::placeholders::error));
+                               m_strand.wrap(boost::bind(&CBoostClientListener::handleAccept, this,
+                                                         new_connection,
+                                                         boost::asio::placeholders::error)));
    }
    
 } // namespace DustSerialMux
@@ -30,7 +30,8 @@ namespace DustSerialMux
    class CBoostClientListener 
    {
    public:
-      CBoostClientListener(boost::asio::io_service& io_svc, uint16_t port, bool useLocalhost,
+      // the listener's and its clients' handlers run on the strand
+      CBoostClientListener(CIoStrand& strand, uint16_t port, bool useLocalhost,
                            ISimpleClientList& clients, const uint8_t* authToken, uint8_t protocolVersion);
 
       virtual ~CBoostClientListener();
@@ -54,7 +55,7 @@ namespace DustSerialMux
       unsigned char         m_expectedAuth[AUTHENTICATION_LEN];
       uint8_t               m_protocolVersion;
       
-      boost::asio::io_service& m_io_service;
+      CIoStrand&            m_strand;
       tcp::endpoint         m_listenerEndpoint;
       tcp::acceptor*        m_acceptor;
    };
@@ -5,7 +5,6 @@
 #include "BoostClientManager.h"
 
 #include "BoostLog.h"
-#include "serial_mux.h"
 
 #include <algorithm>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -20,6 +19,10 @@ namespace DustSerialMux {
    CBoostClientManager::~CBoostClientManager()
    {
       // get rid of all clients and commands
+      if (m_escalationStats.commandFailures > 0) {
+         logEscalationStats(LOG_ALWAYS, "session");
+      }
+      m_rtt.logEstimates(LOG_ALWAYS, "session");
    }
    
    void CBoostClientManager::closeClients()
@@ -55,13 +58,30 @@ namespace DustSerialMux {
    }
 
    
+   void CBoostClientManager::setPicard(IPicardIO* picard)
+   {
+      boost::unique_lock<boost::mutex> lock(m_inProgressMutex);
+      while (m_probing) {
+         m_inProgress.wait(lock);
+      }
+      m_picard = picard;
+   }
+
    // main loop for processing commands
    void CBoostClientManager::commandLoop(IPicardIO* picard)
    {
+      setPicard(picard);
       m_isRunning = true;
+      uint64_t lastStats = monotonicMicroseconds();
       
       // process the queue until it's empty
       while (m_isRunning) {
+         if (m_statsInterval > 0 &&
+             monotonicMicroseconds() - lastStats >= (uint64_t)m_statsInterval * 1000000) {
+            m_rtt.logEstimates(LOG_ALWAYS, "periodic");
+            lastStats = monotonicMicroseconds();
+         }
+
          SClientCommand cmd;
          bool good = m_commands.timedPop(cmd, 1);
          if (!good) {
@@ -98,6 +118,15 @@ namespace DustSerialMux {
             sendResponse(cmd.client, resp, "CBoostClientManager::commandError");
             continue;
          }
+
+         // after a soft reset, the command is held for the new Manager session
+         // (the subscriptions are sent again when it starts)
+         if (!waitForLink()) {
+            if (cmd.client) {
+               commandTimeout(cmd.client, cmd.command.type(), ERR_COMMAND_TIMEOUT);
+            }
+            continue;
+         }
          
          // if this is a subscribe, then use the union of all subscriptions
          if (cmd.command.type() == SUBSCRIBE && cmd.client) {
@@ -121,30 +150,51 @@ namespace DustSerialMux {
          
          // keep the SClientCommand as state to know where to send the response
          m_currentCommand = cmd;
-
-         // wait for the command to complete or timeout
-         EClientResult result = CLIENT_TIMEOUT;
-         for (int i = 0; result == CLIENT_TIMEOUT && i < m_retries; i++) {
-            // send the command to Picard -- the last parameter is a flag indicating a retransmit
-            picard->sendCommand(cmd.command, m_currentCommand.seq, i != 0);
-
-            // wait for the command complete callback to set the semaphore
-            boost::unique_lock<boost::mutex> lock(m_inProgressMutex);
-            m_inProgress.timed_wait(lock, boost::posix_time::milliseconds(m_timeout));
-            result = m_currentCommand.result;
+         uint8_t cmdType = cmd.command.type();
+         EClientResult result = sendToPicard(cmd.command);
+
+         // the link went down while the command was in progress: a command
+         // that wasn't sent yet, or is idempotent, is held for the next session
+         while (result == CLIENT_LINK_DOWN &&
+                (m_currentCommand.sentTime == 0 || m_hold.isIdempotent(cmdType))) {
+            if (!waitForLink()) {
+               break;
+            }
+            std::ostringstream msg;
+            msg << "sending command " << (int)cmdType << " again after a link reset";
+            CBoostLog::log(LOG_ALWAYS, msg.str());
+            result = sendToPicard(cmd.command);
          }
-         // in both the timeout and disconnect cases, we want to send a
-         // timeout response to the client
+         
+         // in both the timeout and disconnect cases, we want to send an
+         // error response to the client
          if (result != CLIENT_OK && cmd.client) {
             if (cmd.command.type() == SUBSCRIBE) {
                // reset the filter union to its previous value
                m_filterUnion = m_prevfilter;
                cmd.client->resetFilter();
             }
-            commandTimeout(cmd.client, cmd.command.type(), ERR_COMMAND_TIMEOUT);
+            uint8_t respCode = ERR_COMMAND_TIMEOUT;
+            if (result == CLIENT_LINK_DOWN && m_currentCommand.sentTime != 0 &&
+                !m_hold.isIdempotent(cmdType)) {
+               std::ostringstream msg;
+               msg << "command " << (int)cmdType
+                   << " was in progress during a link reset, not sent again";
+               CBoostLog::log(LOG_ALWAYS, msg.str());
+               respCode = ERR_LINK_RESET;
+            }
+            commandTimeout(cmd.client, cmd.command.type(), respCode);
          }
          // reset the current command state (clear the client pointer)
          m_currentCommand = SClientCommand();
+
+         // if Picard isn't responding, escalate
+         if (result == CLIENT_OK) {
+            m_consecutiveFailures = 0;
+         }
+         else if (result == CLIENT_TIMEOUT) {
+            escalateFailure();
+         }
       }
    }
 
@@ -154,7 +204,7 @@ namespace DustSerialMux {
 
    // handle command response from Picard
    void CBoostClientManager::commandComplete(uint8_t cmdType, uint8_t seqNo, uint8_t respCode,
-                                             const ByteVector& response) 
+                                             const CByteView& response) 
    {
       // validate the response
       uint8_t expectedSeq = m_currentCommand.seq;
@@ -171,7 +221,7 @@ namespace DustSerialMux {
       std::ostringstream prefix;
       prefix << "CBoostClientManager::commandComplete: cmd=" << (int)cmdType
              << " resp=" << (int)respCode;
-      CBoostLog::logDump(prefix.str(), response);
+      CBoostLog::logDump(LOG_TRACE, prefix.str(), response.data(), response.size());
 
       if (cmdType == SUBSCRIBE && respCode != OK) {
          // reset the filter union to its previous value
@@ -181,10 +231,11 @@ namespace DustSerialMux {
       {
          boost::lock_guard<boost::mutex> lock(m_inProgressMutex);
          m_currentCommand.result = CLIENT_OK;
+         m_currentCommand.responseTime = monotonicMicroseconds();
          
          if (m_currentCommand.client) {
             // construct the response
-            CMuxOutput resp(cmdType, 0 /* id */, respCode, response);
+            CMuxOutput resp(cmdType, 0 /* id */, respCode, response.data(), response.size());
             sendResponse(m_currentCommand.client, resp, "CBoostClientManager::commandComplete");
             // moved inProgress post outside client check because client can be
             // null when sending re-subscribe due to removed client
@@ -201,26 +252,51 @@ namespace DustSerialMux {
 
    // handle notification from Picard
 
-   void CBoostClientManager::handleNotif(uint8_t notifType, const ByteVector& payload) 
+   // a burst of notifications takes the lock and walks the clients once,
+   // each client gets its notifications in one write
+   void CBoostClientManager::handleNotifs(const CNotifBatch& notifs) 
    {
-      std::ostringstream prefix;
-      prefix << "CBoostClientManager::handleNotif: type=" << (int)notifType;
-      CBoostLog::logDump(prefix.str(), payload);
+      if (CBoostLog::isEnabled(LOG_TRACE)) {
+         for (size_t i = 0; i < notifs.size(); i++) {
+            std::ostringstream prefix;
+            prefix << "CBoostClientManager::handleNotifs: type=" << (int)notifs[i].type;
+            CBoostLog::logDump(LOG_TRACE, prefix.str(), notifs[i].payload.data(),
+                               notifs[i].payload.size());
+         }
+      }
 
       {
          boost::mutex::scoped_lock guard(m_lock);
 
+         m_notifOutput.clear();
+         for (size_t i = 0; i < notifs.size(); i++) {
+            CMuxOutput notif(NOTIFICATION, 0 /* id */, notifs[i].type,
+                             notifs[i].payload.data(), notifs[i].payload.size());
+            ByteVector serialized = notif.serialize();
+            m_notifOutput.insert(m_notifOutput.end(), serialized.begin(), serialized.end());
+            m_notifEnd[i] = m_notifOutput.size();
+         }
+
          Clients::iterator iter;
          for (iter = m_clients.begin(); iter != m_clients.end(); ++iter) {
-            if ((*iter)->isSubscribed(notifType)) {
-               {
+            m_clientOutput.clear();
+            int count = 0;
+            for (size_t i = 0; i < notifs.size(); i++) {
+               if ((*iter)->isSubscribed(notifs[i].type)) {
+                  size_t start = (i == 0) ? 0 : m_notifEnd[i - 1];
+                  m_clientOutput.insert(m_clientOutput.end(), m_notifOutput.begin() + start,
+                                        m_notifOutput.begin() + m_notifEnd[i]);
+                  count++;
+               }
+            }
+            if (count > 0) {
+               if (CBoostLog::isEnabled(LOG_INFO)) {
                   std::ostringstream msg;
-                  msg << "CBoostClientManager::handleNotif: sending to "
-                      << (*iter)->remoteName();
+                  msg << "CBoostClientManager::handleNotifs: sending " << count
+                      << " notification(s) to " << (*iter)->remoteName();
                   CBoostLog::log(msg.str());
                }
-               CMuxOutput notif(NOTIFICATION, 0 /* id */, notifType, payload);
-               (*iter)->write(notif.serialize());
+               (*iter)->write(m_clientOutput);
                // TODO: handle write failure / exception ?
             }
          }
@@ -228,6 +304,51 @@ namespace DustSerialMux {
    }
 
 
+   // soft reset: called from the Picard read thread, and from the main loop
+   // while the Picard I/O is replaced
+   void CBoostClientManager::linkStateChanged(bool isUp)
+   {
+      {
+         boost::lock_guard<boost::mutex> lock(m_inProgressMutex);
+         if (isUp == m_linkUp) {
+            return;
+         }
+         m_linkUp = isUp;
+         if (!isUp) {
+            m_linkDownTime = boost::get_system_time();
+         }
+         // fail the command in progress, or release the commands waiting
+         m_inProgress.notify_all();
+      }
+
+      CBoostLog::log(LOG_ALWAYS, isUp ? "link to the Manager is up" :
+                     "link to the Manager is down");
+
+      if (isUp) {
+         // queue the subscriptions before the clients hear that the link is up
+         resubscribe();
+      }
+      sendLinkState(isUp ? LINK_UP : LINK_DOWN);
+   }
+
+   void CBoostClientManager::sessionRestarted()
+   {
+      CBoostLog::log(LOG_INFO, "new Serial API session, subscribing again");
+      resubscribe();
+   }
+
+   void CBoostClientManager::logEscalationStats(LogLevel level, const std::string& context) const
+   {
+      std::ostringstream msg;
+      msg << "command failure stats (" << context << "): failures="
+          << m_escalationStats.commandFailures
+          << " probes=" << m_escalationStats.probes
+          << " probe-failures=" << m_escalationStats.probeFailures
+          << " resets=" << m_escalationStats.resets;
+      CBoostLog::log(level, msg.str());
+   }
+
+
    // -------------------------------------------------------
    // internal (private) methods
 
@@ -329,9 +450,165 @@ namespace DustSerialMux {
       CMuxOutput resp(cmdType, 0 /* id */, respCode, dummy);
 
       sendResponse(client, resp, "CBoostClientManager::commandTimeout");
+   }
+
+   // Returns: whether the link to the Manager is up, waiting up to the
+   // command timeout for it to come back after a soft reset
+   // the hold time is counted from when the link went down, so a queue of
+   // commands isn't held for longer than a single one
+   bool CBoostClientManager::waitForLink()
+   {
+      boost::unique_lock<boost::mutex> lock(m_inProgressMutex);
+      boost::system_time timeout = m_linkDownTime +
+         boost::posix_time::milliseconds(m_hold.holdTime);
+      while (!m_linkUp && m_isRunning && m_inProgress.timed_wait(lock, timeout)) {
+         ;
+      }
+      return m_linkUp;
+   }
+
+   // the command is retransmitted after the timeout from the round trip
+   // times, until the time for all retries at the longest timeout is up
+   EClientResult CBoostClientManager::sendToPicard(const CMuxMessage& command)
+   {
+      uint8_t cmdType = command.type();
+      uint64_t deadline = monotonicMicroseconds() + (uint64_t)m_retries * m_timeout * 1000;
+      EClientResult result = CLIENT_TIMEOUT;
+      for (int i = 0; result == CLIENT_TIMEOUT && (i == 0 || monotonicMicroseconds() < deadline);
+           i++) {
+         uint64_t remaining = deadline - std::min(deadline, monotonicMicroseconds());
+         int attemptTimeout = (int)std::min<uint64_t>(m_rtt.timeout(cmdType),
+                                                      (remaining + 999) / 1000);
+
+         // the lock keeps the Picard I/O from being replaced during the send,
+         // the command complete callback waits for it
+         boost::unique_lock<boost::mutex> lock(m_inProgressMutex);
+         if (i == 0) {
+            // sentTime stays 0 if the command never reaches Picard
+            m_currentCommand.result = CLIENT_TIMEOUT;
+            m_currentCommand.sentTime = 0;
+         }
+         if (m_linkUp && m_picard != NULL) {
+            m_currentCommand.sentTime = monotonicMicroseconds();
+            // send the command to Picard -- the last parameter is a flag indicating a retransmit
+            m_picard->sendCommand(command, m_currentCommand.seq, i != 0);
+         }
+
+         // wait for the command complete callback to set the semaphore
+         boost::system_time timeout = boost::get_system_time() +
+            boost::posix_time::milliseconds(attemptTimeout);
+         while (m_currentCommand.result == CLIENT_TIMEOUT && m_linkUp &&
+                m_inProgress.timed_wait(lock, timeout)) {
+            ;
+         }
+         result = m_currentCommand.result;
+         if (result == CLIENT_TIMEOUT && !m_linkUp) {
+            result = CLIENT_LINK_DOWN;
+         }
+         else if (result == CLIENT_TIMEOUT) {
+            m_rtt.timedOut(cmdType);
+         }
+         else if (result == CLIENT_OK && i == 0) {
+            // a response after a retransmit may be for either attempt
+            m_rtt.sample(cmdType, m_currentCommand.responseTime - m_currentCommand.sentTime);
+         }
+      }
+      return result;
+   }
 
-      // if Picard isn't responding, disconnect
-      resetConnection();
+   // the Manager starts a new session without subscriptions
+   void CBoostClientManager::resubscribe()
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      if (m_filterUnion.filter != 0 || m_filterUnion.unreliable != 0) {
+         ByteVector payload(SUBSCRIBE_PARAMS_LENGTH);
+         filterToVector(m_filterUnion, payload);
+         addCommand(CBoostClient::pointer(), CMuxMessage(SUBSCRIBE, payload));
+      }
+   }
+
+   void CBoostClientManager::escalateFailure()
+   {
+      m_escalationStats.commandFailures++;
+      m_consecutiveFailures++;
+      {
+         // the link is already being reset
+         boost::lock_guard<boost::mutex> lock(m_inProgressMutex);
+         if (!m_linkUp) {
+            return;
+         }
+      }
+
+      std::ostringstream msg;
+      bool reset = false;
+      if (m_consecutiveFailures >= m_escalation.resetThreshold) {
+         msg << m_consecutiveFailures << " consecutive command failure(s)";
+         reset = true;
+      }
+      else if (m_escalation.probeTimeout > 0) {
+         m_escalationStats.probes++;
+         if (probeLink()) {
+            // the Hello started a new session, see sessionRestarted
+            CBoostLog::log(LOG_ALWAYS, "command failure: Picard answered the probe");
+         }
+         else {
+            m_escalationStats.probeFailures++;
+            msg << "command failure, no response to the probe";
+            reset = true;
+         }
+      }
+
+      if (reset) {
+         m_escalationStats.resets++;
+         m_consecutiveFailures = 0;
+         msg << ", resetting the connection to Picard";
+         CBoostLog::log(LOG_ALWAYS, msg.str());
+         logEscalationStats(LOG_ALWAYS, "reset");
+         resetPicardConnection();
+      }
+   }
+
+   // Returns: whether Picard answered a Hello
+   bool CBoostClientManager::probeLink()
+   {
+      IPicardIO* picard = NULL;
+      {
+         boost::lock_guard<boost::mutex> lock(m_inProgressMutex);
+         if (!m_linkUp || m_picard == NULL) {
+            return false;
+         }
+         picard = m_picard;
+         m_probing = true;
+      }
+
+      // the read thread takes m_inProgressMutex for late command responses,
+      // so the probe waits without it
+      bool answered = picard->probe(m_escalation.probeTimeout);
+
+      boost::lock_guard<boost::mutex> lock(m_inProgressMutex);
+      m_probing = false;
+      m_inProgress.notify_all();
+      return answered;
+   }
+
+   void CBoostClientManager::resetPicardConnection()
+   {
+      if (m_session) {
+         m_session->resetPicardConnection();
+      }
+   }
+
+   void CBoostClientManager::sendLinkState(ELinkState state)
+   {
+      ByteVector dummy;
+      CMuxOutput event(MUX_LINK_STATE, 0 /* id */, state, dummy);
+      ByteVector data = event.serialize();
+
+      boost::mutex::scoped_lock guard(m_lock);
+      Clients::iterator iter;
+      for (iter = m_clients.begin(); iter != m_clients.end(); ++iter) {
+         (*iter)->write(data);
+      }
    }
 
 } // namespace DustSerialMux
@@ -8,18 +8,22 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <list>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
 
 #include "Common.h"
+#include "BoostLog.h"
 
 #include "BoostClient.h"
 #include "PicardInterfaces.h"
 #include "MuxMessageParser.h"
 
+#include "RttEstimator.h"
 #include "SyncQueue.h"
+#include "serial_mux.h"
 
 
 namespace DustSerialMux {
@@ -28,20 +32,83 @@ namespace DustSerialMux {
       CLIENT_OK = 0,
       CLIENT_TIMEOUT,
       CLIENT_DISCONNECT,
+      CLIENT_LINK_DOWN,  // the Manager reset while the command was in progress
    };
    
    struct SClientCommand {
       SClientCommand() 
-         : client(), command(), seq(0), result(CLIENT_TIMEOUT)
+         : client(), command(), seq(0), result(CLIENT_TIMEOUT), sentTime(0), responseTime(0)
       { ; }
       SClientCommand(CBoostClient::pointer inClient, const CMuxMessage& inCmd)
-         : client(inClient), command(inCmd), seq(0), result(CLIENT_TIMEOUT)
+         : client(inClient), command(inCmd), seq(0), result(CLIENT_TIMEOUT),
+           sentTime(0), responseTime(0)
       { ; }
       
       CBoostClient::pointer client;
       CMuxMessage    command; // command data from client
       uint8_t        seq;     // message sequence number
       EClientResult  result;  // did we get a Picard response?
+      uint64_t       sentTime;     // monotonic microseconds, last attempt
+      uint64_t       responseTime; // monotonic microseconds
+   };
+
+
+   /**
+    * What to do when a command to Picard gets no response
+    *
+    * The command fails on its own first. The link is then probed with a
+    * Hello, and the connection is reset if the probe gets no response within
+    * probeTimeout milliseconds (0 to skip the probe), or after resetThreshold
+    * consecutive command failures.
+    */
+   struct SEscalationPolicy {
+      SEscalationPolicy(int threshold = 1, int probe = 0)
+         : resetThreshold(threshold), probeTimeout(probe)
+      { ; }
+
+      int resetThreshold;
+      int probeTimeout; // milliseconds
+   };
+
+   /**
+    * Client commands while the link to the Manager is down (soft reset)
+    *
+    * Queued commands wait up to holdTime milliseconds from when the link
+    * went down, and are sent once the new session is up. A command that was
+    * in progress when the link went down may or may not have been executed
+    * by the Manager: it's sent again only if its type is idempotent,
+    * otherwise it fails with ERR_LINK_RESET. Subscribe is always idempotent,
+    * the mux sends the union of the subscriptions.
+    */
+   struct SHoldPolicy {
+      explicit SHoldPolicy(int hold = 0)
+         : holdTime(hold)
+      {
+         memset(m_idempotent, 0, sizeof(m_idempotent));
+         setIdempotent(SUBSCRIBE);
+      }
+
+      void setIdempotent(uint8_t type) { m_idempotent[type / 32] |= 1u << (type % 32); }
+
+      bool isIdempotent(uint8_t type) const
+      {
+         return ((m_idempotent[type / 32] >> (type % 32)) & 1) != 0;
+      }
+
+      int holdTime; // milliseconds
+
+   private:
+      uint32_t m_idempotent[256 / 32]; // one bit per command type
+   };
+
+   // command failure counters, one per escalation level
+   struct SEscalationStats {
+      SEscalationStats() : commandFailures(0), probes(0), probeFailures(0), resets(0) { ; }
+
+      uint32_t commandFailures; // commands without a response
+      uint32_t probes;          // Hellos sent after a command failure
+      uint32_t probeFailures;   // probes without a response
+      uint32_t resets;          // connection resets
    };
 
 
@@ -53,18 +120,31 @@ namespace DustSerialMux {
       typedef std::list<CBoostClient::pointer> Clients;
       typedef CSyncQueue<SClientCommand> Commands;
    public:
-      CBoostClientManager(int retries, int timeout) 
+      // the time to wait for a response adapts to the round trip time of
+      // the commands, between minTimeout and timeout milliseconds
+      CBoostClientManager(int retries, int timeout, int minTimeout,
+                          const SEscalationPolicy& escalation = SEscalationPolicy())
          : m_lock(), 
            m_inProgressMutex(), 
            m_inProgress(), 
            m_isRunning(false),
+           m_picard(NULL),
+           m_linkUp(true),
+           m_linkDownTime(),
            // m_clients
            // m_commands
            m_filterUnion(),
            m_prevfilter(),
            m_currentCommand(),
            m_retries(retries),
-           m_timeout(timeout)
+           m_timeout(timeout),
+           m_rtt(minTimeout, timeout),
+           m_statsInterval(0),
+           m_escalation(escalation),
+           m_consecutiveFailures(0),
+           m_probing(false),
+           m_hold(),
+           m_session(NULL)
       { 
       }
 
@@ -73,6 +153,23 @@ namespace DustSerialMux {
       // main loop for processing commands
       void commandLoop(IPicardIO* picard);
 
+      // seconds between command statistics log messages, 0 to disable,
+      // set before commandLoop()
+      void setStatsInterval(int seconds) { m_statsInterval = seconds; }
+
+      // commands while the link is down after a soft reset, set before
+      // commandLoop()
+      void setHoldPolicy(const SHoldPolicy& hold) { m_hold = hold; }
+
+      // the Manager session reset after repeated command failures, set
+      // before commandLoop()
+      void setSession(IMuxSession* session) { m_session = session; }
+
+      // replace the Picard I/O the commands are sent to, while the command
+      // loop is running, after a soft reset. Call linkStateChanged(false)
+      // first, no commands are sent until the link is up again.
+      void setPicard(IPicardIO* picard);
+
       void closeClients();
 
       void stop();
@@ -89,9 +186,20 @@ namespace DustSerialMux {
       // methods for handling data from Picard
 
       virtual void commandComplete(uint8_t cmdType, uint8_t seqNo, uint8_t respCode,
-                                   const ByteVector& response);
+                                   const CByteView& response);
+
+      virtual void handleNotifs(const CNotifBatch& notifs);
+
+      virtual void linkStateChanged(bool isUp);
+
+      // the subscriptions are sent again
+      virtual void sessionRestarted();
+
+      // only valid from the command thread, or once it's stopped
+      const SEscalationStats& getEscalationStats() const { return m_escalationStats; }
+      const CRttEstimator& getRttEstimator() const { return m_rtt; }
 
-      virtual void handleNotif(uint8_t notifType, const ByteVector& payload);
+      void logEscalationStats(LogLevel level, const std::string& context) const;
 
    private:
       void commandTimeout(CBoostClient::pointer client, uint8_t cmdType, uint8_t respCode);
@@ -100,6 +208,24 @@ namespace DustSerialMux {
 
       bool recomputeSubscribeFilter();
 
+      // wait until the link is up, or the hold time is over
+      // Returns: whether the link is up
+      bool waitForLink();
+
+      // send the current command to Picard and wait for the response,
+      // with retransmissions
+      EClientResult sendToPicard(const CMuxMessage& command);
+
+      void sendLinkState(ELinkState state);
+
+      // queue a subscribe with the filter union for a new Manager session
+      void resubscribe();
+
+      // handle a command without a response, see SEscalationPolicy
+      void escalateFailure();
+      bool probeLink();
+      void resetPicardConnection();
+
       // lock access to the client list
       boost::mutex  m_lock;
       
@@ -108,6 +234,11 @@ namespace DustSerialMux {
       boost::condition_variable  m_inProgress; 
 
       bool m_isRunning;
+
+      // the Picard I/O and the link state are protected by m_inProgressMutex
+      IPicardIO* m_picard;
+      bool       m_linkUp;
+      boost::system_time m_linkDownTime;
       
       // client data structures
       Clients  m_clients;
@@ -115,11 +246,30 @@ namespace DustSerialMux {
       SubscriptionParams m_filterUnion; // union of all client subscriptions
       SubscriptionParams m_prevfilter;  // previous filter, used for resetting subscriptions on error
 
+      // a batch of notifications serialized once for all clients, and the
+      // output for one client, protected by m_lock
+      ByteVector m_notifOutput;
+      size_t     m_notifEnd[CNotifBatch::MAX_NOTIFS]; // end of each notification
+      ByteVector m_clientOutput;
+
       // fields to hold temporary state
       SClientCommand  m_currentCommand; // current command sent to Picard
 
       int m_retries;  // number of times to retry a command to Picard
-      int m_timeout;  // time to wait for a response from Picard
+      int m_timeout;  // longest time to wait for a response from Picard
+      // attempts are spread over retries x timeout, with a timeout
+      // from the command round trip times, only used by the command thread
+      CRttEstimator m_rtt;
+      int m_statsInterval;
+
+      // only used by the command thread
+      SEscalationPolicy m_escalation;
+      SEscalationStats  m_escalationStats;
+      int  m_consecutiveFailures;
+      // a probe is in progress, the Picard I/O must not be replaced
+      bool m_probing;
+      SHoldPolicy m_hold;
+      IMuxSession* m_session;
    };
 
 } // namespace DustSerialMux
@@ -6,6 +6,14 @@
 #include "Common.h"
 #include "Version.h"
 
+#ifdef WIN32
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
 namespace DustSerialMux {
 
    bool isPicardApiCommand(uint8_t type)
@@ -28,6 +36,30 @@ namespace DustSerialMux {
       return data;
    }   
 
+   uint64_t monotonicMicroseconds()
+   {
+#ifdef WIN32
+      static LARGE_INTEGER frequency = { 0 };
+      if (frequency.QuadPart == 0) {
+         QueryPerformanceFrequency(&frequency);
+      }
+      LARGE_INTEGER now;
+      QueryPerformanceCounter(&now);
+      return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 +
+         (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#elif defined(__APPLE__)
+      static mach_timebase_info_data_t timebase = { 0, 0 };
+      if (timebase.denom == 0) {
+         mach_timebase_info(&timebase);
+      }
+      return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+   }
+
    
    void filterToVector(SubscriptionParams params, std::vector<uint8_t>& data)
    {
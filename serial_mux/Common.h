@@ -25,6 +25,14 @@ namespace DustSerialMux {
    enum EMuxCommands {
       MUX_HELLO = 1,
       MUX_INFO = 2,
+      MUX_LINK_STATE = 3, // event to the clients, see ELinkState
+   };
+
+   // link state event: the state of the Serial API session to the Manager
+   // is sent in the response code field
+   enum ELinkState {
+      LINK_DOWN = 0,
+      LINK_UP = 1,
    };
 
    enum ErrorCode {
@@ -34,6 +42,8 @@ namespace DustSerialMux {
       ERR_INVALID_AUTH = 3,
       ERR_UNSUPPORTED_VERSION = 4,
       ERR_COMMAND_TIMEOUT = 5,
+      ERR_LINK_RESET = 6, // the Manager reset while the command was in progress,
+                          // it may or may not have been executed
    };
 
 #define ARRAY_LEN(ary) (sizeof(ary)/sizeof(ary[0]))
@@ -46,6 +56,10 @@ namespace DustSerialMux {
    bool isPicardApiCommand(uint8_t type);
 
    ByteVector muxInfoPayload(uint8_t protocolVersion);
+
+   // microseconds from an arbitrary starting point, never goes backwards
+   // (unlike the wall clock), for measuring intervals
+   uint64_t monotonicMicroseconds();
    
    
    // Common operations on the subscription filter
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2011, Dust Networks Inc.
+ */
+
+#include "FCS16.h"
+
+#include <boost/preprocessor/repetition/enum.hpp>
+
+
+// Compile-time table generation
+//
+// Fcs16Byte<crc, bits> shifts 'bits' bits through the FCS register
+// Fcs16Slice<k, i> is the FCS of byte i followed by k zero bytes
+
+template <uint32_t crc, int bits>
+struct Fcs16Byte {
+   enum { value = Fcs16Byte<(crc & 1) ? ((crc >> 1) ^ FCS16_POLY) : (crc >> 1),
+                            bits - 1>::value };
+};
+
+template <uint32_t crc>
+struct Fcs16Byte<crc, 0> {
+   enum { value = crc };
+};
+
+template <int k, uint32_t i>
+struct Fcs16Slice {
+   enum { prev  = Fcs16Slice<k - 1, i>::value,
+          value = (prev >> 8) ^ Fcs16Slice<0, prev & 0xFF>::value };
+};
+
+template <uint32_t i>
+struct Fcs16Slice<0, i> {
+   enum { value = Fcs16Byte<i, 8>::value };
+};
+
+#define FCS16_ENTRY(z, i, k)  Fcs16Slice<k, i>::value
+#define FCS16_SLICE(z, k, _)  { BOOST_PP_ENUM(256, FCS16_ENTRY, k) }
+
+const uint16_t FCS16_TABLE[FCS16_SLICES][256] = {
+   BOOST_PP_ENUM(8, FCS16_SLICE, ~)
+};
+
+#undef FCS16_SLICE
+#undef FCS16_ENTRY
+
+
+/**
+ * Update the FCS with a block of data
+ *
+ * Processes 8 bytes per step: the current FCS is folded into the first two
+ * bytes and each byte is looked up in the table for its distance from the
+ * end of the block. The lookups are independent of each other.
+ */
+uint16_t CFcs16::update(uint16_t fcs, const uint8_t* data, size_t len)
+{
+   uint32_t crc = fcs;
+   while (len >= 8) {
+      crc ^= data[0] | (data[1] << 8);
+      crc = FCS16_TABLE[7][crc & 0xFF] ^ FCS16_TABLE[6][crc >> 8] ^
+         FCS16_TABLE[5][data[2]] ^ FCS16_TABLE[4][data[3]] ^
+         FCS16_TABLE[3][data[4]] ^ FCS16_TABLE[2][data[5]] ^
+         FCS16_TABLE[1][data[6]] ^ FCS16_TABLE[0][data[7]];
+      data += 8;
+      len -= 8;
+   }
+   while (len-- > 0) {
+      crc = (crc >> 8) ^ FCS16_TABLE[0][(crc ^ *data++) & 0xFF];
+   }
+   return (uint16_t)crc;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2011, Dust Networks Inc.
+ */
+#pragma once
+
+#ifndef FCS16_H_
+#define FCS16_H_
+
+/*
+ * HDLC FCS-16 (RFC 1662) calculation
+ *
+ * The lookup tables are generated by the compiler from the polynomial, so
+ * there's no hand-maintained table to get wrong. Table 0 is the classic
+ * byte-at-a-time table, tables 1-7 are used to process 8 bytes per step
+ * (slicing-by-8), which removes most of the dependency between lookups.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+
+// reversed CCITT polynomial used by HDLC
+const uint16_t FCS16_POLY = 0x8408;
+// initial FCS value
+const uint16_t FCS16_INIT = 0xFFFF;
+// FCS remainder over a frame that includes a valid FCS
+const uint16_t FCS16_GOOD = 0xF0B8;
+
+const int FCS16_SLICES = 8;
+
+// FCS16_TABLE[k][i] is the FCS of byte i followed by k zero bytes
+extern const uint16_t FCS16_TABLE[FCS16_SLICES][256];
+
+
+/**
+ * Incremental FCS-16 calculation
+ *
+ * Usage:
+ *   uint16_t fcs = CFcs16::init();
+ *   fcs = CFcs16::update(fcs, data, len);   // as many times as needed
+ *   uint16_t result = CFcs16::close(fcs);
+ */
+class CFcs16 {
+public:
+   static uint16_t init() { return FCS16_INIT; }
+
+   static uint16_t update(uint16_t fcs, uint8_t byte)
+   {
+      return (fcs >> 8) ^ FCS16_TABLE[0][(fcs ^ byte) & 0xFF];
+   }
+
+   // update the FCS with a block of data
+   static uint16_t update(uint16_t fcs, const uint8_t* data, size_t len);
+
+   static uint16_t close(uint16_t fcs) { return fcs ^ 0xFFFF; }
+
+   // whether the running FCS (including the received FCS bytes) is valid
+   static bool isGood(uint16_t fcs) { return fcs == FCS16_GOOD; }
+};
+
+
+#endif /* ! FCS16_H_ */
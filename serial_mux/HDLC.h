@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2010, Dust Networks Inc. 
+ * Copyright (c) 2010, Dust Networks Inc.
  */
 #pragma once
 
@@ -10,38 +10,184 @@
  * HDLC Parser and Generator
  */
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <vector>
 
+#include "FCS16.h"
+
+
+/**
+ * HDLC Constants
+ */
+struct SHDLC {
+   enum {
+      PADDING = 0x7E,   // frame delimiter
+      ESCCHAR = 0x7D,   // escape character
+      XORBYTE = 0x20,   // escaped characters are XOR'd with this
+      FCS_LEN = 2,      // length of the FCS at the end of each frame
+   };
+};
+
 
 /**
  * HDLC packet generator
  */
 std::vector<unsigned char> encodeHDLC(const std::vector<uint8_t>& src);
 
+/**
+ * Worst case encoded length: every byte (including the FCS) escaped,
+ * plus the opening and closing flags
+ */
+inline size_t maxEncodedHDLC(size_t len) { return 2 * len + 6; }
+
+/**
+ * HDLC packet generator, no allocation
+ * dst must hold at least maxEncodedHDLC(len) bytes
+ * Returns: length of the encoded data
+ */
+size_t encodeHDLC(const uint8_t* src, size_t len, uint8_t* dst);
+
 /**
  * HDLC FCS calculation
  */
 uint16_t computeFCS16(const std::vector<uint8_t>& data);
+uint16_t computeFCS16(const uint8_t* data, size_t len);
+
+/**
+ * Returns: the index of the first flag or escape character, or len if none
+ */
+size_t findHDLCSpecial(const uint8_t* data, size_t len);
+
+
+/**
+ * HDLC encoder for a frame built from several pieces
+ *
+ * Encodes into a caller-provided buffer as the pieces are appended, so a
+ * frame header and its payload don't have to be copied into one buffer
+ * first. Runs of plain bytes are copied and added to the FCS in bulk,
+ * special characters are escaped one at a time. The encoder is inline, a
+ * transport that knows its frame layout at compile time gets the whole
+ * build and encode path in one function.
+ *
+ * dst must hold at least maxEncodedHDLC() of the total appended length.
+ */
+class CHDLCEncoder {
+public:
+   explicit CHDLCEncoder(uint8_t* dst)
+      : m_dst(dst), m_out(dst), m_fcs(CFcs16::init())
+   {
+      *m_out++ = SHDLC::PADDING;
+   }
+
+   void append(uint8_t b)
+   {
+      m_fcs = CFcs16::update(m_fcs, b);
+      escape(b);
+   }
+
+   void append(const uint8_t* src, size_t len)
+   {
+      while (len > 0) {
+         size_t run = findHDLCSpecial(src, len);
+         if (run > 0) {
+            memcpy(m_out, src, run);
+            m_fcs = CFcs16::update(m_fcs, src, run);
+            m_out += run;
+            src += run;
+            len -= run;
+            if (len == 0) {
+               break;
+            }
+         }
+         append(*src++);
+         len--;
+      }
+   }
+
+   // append the FCS and the closing flag
+   // Returns: length of the encoded frame
+   size_t finish()
+   {
+      // the FCS is sent least significant byte first
+      uint16_t fcs = CFcs16::close(m_fcs);
+      escape(fcs & 0xFF);
+      escape((fcs >> 8) & 0xFF);
+      *m_out++ = SHDLC::PADDING;
+      return m_out - m_dst;
+   }
+
+private:
+   // inserts an escape character before special characters
+   void escape(uint8_t b)
+   {
+      if (b == SHDLC::PADDING || b == SHDLC::ESCCHAR) {
+         *m_out++ = SHDLC::ESCCHAR;
+         *m_out++ = b ^ SHDLC::XORBYTE;
+      } else {
+         *m_out++ = b;
+      }
+   }
+
+   uint8_t* m_dst;
+   uint8_t* m_out;
+   uint16_t m_fcs;
+};
 
 // TODO: needs a better name
 class IHDLCParser {
 public:
-   virtual void frameComplete(const std::vector<uint8_t>& packet) = 0;
+   // The frame is lent by the parser from its frame pool: it stays valid
+   // until the parser has completed (poolSize - 1) more frames.
+   virtual void frameComplete(const uint8_t* frame, size_t len) = 0;
 };
 
 
-// TODO: I don't know how to make this part of the CHDLC class
-//enum ParseState {
-//   HDLC_PACKET_COMPLETE,
-//   HDLC_DATA,
-//   HDLC_ESCAPE,
-//};
-//#define HDLC_PADDING         0x7E
-//#define HDLC_ESCCHAR         0x7D
-//#define HDLC_XORBYTE         0x20
-//#define CRC_MAGIC_NUMBER     0xF0B8
+/**
+ * HDLC link statistics
+ *
+ * Counters are updated by the parser thread; a copy taken from another
+ * thread is not an atomic snapshot, but each counter is consistent.
+ */
+struct SHDLCStats {
+   // log2 buckets of frame length: [1], [2,3], [4,7], ... [1024,)
+   static const int SIZE_BUCKETS = 11;
 
-class CHDLC {
+   SHDLCStats();
+
+   uint32_t goodFrames;      // frames passed to the handler
+   uint32_t fcsErrors;       // frames dropped because of a bad FCS
+   uint32_t runtFrames;      // frames too short to hold an FCS
+   uint32_t oversizeFrames;  // frames longer than the maximum frame length
+   uint32_t aborts;          // frames dropped by an abort sequence (escape, flag)
+   uint64_t bytesReceived;   // all input, including flags and escapes
+   uint64_t escapeBytes;     // escape characters in the input
+   uint64_t discardedBytes;  // input that was part of a dropped frame
+   uint32_t sizeHistogram[SIZE_BUCKETS]; // length of good frames (without FCS)
+
+   // escape characters per received byte
+   double escapeOverhead() const;
+
+   static int sizeBucket(size_t len);
+};
+
+
+/**
+ * HDLC decoder
+ *
+ * Handler: receives the decoded frames through a (non-virtual) call to
+ *   void frameComplete(const uint8_t* frame, size_t len)
+ *   The frame is lent from the decoder's pool, see IHDLCParser.
+ * MaxFrame: largest frame (without FCS) the decoder accepts, or 0 to set
+ *   the limit at construction. Longer frames are discarded.
+ * CrcPolicy: FCS calculation, provides init(), update() for a byte and for
+ *   a block, and isGood() for the FCS over a frame including its FCS
+ *
+ * All the calls are resolved at compile time, so the state machine, the FCS
+ * and the handler can be inlined into the code that feeds the decoder.
+ */
+template <typename Handler, size_t MaxFrame = 0, typename CrcPolicy = CFcs16>
+class CHDLCDecoder {
    enum ParseState {
       HDLC_PACKET_COMPLETE,
       HDLC_DATA,
@@ -49,24 +195,228 @@ class CHDLC {
    };
 
 public:
-   CHDLC(int inputLength, IHDLCParser* handler) 
-      : m_buffer(inputLength),
-        m_handler(handler)
-   { reset(); }
+   static const int DEFAULT_FRAME_POOL_SIZE = 4;
+
+   CHDLCDecoder(Handler* handler, size_t maxFrameLen = MaxFrame,
+                int poolSize = DEFAULT_FRAME_POOL_SIZE)
+      : m_handler(handler),
+        m_state(HDLC_PACKET_COMPLETE),
+        m_capacity((MaxFrame ? MaxFrame : maxFrameLen) + SHDLC::FCS_LEN),
+        m_poolSize(poolSize > 0 ? poolSize : 1),
+        m_pool(m_poolSize * m_capacity),
+        m_current(0),
+        m_frame(&m_pool[0]),
+        m_frameLen(0),
+        m_oversize(false),
+        m_runningFCS(CrcPolicy::init()),
+        m_frameBytes(0),
+        m_stats()
+   { ; }
+
+   // State transitions:
+   // PACKET_COMPLETE (ESC) -> HDLC_ESCAPE
+   // PACKET_COMPLETE (PAD) -> PACKET_COMPLETE, (callback)
+   // PACKET_COMPLETE (any) -> HDLC_DATA, append
+
+   // HDLC_DATA (ESC) -> HDLC_ESCAPE
+   // HDLC_DATA (PAD) -> PACKET_COMPLETE, callback
+   // HDLC_DATA (any) -> HDLC_DATA, append
+
+   // HDLC_ESCAPE (PAD) -> PACKET_COMPLETE, abort
+   // HDLC_ESCAPE (any) -> HDLC_DATA, append
+   void addByte(uint8_t b)
+   {
+      m_stats.bytesReceived++;
+      if (m_state == HDLC_ESCAPE) {
+         if (b == SHDLC::PADDING) {
+            abort();
+            return;
+         }
+         append(b ^ SHDLC::XORBYTE);
+         m_frameBytes++;
+         m_state = HDLC_DATA;
+      }
+      else if (b == SHDLC::ESCCHAR) {
+         m_stats.escapeBytes++;
+         m_frameBytes++;
+         m_state = HDLC_ESCAPE;
+      }
+      else if (b == SHDLC::PADDING) {
+         endFrame();
+      } else {
+         append(b);
+         m_frameBytes++;
+      }
+   }
+
+   // Add a block of input
+   //
+   // Equivalent to calling addByte for each byte: the runs of plain data
+   // between special characters are appended (and added to the FCS) in bulk,
+   // the special characters go through the addByte state machine.
+   void addBytes(const uint8_t* data, size_t len)
+   {
+      while (len > 0) {
+         // the byte after an escape is never the start of a plain run
+         if (m_state != HDLC_ESCAPE) {
+            size_t run = findHDLCSpecial(data, len);
+            if (run > 0) {
+               appendRun(data, run);
+               m_stats.bytesReceived += run;
+               m_frameBytes += run;
+               data += run;
+               len -= run;
+               if (len == 0) {
+                  break;
+               }
+            }
+         }
+         addByte(*data++);
+         len--;
+      }
+   }
+
+   size_t getMaxFrameLen() const { return capacity() - SHDLC::FCS_LEN; }
 
-   void addByte(uint8_t b);
+   const SHDLCStats& getStats() const { return m_stats; }
 
 private:
-   bool validateChecksum(uint16_t frameFcs);
-   void append(uint8_t byte);
-   void callback();
-   void reset();
+   // max frame length including FCS, a constant if MaxFrame is set
+   size_t capacity() const { return MaxFrame ? MaxFrame + SHDLC::FCS_LEN : m_capacity; }
 
-   IHDLCParser* m_handler;
+   // the frame buffers never grow: input past the capacity marks the frame
+   // as oversize and it's discarded at the next flag
+   void append(uint8_t byte)
+   {
+      if (!m_oversize && m_frameLen < capacity()) {
+         m_frame[m_frameLen++] = byte;
+         m_runningFCS = CrcPolicy::update(m_runningFCS, byte);
+      } else {
+         m_oversize = true;
+      }
+   }
+
+   void appendRun(const uint8_t* data, size_t len)
+   {
+      if (!m_oversize && m_frameLen + len <= capacity()) {
+         memcpy(m_frame + m_frameLen, data, len);
+         m_frameLen += len;
+         m_runningFCS = CrcPolicy::update(m_runningFCS, data, len);
+      } else {
+         m_oversize = true;
+      }
+   }
+
+   // closing flag: validate the frame and pass it on
+   void endFrame()
+   {
+      if (m_oversize) {
+         // the frame was truncated, there's nothing to validate
+         m_stats.oversizeFrames++;
+         discard();
+      }
+      else if (m_frameLen > SHDLC::FCS_LEN) {
+         if (CrcPolicy::isGood(m_runningFCS)) {
+            m_stats.goodFrames++;
+            m_stats.sizeHistogram[SHDLCStats::sizeBucket(m_frameLen - SHDLC::FCS_LEN)]++;
+            callback();
+         } else {
+            m_stats.fcsErrors++;
+            discard();
+         }
+      }
+      else if (m_frameBytes > 0) {
+         // small packets are dropped
+         m_stats.runtFrames++;
+         discard();
+      }
+      // back-to-back flags are not counted
+      reset();
+   }
+
+   // abort sequence: the frame is dropped, the flag opens the next one
+   void abort()
+   {
+      m_stats.aborts++;
+      discard();
+      reset();
+   }
+
+   // lend the completed frame to the handler and move on to the next buffer
+   // in the pool, so the handler may hold on to the frame for a while
+   void callback()
+   {
+      if (m_handler) {
+         m_handler->frameComplete(m_frame, m_frameLen - SHDLC::FCS_LEN);
+         m_current = (m_current + 1) % m_poolSize;
+         m_frame = &m_pool[m_current * capacity()];
+      }
+   }
+
+   void discard() { m_stats.discardedBytes += m_frameBytes; }
+
+   void reset()
+   {
+      m_frameBytes = 0;
+      m_state = HDLC_PACKET_COMPLETE;
+      m_frameLen = 0;
+      m_oversize = false;
+      m_runningFCS = CrcPolicy::init();
+   }
+
+   Handler*     m_handler;
 
    ParseState   m_state;
-   std::vector<uint8_t> m_buffer;
-   uint32_t     m_runningFCS;
+   size_t       m_capacity;  // max frame length including FCS
+   // frames are decoded in place into a fixed set of buffers that never grow
+   size_t       m_poolSize;
+   std::vector<uint8_t> m_pool;
+   size_t       m_current;   // index of the frame being decoded
+   uint8_t*     m_frame;
+   size_t       m_frameLen;
+   bool         m_oversize;  // the current frame is being discarded
+   uint16_t     m_runningFCS;
+   size_t       m_frameBytes; // input bytes since the last flag
+
+   SHDLCStats   m_stats;
+};
+
+
+/**
+ * HDLC parser with a run-time frame limit and an IHDLCParser handler
+ */
+class CHDLC {
+public:
+   static const int DEFAULT_FRAME_POOL_SIZE = 4;
+
+   // maxFrameLen is the largest frame (without FCS) the parser accepts,
+   // longer frames are discarded
+   CHDLC(size_t maxFrameLen, IHDLCParser* handler,
+         int poolSize = DEFAULT_FRAME_POOL_SIZE)
+      : m_handler(handler), m_decoder(this, maxFrameLen, poolSize) { ; }
+
+   void addByte(uint8_t b) { m_decoder.addByte(b); }
+
+   // add a block of input, same result as addByte for each byte
+   void addBytes(const uint8_t* data, size_t len) { m_decoder.addBytes(data, len); }
+
+   static size_t findSpecial(const uint8_t* data, size_t len) { return findHDLCSpecial(data, len); }
+
+   size_t getMaxFrameLen() const { return m_decoder.getMaxFrameLen(); }
+
+   const SHDLCStats& getStats() const { return m_decoder.getStats(); }
+
+   // decoder callback
+   void frameComplete(const uint8_t* frame, size_t len)
+   {
+      if (m_handler) {
+         m_handler->frameComplete(frame, len);
+      }
+   }
+
+private:
+   IHDLCParser* m_handler;
+   CHDLCDecoder<CHDLC> m_decoder;
 };
 
 
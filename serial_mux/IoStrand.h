@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef IoStrand_H_
+#define IoStrand_H_
+
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+
+namespace DustSerialMux {
+
+   class CIoStrand;
+
+   /**
+    * A completion handler that runs on a CIoStrand, see CIoStrand::wrap
+    *
+    * Unlike strand::wrap, the handler doesn't forward the handler hooks:
+    * the intermediate steps of a composed operation (async_write,
+    * async_read) would run outside the strand. Operations that use it
+    * continue themselves from the handler, e.g. with async_write_some.
+    */
+   template <typename Handler>
+   class CStrandHandler {
+   public:
+      CStrandHandler(CIoStrand* strand, const Handler& handler)
+         : m_strand(strand), m_handler(handler)
+      { ; }
+
+      void operator()();
+
+      template <typename Arg1>
+      void operator()(const Arg1& arg1);
+
+      template <typename Arg1, typename Arg2>
+      void operator()(const Arg1& arg1, const Arg2& arg2);
+
+   private:
+      CIoStrand* m_strand;
+      Handler    m_handler;
+   };
+
+
+   /**
+    * The completion handlers of one component on the shared io_service
+    *
+    * The io_service is run by a pool of threads, serving all the Manager
+    * sessions. The handlers of a component run one at a time, in the order
+    * they were dispatched, like they did on a single I/O thread. The
+    * handlers are counted until they have run: the component cancels its
+    * operations and waits for waitIdle() before it is deleted, which does
+    * not stop the io_service for the other sessions.
+    */
+   class CIoStrand {
+   public:
+      explicit CIoStrand(boost::asio::io_service& io_service)
+         : m_io_service(io_service), m_strand(io_service), m_lock(), m_idle(), m_pending(0)
+      { ; }
+
+      boost::asio::io_service& get_io_service() { return m_io_service; }
+
+      // the handler of an asynchronous operation, the operation must
+      // complete (or be cancelled) for the handler to run
+      template <typename Handler>
+      CStrandHandler<Handler> wrap(const Handler& handler)
+      {
+         started();
+         return CStrandHandler<Handler>(this, handler);
+      }
+
+      // run the handler on the strand, may be called from any thread
+      template <typename Handler>
+      void post(const Handler& handler)
+      {
+         started();
+         m_strand.post(SCall<Handler>(this, handler));
+      }
+
+      // wait until the wrapped and posted handlers have run
+      void waitIdle()
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         while (m_pending > 0) {
+            m_idle.wait(guard);
+         }
+      }
+
+      // Returns: the handlers that haven't run yet
+      int getPending() const
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         return m_pending;
+      }
+
+   private:
+      template <typename Handler> friend class CStrandHandler;
+
+      // a handler on the strand, counted as done even if it throws
+      template <typename Handler>
+      struct SCall {
+         SCall(CIoStrand* strand, const Handler& handler)
+            : strand(strand), handler(handler)
+         { ; }
+
+         void operator()()
+         {
+            SDone done(strand);
+            handler();
+         }
+
+         CIoStrand* strand;
+         Handler    handler;
+      };
+
+      struct SDone {
+         explicit SDone(CIoStrand* strand) : strand(strand) { ; }
+         ~SDone() { strand->completed(); }
+         CIoStrand* strand;
+      };
+
+      // an operation completed, its handler runs on the strand
+      template <typename Handler>
+      void dispatch(const Handler& handler)
+      {
+         m_strand.dispatch(SCall<Handler>(this, handler));
+      }
+
+      void started()
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         m_pending++;
+      }
+
+      void completed()
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         if (--m_pending == 0) {
+            m_idle.notify_all();
+         }
+      }
+
+      boost::asio::io_service& m_io_service;
+      boost::asio::io_service::strand m_strand;
+      mutable boost::mutex m_lock;
+      boost::condition_variable m_idle;
+      int m_pending;
+   };
+
+
+   template <typename Handler>
+   void CStrandHandler<Handler>::operator()()
+   {
+      m_strand->dispatch(m_handler);
+   }
+
+   template <typename Handler>
+   template <typename Arg1>
+   void CStrandHandler<Handler>::operator()(const Arg1& arg1)
+   {
+      m_strand->dispatch(boost::bind(m_handler, arg1));
+   }
+
+   template <typename Handler>
+   template <typename Arg1, typename Arg2>
+   void CStrandHandler<Handler>::operator()(const Arg1& arg1, const Arg2& arg2)
+   {
+      m_strand->dispatch(boost::bind(m_handler, arg1, arg2));
+   }
+
+} // namespace DustSerialMux
+
+#endif  /* ! IoStrand_H_ */
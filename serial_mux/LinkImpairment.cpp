@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "LinkImpairment.h"
+
+#include <sstream>
+
+
+namespace DustSerialMux {
+
+   const char* DIRECTION_NAMES[] = { "tx", "rx" };
+
+   CLinkImpairment::CLinkImpairment(const SImpairmentPolicy& policy)
+      : m_policy(policy),
+        m_lock(),
+        m_random(policy.seed),
+        m_outageEnd(0),
+        m_outages(0)
+   { ; }
+
+   CLinkImpairment::EAction CLinkImpairment::impair(EDirection dir, uint8_t* data, size_t len,
+                                                    uint64_t now)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      SImpairmentStats& stats = m_stats[dir];
+      stats.frames++;
+
+      if (m_outageEnd != 0 && now < m_outageEnd) {
+         stats.outageDrops++;
+         return IMPAIR_DROP;
+      }
+      m_outageEnd = 0;
+      if (m_policy.outageTime > 0 && roll(m_policy.outageRate)) {
+         m_outages++;
+         m_outageEnd = now + (uint64_t)m_policy.outageTime * 1000;
+         stats.outageDrops++;
+         return IMPAIR_DROP;
+      }
+
+      if (roll(m_policy.dropRate)) {
+         stats.dropped++;
+         return IMPAIR_DROP;
+      }
+      if (len > 0 && roll(m_policy.corruptRate)) {
+         stats.corrupted++;
+         data[random() % len] ^= (uint8_t)(1 << (random() % 8));
+         return IMPAIR_CORRUPT;
+      }
+      if (roll(m_policy.duplicateRate)) {
+         stats.duplicated++;
+         return IMPAIR_DUPLICATE;
+      }
+      if (m_policy.delayTime > 0 && roll(m_policy.delayRate)) {
+         stats.delayed++;
+         return IMPAIR_DELAY;
+      }
+      return IMPAIR_PASS;
+   }
+
+   SImpairmentStats CLinkImpairment::getStats(EDirection dir) const
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      return m_stats[dir];
+   }
+
+   uint32_t CLinkImpairment::getOutages() const
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      return m_outages;
+   }
+
+   void CLinkImpairment::logStats(LogLevel level, const std::string& context) const
+   {
+      std::ostringstream msg;
+      msg << "link impairment (" << context << "):";
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         for (int dir = IMPAIR_TX; dir <= IMPAIR_RX; dir++) {
+            const SImpairmentStats& stats = m_stats[dir];
+            msg << " " << DIRECTION_NAMES[dir] << " frames=" << stats.frames
+                << " corrupted=" << stats.corrupted
+                << " dropped=" << stats.dropped
+                << " duplicated=" << stats.duplicated
+                << " delayed=" << stats.delayed
+                << " outage-drops=" << stats.outageDrops << ";";
+         }
+         msg << " outages=" << m_outages;
+      }
+      CBoostLog::log(level, msg.str());
+   }
+
+   bool CLinkImpairment::roll(double rate)
+   {
+      if (rate <= 0) {
+         return false;
+      }
+      // 1/10000 percent resolution
+      return (random() % 1000000) < rate * 10000;
+   }
+
+   // 30 bits from two steps of an LCG, the same sequence on every platform
+   uint32_t CLinkImpairment::random()
+   {
+      m_random = m_random * 1103515245 + 12345;
+      uint32_t high = m_random >> 16;
+      m_random = m_random * 1103515245 + 12345;
+      return ((high & 0x7FFF) << 15) | ((m_random >> 16) & 0x7FFF);
+   }
+
+} // namespace DustSerialMux
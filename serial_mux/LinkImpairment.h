@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef LinkImpairment_H_
+#define LinkImpairment_H_
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#include "BoostLog.h"
+
+
+namespace DustSerialMux {
+
+   /**
+    * What goes wrong on the link, and how often
+    *
+    * The rates are percentages of the frames in each direction. An outage
+    * starts at a frame with the outage rate and drops every frame in both
+    * directions for outageTime.
+    */
+   struct SImpairmentPolicy {
+      SImpairmentPolicy()
+         : corruptRate(0), dropRate(0), duplicateRate(0), delayRate(0), delayTime(0),
+           outageRate(0), outageTime(0), seed(1)
+      { ; }
+
+      bool isEnabled() const
+      {
+         return corruptRate > 0 || dropRate > 0 || duplicateRate > 0 ||
+            (delayRate > 0 && delayTime > 0) || (outageRate > 0 && outageTime > 0);
+      }
+
+      double   corruptRate;   // a bit flipped in one byte of the frame
+      double   dropRate;
+      double   duplicateRate; // the frame is sent twice
+      double   delayRate;
+      int      delayTime;     // milliseconds, the frames behind a delayed one wait too
+      double   outageRate;
+      int      outageTime;    // milliseconds
+      uint32_t seed;          // the same seed impairs the same frames
+   };
+
+
+   struct SImpairmentStats {
+      SImpairmentStats()
+         : frames(0), corrupted(0), dropped(0), duplicated(0), delayed(0), outageDrops(0)
+      { ; }
+
+      uint32_t frames;      // frames seen
+      uint32_t corrupted;
+      uint32_t dropped;     // by the drop rate
+      uint32_t duplicated;
+      uint32_t delayed;
+      uint32_t outageDrops; // dropped during an outage
+   };
+
+
+   /**
+    * Impairment of the link between the Picard I/O and its transport
+    *
+    * The transport asks for the fate of each frame it sends or receives and
+    * carries it out: corruption is done in place, a dropped frame is not
+    * sent or passed on, a duplicate is sent or passed on twice and a delayed
+    * frame waits for getDelay(). At most one impairment applies to a frame.
+    *
+    * Thread-safe, frames are sent from the command thread and received on
+    * the read thread. The counters are kept over the whole run, across
+    * reconnects.
+    */
+   class CLinkImpairment {
+   public:
+      enum EDirection {
+         IMPAIR_TX = 0, // to Picard
+         IMPAIR_RX = 1, // from Picard
+      };
+
+      enum EAction {
+         IMPAIR_PASS,
+         IMPAIR_CORRUPT,   // corrupted in place, then passed on
+         IMPAIR_DROP,
+         IMPAIR_DUPLICATE,
+         IMPAIR_DELAY,
+      };
+
+      CLinkImpairment(const SImpairmentPolicy& policy);
+
+      // Decide what happens to a frame, times are monotonic microseconds
+      // data may be NULL if len is 0
+      EAction impair(EDirection dir, uint8_t* data, size_t len, uint64_t now);
+
+      // Returns: the delay of a delayed frame, microseconds
+      uint64_t getDelay() const { return (uint64_t)m_policy.delayTime * 1000; }
+
+      const SImpairmentPolicy& getPolicy() const { return m_policy; }
+
+      SImpairmentStats getStats(EDirection dir) const;
+
+      uint32_t getOutages() const;
+
+      void logStats(LogLevel level, const std::string& context) const;
+
+   private:
+      // Returns: whether an event with a rate in percent happens
+      bool roll(double rate);
+      uint32_t random();
+
+      SImpairmentPolicy m_policy;
+      mutable boost::mutex m_lock;
+      uint32_t m_random;
+      uint64_t m_outageEnd;  // monotonic microseconds, 0 without an outage
+      uint32_t m_outages;
+      SImpairmentStats m_stats[2];
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! LinkImpairment_H_ */
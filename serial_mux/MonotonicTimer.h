@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef MonotonicTimer_H_
+#define MonotonicTimer_H_
+
+#pragma once
+
+#include "Common.h"
+
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+
+namespace DustSerialMux {
+
+   /**
+    * Time traits for an asio timer on the monotonic clock
+    *
+    * boost::asio::deadline_timer runs on the wall clock, so a clock change
+    * stretches or skips its waits. Times are monotonicMicroseconds() values,
+    * durations are microseconds.
+    */
+   struct SMonotonicTimeTraits {
+      typedef uint64_t time_type;
+      typedef int64_t  duration_type;
+
+      static time_type now() { return monotonicMicroseconds(); }
+
+      static time_type add(time_type t, duration_type d) { return t + d; }
+
+      static duration_type subtract(time_type t1, time_type t2) { return t1 - t2; }
+
+      static bool less_than(time_type t1, time_type t2) { return t1 < t2; }
+
+      static boost::posix_time::time_duration to_posix_duration(duration_type d)
+      {
+         return boost::posix_time::microseconds(d);
+      }
+   };
+
+   typedef boost::asio::basic_deadline_timer<uint64_t, SMonotonicTimeTraits> MonotonicTimer;
+
+   // MonotonicTimer duration
+   inline int64_t timerMilliseconds(int millis) { return (int64_t)millis * 1000; }
+
+} // namespace DustSerialMux
+
+#endif  /* ! MonotonicTimer_H_ */
@@ -43,9 +43,21 @@ ByteVector CMuxMessage::serialize() const
 // -------------------------------------------------------------
 // Mux Response 
 
-CMuxOutput::CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix, ByteVector payload)
-   : m_data(payload.size() + 4)
+CMuxOutput::CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix, const ByteVector& payload)
 {
+   build(cmdType, id, prefix, payload.empty() ? NULL : &payload[0], payload.size());
+}
+
+CMuxOutput::CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix,
+                       const uint8_t* payload, size_t len)
+{
+   build(cmdType, id, prefix, payload, len);
+}
+
+void CMuxOutput::build(uint8_t cmdType, uint16_t id, uint8_t prefix,
+                       const uint8_t* payload, size_t len)
+{
+   m_data.resize(len + 4);
    int index = 0;
    // id
    m_data[index++] = (id & 0xFF00) >> 8;
@@ -55,7 +67,7 @@ CMuxOutput::CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix, ByteVector
    // the prefix is the response code or notification type
    m_data[index++] = prefix;
    // payload
-   std::copy(payload.begin(), payload.end(), m_data.begin() + index);
+   std::copy(payload, payload + len, m_data.begin() + index);
 }
 
 ByteVector CMuxOutput::serialize() const 
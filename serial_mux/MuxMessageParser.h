@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include <vector>
 
 
@@ -55,10 +56,15 @@ namespace DustSerialMux {
     */
    class CMuxOutput {
    public:
-      CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix, ByteVector payload);
+      CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix, const ByteVector& payload);
+      CMuxOutput(uint8_t cmdType, uint16_t id, uint8_t prefix,
+                 const uint8_t* payload, size_t len);
 
       ByteVector serialize() const;
    private:
+      void build(uint8_t cmdType, uint16_t id, uint8_t prefix,
+                 const uint8_t* payload, size_t len);
+
       ByteVector  m_data;
    };
 
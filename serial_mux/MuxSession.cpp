@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "MuxSession.h"
+
+#include "BoostLog.h"
+
+#include "BoostClient.h"
+#include "PicardBoost.h"
+#include "BoostClientManager.h"
+#include "BoostClientListener.h"
+#include "LinkImpairment.h"
+#include "MonotonicTimer.h"
+
+#include <sstream>
+#include <algorithm>
+
+#include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+
+namespace DustSerialMux {
+
+#ifdef USE_PICARD_CLR
+   SerialPort^ connectSerial(String^ port /* serial port */, uint32_t baudRate)
+   {
+      // Create a new SerialPort object with default settings.
+      SerialPort^ sp = gcnew SerialPort();
+
+      // Allow the user to set the appropriate properties.
+      sp->PortName = port;
+      sp->BaudRate = baudRate;
+      //sp->Parity
+      //sp->DataBits
+      //sp->StopBits
+      sp->Handshake = Handshake::None;
+
+      // Set the read/write timeouts
+      sp->ReadTimeout = 500;
+      sp->WriteTimeout = 500;
+
+      sp->Open();
+
+      sp->DtrEnable = 1; // set CTS
+      sp->RtsEnable = 0; // unset RTS (until we're ready to send)
+      return sp;
+   }
+#endif
+
+   CMuxSession::CMuxSession(boost::asio::io_service& io_service, const SerialMuxOptions& opts,
+                            const SMuxSessionOptions& session)
+      : m_opts(opts),
+        m_session(session),
+        m_name(session.serialPort),
+        m_picardStrand(io_service),
+        m_clientStrand(io_service),
+        m_lock(),
+        m_resetRequest(),
+        m_picardIO(NULL),
+        m_listener(NULL),
+        m_clientMgr(NULL),
+        m_running(true),
+        m_reset(false),
+        m_picardRestart(false),
+        m_listening(false),
+        m_linkLost(0),
+        m_failoverStart(0),
+        m_failovers(0),
+        m_maxFailoverLatency(0)
+   { ; }
+
+   CMuxSession::~CMuxSession()
+   { ; }
+
+   void CMuxSession::log(LogLevel level, const std::string& msg) const
+   {
+      CBoostLog::log(level, m_name + ": " + msg);
+   }
+
+   void CMuxSession::resetConnection()
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      // a full reset overrides a soft reset
+      m_picardRestart = false;
+      m_linkLost = monotonicMicroseconds();
+
+      log(LOG_ALWAYS, "picard connection reset");
+
+      if (m_picardIO) {
+         // close Picard read loop
+         log(LOG_INFO, "stopping Picard read loop");
+         m_picardIO->reset();
+         m_picardIO->stop();
+      }
+      if (m_clientMgr) {
+         // close client connections
+         log(LOG_INFO, "closing client connections");
+         m_clientMgr->closeClients();
+      }
+      if (m_listener) {
+         // stop the listener
+         log(LOG_INFO, "stopping listener");
+         m_listener->stop();
+      }
+
+      m_reset = true;
+      m_resetRequest.notify_all();
+   }
+
+   void CMuxSession::resetPicardConnection()
+   {
+      if (!isSoftReset()) {
+         resetConnection();
+         return;
+      }
+
+      boost::mutex::scoped_lock guard(m_lock);
+      log(LOG_ALWAYS, "picard connection reset, keeping client connections");
+      m_picardRestart = true;
+      m_linkLost = monotonicMicroseconds();
+      if (m_picardIO) {
+         m_picardIO->reset();
+         m_picardIO->stop();
+      }
+      m_reset = true;
+      m_resetRequest.notify_all();
+   }
+
+   void CMuxSession::stop()
+   {
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         m_running = false;
+      }
+      resetConnection();
+   }
+
+   int CMuxSession::getFailovers() const
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      return m_failovers;
+   }
+
+   uint64_t CMuxSession::getMaxFailoverLatency() const
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      return m_maxFailoverLatency;
+   }
+
+   bool CMuxSession::waitForReset(CBasePicardIO* picardIO, uint64_t started)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      // without a secondary port, Picard is waited for as long as it takes
+      if (!hasSecondary()) {
+         while (!m_reset && m_running) {
+            m_resetRequest.wait(guard);
+         }
+         return false;
+      }
+
+      // the first Hello must be answered within the failover timeout, and
+      // then a link that has been quiet for as long is probed
+      uint64_t timeout = timerMilliseconds(m_opts.failoverTimeout);
+      uint64_t deadline = started + timeout;
+      bool waitForHello = true;
+      while (!m_reset && m_running) {
+         uint64_t now = monotonicMicroseconds();
+         if (now < deadline) {
+            m_resetRequest.timed_wait(guard, boost::posix_time::microseconds(deadline - now));
+            continue;
+         }
+         if (waitForHello) {
+            if (picardIO->getTimeToConnect() == 0) {
+               // the reset of the Picard I/O is left to the main loop
+               m_picardRestart = true;
+               return true;
+            }
+            waitForHello = false;
+            checkFailover(picardIO, started);
+         }
+
+         uint64_t lastInput = picardIO->getLastInput();
+         if (now < lastInput + timeout) {
+            deadline = lastInput + timeout;
+            continue;
+         }
+         guard.unlock();
+         bool answered = picardIO->probe(m_opts.failoverTimeout);
+         guard.lock();
+         if (!answered && !m_reset && m_running) {
+            // the failover latency is measured from the last input
+            m_picardRestart = true;
+            m_linkLost = lastInput;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   void CMuxSession::failover(const std::string& reason)
+   {
+      // while neither port answers, the ports are tried in turn
+      LogLevel level = LOG_INFO;
+      if (m_failoverStart == 0) {
+         boost::mutex::scoped_lock guard(m_lock);
+         m_failoverStart = m_linkLost;
+         level = LOG_ALWAYS;
+      }
+      log(level, reason + ", failing over to " + m_session.secondaryPort);
+      std::string port = m_session.secondaryPort;
+      m_session.secondaryPort = m_session.serialPort;
+      setPicardPort(m_session, port);
+   }
+
+   void CMuxSession::checkFailover(const CBasePicardIO* picardIO, uint64_t started)
+   {
+      if (m_failoverStart == 0 || picardIO->getTimeToConnect() == 0) {
+         return;
+      }
+      uint64_t latency = started + picardIO->getTimeToConnect() - m_failoverStart;
+      m_failoverStart = 0;
+      m_failovers++;
+      m_maxFailoverLatency = std::max(m_maxFailoverLatency, latency);
+
+      std::ostringstream msg;
+      msg << "failed over to " << m_session.serialPort << " in " << latency / 1000
+          << " ms (failovers: " << m_failovers << ", longest "
+          << m_maxFailoverLatency / 1000 << " ms)";
+      log(LOG_ALWAYS, msg.str());
+   }
+
+   // the listen thread is to assure we get the protocol version from
+   // hello response before async listen get started
+   void CMuxSession::listenThread()
+   {
+      CBasePicardIO* picardIO = NULL;
+      CBoostClientListener* listener = NULL;
+      {
+         boost::mutex::scoped_lock guard(m_lock);
+         picardIO = m_picardIO;
+         listener = m_listener;
+      }
+
+      log(LOG_INFO, "listen_thread: waiting for Hello Response");
+      bool picardReady = picardIO->waitForHello();
+      uint8_t version = picardIO->getVersion();
+      std::ostringstream msg;
+      msg << "listen_thread: got version " << std::dec << (int) version;
+      log(LOG_INFO, msg.str());
+      listener->set_protocolVersion(version);
+      listener->asyncListen();
+      boost::mutex::scoped_lock guard(m_lock);
+      m_listening = picardReady;
+   }
+
+   void CMuxSession::run()
+   {
+      // failed attempts to open the Picard port are retried quickly at first
+      int reopenInterval = m_opts.reopenInterval;
+      int openFailures = 0;
+      // after a soft reset, the client manager, the listener and their
+      // threads are kept
+      bool keepClients = false;
+      boost::scoped_ptr<boost::thread> clientThread;
+      boost::scoped_ptr<boost::thread> listenThread;
+
+      // the link impairment (for testing) lasts over all connections to Picard
+      SImpairmentPolicy impairmentPolicy;
+      impairmentPolicy.corruptRate = m_opts.impairCorrupt;
+      impairmentPolicy.dropRate = m_opts.impairDrop;
+      impairmentPolicy.duplicateRate = m_opts.impairDuplicate;
+      impairmentPolicy.delayRate = m_opts.impairDelay;
+      impairmentPolicy.delayTime = m_opts.impairDelayTime;
+      impairmentPolicy.outageRate = m_opts.impairOutage;
+      impairmentPolicy.outageTime = m_opts.impairOutageTime;
+      impairmentPolicy.seed = m_opts.impairSeed;
+      boost::scoped_ptr<CLinkImpairment> impairment;
+      if (impairmentPolicy.isEnabled()) {
+         impairment.reset(new CLinkImpairment(impairmentPolicy));
+         log(LOG_ALWAYS, "impairing the link to Picard (testing)");
+      }
+
+      {
+         // a failover at startup is measured from the start
+         boost::mutex::scoped_lock guard(m_lock);
+         m_linkLost = monotonicMicroseconds();
+      }
+
+      for (;;) {
+         {
+            // a reset of the previous components is over
+            boost::mutex::scoped_lock guard(m_lock);
+            if (!m_running) {
+               break;
+            }
+            m_reset = false;
+         }
+
+         // connect to Picard
+         CBasePicardIO* picardIO = NULL;
+#ifdef USE_PICARD_CLR
+         SerialPort^ sp = nullptr;
+         UdpClient^ picardSim = nullptr;
+
+         try {
+            if (m_session.useSerial) {
+               String^ serialDevice = gcnew String(m_session.serialPort.c_str());
+               sp = connectSerial(serialDevice, m_opts.baudRate);
+               log(LOG_ALWAYS, "Connected to serial port " + m_session.serialPort);
+               picardIO = new CPicardCLR_Serial(sp, m_opts.rtsDelay, m_opts.useFlowControl,
+                                                m_opts.readTimeout);
+            } else {
+               picardSim = gcnew UdpClient();
+               picardSim->Connect("127.0.0.1", m_session.emulatorPort);
+               picardIO = new CPicardCLR_UDP(picardSim, m_opts.readTimeout);
+            }
+         }
+         catch (Exception^) {
+            if (openFailures++ % (10000 / MAX_REOPEN_INTERVAL) == 0) {
+               log(LOG_INFO, "error: can not open a connection to Picard, retrying");
+            }
+            if (hasSecondary()) {
+               failover("can not open " + m_session.serialPort);
+            }
+            boost::this_thread::sleep(boost::posix_time::milliseconds(reopenInterval));
+            reopenInterval = std::min(reopenInterval * 2, MAX_REOPEN_INTERVAL);
+            continue;
+         }
+#else
+         try {
+            if (m_session.useSerial) {
+               picardIO = new CPicardBoost_Serial(m_picardStrand, m_session.serialPort,
+                                                  m_opts.baudRate, m_opts.rtsDelay,
+                                                  m_opts.useFlowControl, m_opts.writeTimeout,
+                                                  m_opts.readTimeout, m_opts.maxFrameLen,
+                                                  m_opts.statsInterval);
+               log(LOG_ALWAYS, "Connected to serial port " + m_session.serialPort);
+            }
+            else {
+               picardIO = new CPicardBoost_UDP(m_picardStrand.get_io_service(),
+                                               m_session.emulatorPort, m_opts.readTimeout);
+            }
+         }
+         catch (const std::exception& ex) {
+            // log the first failure, and then about once every 10 seconds
+            if (openFailures++ % (10000 / MAX_REOPEN_INTERVAL) == 0) {
+               std::ostringstream msg;
+               msg << "error: can not open a connection to Picard, retrying: " << ex.what();
+               log(LOG_INFO, msg.str());
+            }
+            if (hasSecondary()) {
+               failover("can not open " + m_session.serialPort);
+            }
+            boost::this_thread::sleep(boost::posix_time::milliseconds(reopenInterval));
+            reopenInterval = std::min(reopenInterval * 2, MAX_REOPEN_INTERVAL);
+            continue;
+         }
+#endif
+         reopenInterval = m_opts.reopenInterval;
+         openFailures = 0;
+
+         if (!keepClients) {
+            // create the client manager
+            CBoostClientManager* clientMgr =
+               new CBoostClientManager(m_opts.picardRetries, m_opts.picardTimeout,
+                                       m_opts.minPicardTimeout,
+                                       SEscalationPolicy(m_opts.failuresBeforeReset,
+                                                         m_opts.probeTimeout));
+            clientMgr->setStatsInterval(m_opts.statsInterval);
+            SHoldPolicy hold(m_opts.holdCommands);
+            for (size_t i = 0; i < m_opts.idempotentCommands.size(); i++) {
+               hold.setIdempotent(m_opts.idempotentCommands[i]);
+            }
+            clientMgr->setHoldPolicy(hold);
+            clientMgr->setSession(this);
+
+            boost::mutex::scoped_lock guard(m_lock);
+            m_clientMgr = clientMgr;
+         }
+         picardIO->registerCallback(m_clientMgr);
+         picardIO->setReconnectPolicy(SReconnectPolicy(m_opts.helloInterval,
+                                                       m_opts.maxHelloInterval));
+         picardIO->setSoftReset(isSoftReset());
+         picardIO->setImpairment(impairment.get());
+         picardIO->setSession(this);
+         {
+            boost::mutex::scoped_lock guard(m_lock);
+            m_picardIO = picardIO;
+         }
+
+         // start output
+         uint64_t started = monotonicMicroseconds();
+         picardIO->start();
+         // the serial port is read on the io_service, UDP needs a read thread
+         boost::scoped_ptr<boost::thread> picardThread;
+         if (picardIO->needsReadThread()) {
+            picardThread.reset(new boost::thread(&CBasePicardIO::threadMain, picardIO));
+#ifdef WIN32
+            SetThreadPriority(picardThread->native_handle(), THREAD_PRIORITY_HIGHEST);
+#endif
+         }
+
+         if (keepClients) {
+            // the command thread is still running, its commands wait for the link
+            m_clientMgr->setPicard(picardIO);
+         }
+         else {
+            // start command processing thread
+            clientThread.reset(new boost::thread(&CBoostClientManager::commandLoop,
+                                                 m_clientMgr, picardIO));
+
+            // start listening
+            CBoostClientListener* listener =
+               new CBoostClientListener(m_clientStrand, m_session.listenerPort,
+                                        !m_opts.acceptAnyhost, *m_clientMgr,
+                                        m_session.authToken, 0);
+            {
+               boost::mutex::scoped_lock guard(m_lock);
+               m_listener = listener;
+            }
+            listenThread.reset(new boost::thread(&CMuxSession::listenThread, this));
+         }
+
+         // the io_service threads serve the session until it's reset
+         if (waitForReset(picardIO, started)) {
+            // wake up the listen thread if it waits for the Hello Response
+            picardIO->reset();
+            failover("no Hello Response from " + m_session.serialPort);
+         }
+         else {
+            boost::mutex::scoped_lock guard(m_lock);
+            checkFailover(picardIO, started);
+         }
+
+         log(LOG_INFO, "stopping components");
+
+         {
+            boost::mutex::scoped_lock guard(m_lock);
+            // the clients are kept once the listener has been started
+            keepClients = m_picardRestart && m_listening;
+            m_picardRestart = false;
+            m_picardIO = NULL;
+         }
+
+         picardIO->registerCallback(NULL); // disable callbacks from Picard output
+         if (keepClients) {
+            // the clients hear about the reset, commands wait for the new Picard I/O
+            m_clientMgr->linkStateChanged(false);
+            m_clientMgr->setPicard(NULL);
+         }
+         else {
+            // close command processing thread
+            m_clientMgr->stop();
+            clientThread->join();
+            listenThread->join();
+         }
+
+         // shutdown output
+         picardIO->stop();
+         if (picardThread) {
+            picardThread->join();
+         }
+         // let the cancelled Picard I/O complete before the handlers go away
+         m_picardStrand.waitIdle();
+
+         log(LOG_INFO, "deleting components");
+
+         if (!keepClients) {
+            CBoostClientManager* clientMgr = NULL;
+            CBoostClientListener* listener = NULL;
+            {
+               boost::mutex::scoped_lock guard(m_lock);
+               std::swap(clientMgr, m_clientMgr);
+               std::swap(listener, m_listener);
+               m_listening = false;
+            }
+            // the clients have been closed by the reset
+            listener->stop();
+            m_clientStrand.waitIdle();
+
+            delete clientMgr;
+            delete listener;
+         }
+
+         delete picardIO;
+
+         if (impairment) {
+            impairment->logStats(LOG_ALWAYS, "total");
+         }
+
+#ifdef USE_PICARD_CLR
+         // close connection to Picard
+         log(LOG_INFO, "closing Picard connection");
+         if (m_session.useSerial) {
+            sp->Close();
+         } else {
+            picardSim->Close();
+         }
+#endif
+      }
+
+      // stopped while the Picard I/O was being restarted
+      if (keepClients) {
+         log(LOG_INFO, "deleting client components");
+         CBoostClientManager* clientMgr = NULL;
+         CBoostClientListener* listener = NULL;
+         {
+            boost::mutex::scoped_lock guard(m_lock);
+            std::swap(clientMgr, m_clientMgr);
+            std::swap(listener, m_listener);
+            m_listening = false;
+         }
+         clientMgr->closeClients();
+         listener->stop();
+         clientMgr->stop();
+         clientThread->join();
+         listenThread->join();
+         m_clientStrand.waitIdle();
+
+         delete clientMgr;
+         delete listener;
+      }
+   }
+
+} // namespace DustSerialMux
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef MuxSession_H_
+#define MuxSession_H_
+
+#pragma once
+
+#include "serial_mux.h"
+#include "SerialMuxOptions.h"
+#include "IoStrand.h"
+
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+
+namespace DustSerialMux {
+
+   class CBasePicardIO;
+   class CBoostClientListener;
+   class CBoostClientManager;
+
+   /**
+    * A Manager served by the Serial Mux
+    *
+    * The session connects to its Picard, listens for its clients and
+    * recreates its components after a reset, in run(). The Picard port and
+    * the client connections of all the sessions are served by the threads
+    * of one io_service; each session's handlers run on strands of their
+    * own, so a reset of one session leaves the others running.
+    *
+    * With a secondary Picard port, the session fails over to the other
+    * port when the Picard port can't be opened or doesn't answer a Hello
+    * within the failover timeout. Once connected, a link that has been
+    * quiet for the failover timeout is probed with a Hello. The session
+    * resets softly: the clients are kept over a failover and get link
+    * state events.
+    */
+   class CMuxSession : public IMuxSession {
+   public:
+      CMuxSession(boost::asio::io_service& io_service, const SerialMuxOptions& opts,
+                  const SMuxSessionOptions& session);
+
+      virtual ~CMuxSession();
+
+      // the session's main loop, returns once the session is stopped
+      void run();
+
+      // stop the main loop, may be called from any thread
+      void stop();
+
+      // the session's (primary) Picard port, for the log
+      const std::string& getName() const { return m_name; }
+
+      // failovers to the other Picard port, and the longest failover
+      // latency in microseconds
+      int getFailovers() const;
+      uint64_t getMaxFailoverLatency() const;
+
+      // * IMuxSession
+
+      virtual void resetConnection();
+      virtual void resetPicardConnection();
+
+   private:
+      // waits for the protocol version from the Hello Response before
+      // the listener is started
+      void listenThread();
+
+      // Returns: once a reset or stop is requested, or true if the Picard
+      // port is to be failed over. started is when the Picard I/O started.
+      bool waitForReset(CBasePicardIO* picardIO, uint64_t started);
+
+      bool hasSecondary() const { return !m_session.secondaryPort.empty(); }
+
+      // the clients are kept over a failover, as over a soft reset
+      bool isSoftReset() const { return m_opts.softReset || hasSecondary(); }
+
+      // switch the Picard port to the other port, the failover latency is
+      // measured from the loss of the link
+      void failover(const std::string& reason);
+
+      // log the failover latency once the other port answers a Hello,
+      // called with the lock held
+      void checkFailover(const CBasePicardIO* picardIO, uint64_t started);
+
+      void log(LogLevel level, const std::string& msg) const;
+
+      const SerialMuxOptions& m_opts;
+      // the Picard port in use is m_session.serialPort, a failover swaps it
+      // with the secondary port
+      SMuxSessionOptions      m_session;
+      const std::string       m_name;
+
+      // the handlers of the Picard I/O, and of the listener and its clients
+      CIoStrand m_picardStrand;
+      CIoStrand m_clientStrand;
+
+      // the components are replaced by the main loop, the lock protects
+      // the pointers and the reset state
+      mutable boost::mutex m_lock;
+      boost::condition_variable m_resetRequest;
+      CBasePicardIO*        m_picardIO;
+      CBoostClientListener* m_listener;
+      CBoostClientManager*  m_clientMgr;
+
+      bool m_running;
+      bool m_reset;
+      // soft reset: only the Picard I/O is restarted by the main loop
+      bool m_picardRestart;
+      // the listener accepts clients once the first Hello Response is in,
+      // set by the listen thread
+      bool m_listening;
+
+      // monotonic microseconds: when the link to Picard was lost (under
+      // the lock), and when the failover in progress started, 0 for none
+      uint64_t m_linkLost;
+      uint64_t m_failoverStart;
+      // under the lock
+      int      m_failovers;
+      uint64_t m_maxFailoverLatency; // microseconds
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! MuxSession_H_ */
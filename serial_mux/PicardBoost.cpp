@@ -6,14 +6,18 @@
 
 #include "BoostLog.h"
 #include "SerialMuxOptions.h"
-
-#include "serial_mux.h"  // for resetConnection
+#include "SerialLine.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <iomanip>
+#include <algorithm>
 
 #ifndef WIN32
 #include <termios.h>
 #include <unistd.h>
+#include <sys/select.h>
 #endif
 
 using namespace boost::posix_time;
@@ -23,32 +27,77 @@ using boost::asio::ip::udp;
 
 namespace DustSerialMux {
 
-   CPicardBoost_Serial::CPicardBoost_Serial(boost::asio::io_service& io_service, const std::string& port,
-                                            int rtsDelay, bool hwFlowControl, int readTimeout)
-      : m_io_service(io_service),
+   // how often CTS is checked while a frame waits for it
+   const int64_t CTS_POLL_INTERVAL = 1000; // microseconds
+   // the shortest wait for the output to drain
+   const int64_t MIN_DRAIN_WAIT = 100; // microseconds
+
+   CPicardBoost_Serial::CPicardBoost_Serial(CIoStrand& strand, const std::string& port,
+                                            uint32_t baudRate, int rtsDelay, bool hwFlowControl,
+                                            int writeTimeout, int readTimeout,
+                                            size_t maxFrameLen, int statsInterval)
+      : CPicardIO<CPicardBoost_Serial>(maxFrameLen, statsInterval),
+        m_strand(strand),
+        m_baudRate(0),
         m_rtsDelay(rtsDelay),
         m_hwFlowControl(hwFlowControl),
+        m_writeTimeout(writeTimeout),
         m_readTimeout(readTimeout),
-        m_serial(io_service, port),
-        m_readLock(),
-        m_readSem(),
-        m_readComplete(false)
+        m_input(INPUT_BUFFER_LEN),
+        m_serial(strand.get_io_service(), port),
+        m_txLock(),
+        m_txQueue(maxEncodedHDLC(MAX_SERIAL_API_FRAME_LEN)),
+        m_writing(NULL),
+        m_writeOffset(0),
+        m_notifAck(NOTIFICATION),
+        m_ackStats(),
+        m_rxTime(0),
+        m_helloTimer(strand.get_io_service()),
+        m_helloInterval(0),
+        m_statsTimer(strand.get_io_service()),
+        m_txRepeat(false),
+        m_txDelayTimer(strand.get_io_service()),
+        m_rxDelayed(),
+        m_rxDelayTimer(strand.get_io_service()),
+        m_flowState(FLOW_IDLE),
+        m_flowDeadline(0),
+        m_rtsDelayed(false),
+        m_flowTimer(strand.get_io_service()),
+        m_ctsTimeouts(0),
+        m_drainTimeouts(0)
    {
       boost::system::error_code err;
       
       // set parameters
-      m_serial.set_option(serial_port_base::baud_rate(DEFAULT_BAUD_RATE), err);
       m_serial.set_option(serial_port_base::flow_control(serial_port_base::flow_control::none), err);
       m_serial.set_option(serial_port_base::character_size(8), err);
       m_serial.set_option(serial_port_base::parity(serial_port_base::parity::none), err);
       m_serial.set_option(serial_port_base::stop_bits(serial_port_base::stop_bits::one), err);
+      setBaudRate(port, baudRate);
+
+      // RTS is driven by the handshake, not by the kernel (CRTSCTS is off)
+      if (m_hwFlowControl) {
+#ifdef __linux__
+         boost::system::error_code rtsErr;
+         setSerialRts(m_serial.native(), false, rtsErr);
+         if (rtsErr) {
+            CBoostLog::log("serial port " + port + ": no RTS/CTS flow control: " +
+                           rtsErr.message());
+            m_hwFlowControl = false;
+         }
+#else
+         CBoostLog::log("RTS/CTS flow control is only supported on Linux");
+         m_hwFlowControl = false;
+#endif
+      }
 #ifdef WIN32
       serial_port::native_type handle = m_serial.native();
       int result;
       result = EscapeCommFunction(handle, SETDTR);
       result = EscapeCommFunction(handle, CLRRTS);
 
-      // TODO: instead of timeouts, rework read loop to use async reads
+      // async reads complete with whatever arrived within the read timeout,
+      // an empty read is re-armed
       COMMTIMEOUTS timeouts;
       GetCommTimeouts(handle, &timeouts);
 
@@ -61,172 +110,583 @@ namespace DustSerialMux {
  #endif
    }
 
+   void CPicardBoost_Serial::setBaudRate(const std::string& port, uint32_t baudRate)
+   {
+      boost::system::error_code err;
+#ifdef __linux__
+      // any rate the driver can divide its clock to, not only the Bxxx rates
+      m_baudRate = setSerialBaudRate(m_serial.native(), baudRate, err);
+#else
+      m_serial.set_option(serial_port_base::baud_rate(baudRate), err);
+      serial_port_base::baud_rate effective(0);
+      boost::system::error_code readErr;
+      m_serial.get_option(effective, readErr);
+      m_baudRate = effective.value();
+#endif
+
+      std::ostringstream msg;
+      msg << "serial port " << port << ": " << m_baudRate << " baud";
+      if (err || m_baudRate != baudRate) {
+         msg << ", can not set " << baudRate << " baud";
+         if (err) {
+            msg << ": " << err.message();
+         }
+         CBoostLog::log(LOG_ERROR, msg.str());
+      }
+      else {
+         CBoostLog::log(LOG_ALWAYS, msg.str());
+      }
+   }
+
    CPicardBoost_Serial::~CPicardBoost_Serial() { 
       m_serial.cancel();
+      logAckStats(LOG_ALWAYS, "session");
+      // frames still in the queue are dropped
+      if (m_writing) {
+         m_txQueue.release(m_writing);
+      }
    }
 
-   void CPicardBoost_Serial::sendRaw(const ByteVector& data)
+   void CPicardBoost_Serial::writeFrame(const uint8_t* header, size_t headerLen,
+                                        const uint8_t* payload, size_t payloadLen)
    {
-      // locks should be handled at the sendCommand / sendAck methods
+      {
+         boost::mutex::scoped_lock guard(m_txLock);
+         STxFrame* frame = m_txQueue.alloc();
+         // encoded straight into the queued frame
+         CHDLCEncoder encoder(&frame->data[0]);
+         encoder.append(header, headerLen);
+         encoder.append(payload, payloadLen);
+         frame->len = encoder.finish();
+         m_txQueue.push(frame);
+      }
+      // the port belongs to the strand
+      m_strand.post(boost::bind(&CPicardBoost_Serial::startWrite, this));
+   }
 
-      // HDLC encode
-      ByteVector encodedvec = encodeHDLC(data);
+   // called from frameComplete, on the strand
+   void CPicardBoost_Serial::sendAckFrame(uint8_t type, uint8_t seqNo)
+   {
+      {
+         boost::mutex::scoped_lock guard(m_txLock);
+         STxFrame* frame = m_txQueue.alloc();
+         if (type == m_notifAck.getType()) {
+            frame->len = m_notifAck.encode(seqNo, &frame->data[0]);
+         } else {
+            uint8_t ack[SERIAL_API_HEADER_LEN + 1] = { 3, type, seqNo, 1, 0 };
+            frame->len = encodeHDLC(ack, sizeof(ack), &frame->data[0]);
+         }
+         frame->isAck = true;
+         frame->rxTime = m_rxTime;
+         m_txQueue.push(frame);
+      }
+      startWrite();
+   }
 
-      // the current implementation does not support hardware flow control
-#if 0
-      if (m_hwFlowControl) {
-         m_serial->RtsEnable = 1;
-         // busy wait for DSR (or timeout)
-         bool sendTimeout = false;
-         ptime timeout = microsec_clock::local_time() + milliseconds(m_serial->WriteTimeout);
-         while (m_serial->DsrHolding == 0) {
-            ptime now = microsec_clock::local_time();
-            if (now > timeout) {
-               sendTimeout = true;
-               break;
-            }
-            boost::this_thread::sleep(milliseconds(1)); 
+   // One write is outstanding at a time, so a queued ACK waits at most for
+   // the frame already on the wire
+   void CPicardBoost_Serial::startWrite()
+   {
+      if (m_writing != NULL || !isRunning()) {
+         return;
+      }
+      for (;;) {
+         {
+            boost::mutex::scoped_lock guard(m_txLock);
+            m_writing = m_txQueue.pop();
+         }
+         if (m_writing == NULL) {
+            return;
+         }
+         if (m_impairment == NULL) {
+            break;
+         }
+
+         // corruption stays between the flags, for the Manager's FCS to find
+         CLinkImpairment::EAction action =
+            m_impairment->impair(CLinkImpairment::IMPAIR_TX, &m_writing->data[1],
+                                 m_writing->len - 2, monotonicMicroseconds());
+         if (action == CLinkImpairment::IMPAIR_DROP) {
+            boost::mutex::scoped_lock guard(m_txLock);
+            m_txQueue.release(m_writing);
+            m_writing = NULL;
+            continue;
+         }
+         if (action == CLinkImpairment::IMPAIR_DUPLICATE) {
+            m_txRepeat = true;
          }
-         if (sendTimeout) {
-            // note: we detect the write failure when Acks are not received
-            CBoostLog::log("Serial:Write error: no CTS received");
+         else if (action == CLinkImpairment::IMPAIR_DELAY) {
+            // the queue waits behind the delayed frame
+            m_txDelayTimer.expires_from_now(m_impairment->getDelay());
+            m_txDelayTimer.async_wait(
+               m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleTxDelayTimer, this,
+                                         boost::asio::placeholders::error)));
             return;
          }
+         break;
       }
-#endif
-      
-      try {
-         size_t len = boost::asio::write(m_serial, boost::asio::buffer(encodedvec));
+
+      sendCurrent();
+   }
+
+   void CPicardBoost_Serial::sendCurrent()
+   {
+      if (m_hwFlowControl) {
+         requestToSend();
+      } else {
+         writeCurrent();
       }
-      catch (const std::exception&) {
-         CBoostLog::log("exception (Serial write)");
+   }
+
+   void CPicardBoost_Serial::writeCurrent()
+   {
+      m_writeOffset = 0;
+      writeRemaining();
+   }
+
+   // async_write would continue a partial write outside the strand (see
+   // CStrandHandler), so handleWrite writes the rest
+   void CPicardBoost_Serial::writeRemaining()
+   {
+      m_serial.async_write_some(boost::asio::buffer(&m_writing->data[m_writeOffset],
+                                                    m_writing->len - m_writeOffset),
+                                m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleWrite, this,
+                                                          boost::asio::placeholders::error,
+                                                          boost::asio::placeholders::bytes_transferred)));
+   }
+
+   void CPicardBoost_Serial::handleTxDelayTimer(const boost::system::error_code& result)
+   {
+      if (m_writing == NULL) {
+         return;
       }
-      
-      CBoostLog::logDump("Serial:Write", encodedvec);
-      
-      // the current implementation does not support hardware flow control
-#if 0
-      // wait before deasserting RTS
-      // TODO: wait on EV_TXEMPTY
-      // TODO: later, we may need to adjust the RTS delay based on data length
-      if (m_hwFlowControl) {
-         if (m_rtsDelay > 0) {
-            boost::this_thread::sleep(milliseconds(m_rtsDelay));
-         }
-         m_serial->RtsEnable = 0;
+      if (result || !isRunning()) {
+         boost::mutex::scoped_lock guard(m_txLock);
+         m_txQueue.release(m_writing);
+         m_writing = NULL;
+         return;
       }
-#endif
+      sendCurrent();
    }
 
-   void CPicardBoost_Serial::handleRead(const boost::system::error_code& result,
-                                        std::size_t bytes)
+   void CPicardBoost_Serial::receiveImpaired(const uint8_t* frame, size_t len, uint64_t delay)
+   {
+      if (delay == 0 && m_rxDelayed.empty()) {
+         handleFrame(frame, len);
+         return;
+      }
+      SDelayedFrame delayed;
+      delayed.due = monotonicMicroseconds() + delay;
+      if (!m_rxDelayed.empty()) {
+         delayed.due = std::max(delayed.due, m_rxDelayed.back().due);
+      }
+      delayed.frame.assign(frame, frame + len);
+      m_rxDelayed.push_back(delayed);
+      if (m_rxDelayed.size() == 1) {
+         m_rxDelayTimer.expires_at(delayed.due);
+         m_rxDelayTimer.async_wait(
+            m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleRxDelayTimer, this,
+                                      boost::asio::placeholders::error)));
+      }
+   }
+
+   void CPicardBoost_Serial::handleRxDelayTimer(const boost::system::error_code& result)
+   {
+      if (result || !isRunning()) {
+         m_rxDelayed.clear();
+         return;
+      }
+      uint64_t now = monotonicMicroseconds();
+      while (!m_rxDelayed.empty() && m_rxDelayed.front().due <= now) {
+         // handleFrame may reset the connection
+         ByteVector frame;
+         frame.swap(m_rxDelayed.front().frame);
+         m_rxDelayed.pop_front();
+         handleFrame(&frame[0], frame.size());
+         // the notifications point into frame
+         flushNotifs();
+      }
+      if (!m_rxDelayed.empty()) {
+         m_rxDelayTimer.expires_at(m_rxDelayed.front().due);
+         m_rxDelayTimer.async_wait(
+            m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleRxDelayTimer, this,
+                                      boost::asio::placeholders::error)));
+      }
+   }
+
+   void CPicardBoost_Serial::handleWrite(const boost::system::error_code& result,
+                                         std::size_t bytes)
    {
-    boost::unique_lock<boost::mutex> guard(m_readLock);
-    m_readComplete = true;
-    if (result) {
-         // need to notify the semaphore - unless the async read was cancelled by the timeout
+      STxFrame* frame = m_writing;
+      if (frame == NULL) {
+         return;
+      }
+      if (!result && m_writeOffset + bytes < frame->len && isRunning()) {
+         m_writeOffset += bytes;
+         writeRemaining();
+         return;
+      }
+      m_writing = NULL;
+
+      if (result) {
          if (result != boost::asio::error::operation_aborted) {
-             m_readSem.notify_one();
+            std::ostringstream msg;
+            msg << "Serial write error: " << result.message();
+            CBoostLog::log(msg.str());
+         }
+      } else {
+         // the dump is done after the write, so it doesn't delay the ACK
+         CBoostLog::logDump(LOG_TRACE, "Serial:Write", &frame->data[0], frame->len);
+      }
+
+      if (m_txRepeat && !result) {
+         // the duplicate goes out right behind the frame, once CTS allows
+         m_txRepeat = false;
+         m_writing = frame;
+         sendCurrent();
+         return;
+      }
+      m_txRepeat = false;
+
+      // the released frame goes to the writers
+      size_t len = frame->len;
+      {
+         boost::mutex::scoped_lock guard(m_txLock);
+         if (frame->isAck && !result) {
+            m_ackStats.record(monotonicMicroseconds() - frame->rxTime);
          }
-     return;
-    }
-    CBoostLog::log(LOG_TRACE, "read complete");
-    m_readLen = bytes;
-    // cancel timer and set the read semaphore
-    m_readSem.notify_one();
+         m_txQueue.release(frame);
+      }
+
+      // a failed write drops the frame, the retransmit logic recovers
+      if (result != boost::asio::error::operation_aborted) {
+         if (m_hwFlowControl) {
+            // RTS stays asserted for the next frame, or until the frame is out
+            startDrain(len);
+         }
+         startWrite();
+      }
    }
 
-   void CPicardBoost_Serial::read_async(const std::string& context, int timeout)
+   void CPicardBoost_Serial::requestToSend()
    {
-      CBoostLog::log(LOG_TRACE, "Starting read(), async");
-      bool portClosed = false;
-      m_readComplete = false;
+#ifdef __linux__
+      if (m_flowState == FLOW_IDLE) {
+         boost::system::error_code ignored;
+         setSerialRts(m_serial.native(), true, ignored);
+      }
+      m_flowState = FLOW_WAIT_CTS;
+      m_flowDeadline = monotonicMicroseconds() + timerMilliseconds(m_writeTimeout);
+      checkCts();
+#endif
+   }
 
-      try {
-         ByteVector input(INPUT_BUFFER_LEN);
-         m_readLen = 0;
-         
-         m_serial.async_read_some(boost::asio::buffer(input),
-                                  boost::bind(&CPicardBoost_Serial::handleRead, this,
-                                              boost::asio::placeholders::error,
-                                              boost::asio::placeholders::bytes_transferred));
-         {
-            boost::unique_lock<boost::mutex> guard(m_readLock);
-            if (!m_readComplete) { 
-                boost::system_time const wtimeout=boost::get_system_time()+ boost::posix_time::milliseconds(timeout);
-                m_readSem.timed_wait(guard, wtimeout);
-                // the timeout should cancel the async read so we don't have multiple outstanding reads
-                m_serial.cancel();
-            }
+   void CPicardBoost_Serial::checkCts()
+   {
+#ifdef __linux__
+      boost::system::error_code err;
+      if (getSerialCts(m_serial.native(), err)) {
+         m_flowState = FLOW_WRITING;
+         writeCurrent();
+         return;
+      }
+      if (monotonicMicroseconds() < m_flowDeadline) {
+         waitFlow(CTS_POLL_INTERVAL);
+         return;
+      }
+
+      // note: we detect the write failure when Acks are not received
+      std::ostringstream msg;
+      msg << "Serial:Write error: no CTS received in " << m_writeTimeout << " ms"
+          << " (CTS timeouts: " << ++m_ctsTimeouts << ")";
+      CBoostLog::log(msg.str());
+      {
+         boost::mutex::scoped_lock guard(m_txLock);
+         m_txQueue.release(m_writing);
+         m_writing = NULL;
+      }
+      releaseRts();
+      startWrite();
+#endif
+   }
+
+   void CPicardBoost_Serial::startDrain(size_t bytes)
+   {
+      m_flowState = FLOW_DRAINING;
+      m_flowDeadline = monotonicMicroseconds() + timerMilliseconds(m_writeTimeout);
+      m_rtsDelayed = false;
+      waitFlow(sendTime(bytes));
+   }
+
+   void CPicardBoost_Serial::checkDrain()
+   {
+#ifdef __linux__
+      boost::system::error_code err;
+      int queued = getSerialOutputQueue(m_serial.native(), err);
+      if (err) {
+         // the driver doesn't report its queue, RTS is held for the RTS delay
+         if (!m_rtsDelayed && m_rtsDelay > 0) {
+            m_rtsDelayed = true;
+            waitFlow(timerMilliseconds(m_rtsDelay));
+            return;
          }
-         std::ostringstream msg;
-         msg << "async read() complete: len=" << m_readLen;
-         CBoostLog::log(LOG_TRACE, msg.str());
-         msg.str("");
-         msg.clear();
-
-        if (m_readLen > 0) {
-            msg << "Serial:Read (" << context << ")";
-            CBoostLog::logDump(msg.str(), ByteVector(input.begin(), input.begin() + m_readLen));
-        }
-         
-         for (size_t i = 0; i < m_readLen; i++) {
-            m_hdlc->addByte(input[i]);
+         queued = 0;
+      }
+      if (queued == 0) {
+         releaseRts();
+         return;
+      }
+      if (monotonicMicroseconds() < m_flowDeadline) {
+         waitFlow(sendTime(queued));
+         return;
+      }
+
+      // the output is held up, e.g. by a stuck transmitter
+      boost::system::error_code ignored;
+      flushSerialOutput(m_serial.native(), ignored);
+      std::ostringstream msg;
+      msg << "Serial:Write error: " << queued << " byte(s) not sent in " << m_writeTimeout
+          << " ms, discarded (drain timeouts: " << ++m_drainTimeouts << ")";
+      CBoostLog::log(msg.str());
+      releaseRts();
+#endif
+   }
+
+   void CPicardBoost_Serial::releaseRts()
+   {
+#ifdef __linux__
+      boost::system::error_code ignored;
+      setSerialRts(m_serial.native(), false, ignored);
+#endif
+      m_flowState = FLOW_IDLE;
+   }
+
+   void CPicardBoost_Serial::waitFlow(int64_t delay)
+   {
+      m_flowTimer.expires_from_now(delay);
+      m_flowTimer.async_wait(
+         m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleFlowTimer, this,
+                                   boost::asio::placeholders::error)));
+   }
+
+   void CPicardBoost_Serial::handleFlowTimer(const boost::system::error_code& result)
+   {
+      if (result || !isRunning()) {
+         return;
+      }
+      // a timer that was overtaken by the next frame finds another state
+      if (m_flowState == FLOW_WAIT_CTS) {
+         checkCts();
+      }
+      else if (m_flowState == FLOW_DRAINING) {
+         checkDrain();
+      }
+   }
+
+   int64_t CPicardBoost_Serial::sendTime(size_t bytes) const
+   {
+      // 10 bits a byte: start, 8 data bits and stop
+      uint32_t rate = m_baudRate > 0 ? m_baudRate : DEFAULT_BAUD_RATE;
+      return std::max<int64_t>((int64_t)bytes * 10 * 1000000 / rate, MIN_DRAIN_WAIT);
+   }
+
+   SAckStats CPicardBoost_Serial::getAckStats() const
+   {
+      boost::mutex::scoped_lock guard(m_txLock);
+      return m_ackStats;
+   }
+
+   void CPicardBoost_Serial::logAckStats(LogLevel level, const std::string& context) const
+   {
+      SAckStats stats = getAckStats();
+      if (stats.acks == 0) {
+         return;
+      }
+
+      std::ostringstream msg;
+      msg << "ack stats (" << context << "): acks=" << stats.acks
+          << " mean=" << std::fixed << std::setprecision(0) << stats.meanLatency() << "us"
+          << " max=" << stats.maxLatency << "us"
+          << " latency=";
+      for (int i = 0; i < SAckStats::LATENCY_BUCKETS; i++) {
+         msg << (i ? "," : "") << stats.latencyHistogram[i];
+      }
+      CBoostLog::log(level, msg.str());
+   }
+
+   void CPicardBoost_Serial::start()
+   {
+      CBasePicardIO::start();
+      createDecoder();
+      // the other sessions' threads may already be running the io_service
+      m_strand.post(boost::bind(&CPicardBoost_Serial::startIO, this));
+   }
+
+   void CPicardBoost_Serial::startIO()
+   {
+      startRead();
+      startHellos();
+      if (m_statsInterval > 0) {
+         m_statsTimer.expires_from_now(timerMilliseconds(m_statsInterval * 1000));
+         m_statsTimer.async_wait(
+            m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleStatsTimer, this,
+                                      boost::asio::placeholders::error)));
+      }
+   }
+
+   void CPicardBoost_Serial::stop()
+   {
+      CBasePicardIO::stop();
+      // the serial port and timers belong to the strand
+      m_strand.post(boost::bind(&CPicardBoost_Serial::cancelIO, this));
+   }
+
+   void CPicardBoost_Serial::cancelIO()
+   {
+      boost::system::error_code ignored;
+      m_serial.cancel(ignored);
+      m_helloTimer.cancel(ignored);
+      m_statsTimer.cancel(ignored);
+      m_txDelayTimer.cancel(ignored);
+      m_rxDelayTimer.cancel(ignored);
+      m_flowTimer.cancel(ignored);
+   }
+
+   void CPicardBoost_Serial::startRead()
+   {
+      m_serial.async_read_some(boost::asio::buffer(m_input),
+                               m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleRead, this,
+                                                         boost::asio::placeholders::error,
+                                                         boost::asio::placeholders::bytes_transferred)));
+   }
+
+   // the read is always outstanding: input is decoded as soon as it arrives
+   // and the next read is started right away
+   void CPicardBoost_Serial::handleRead(const boost::system::error_code& result,
+                                        std::size_t bytes)
+   {
+      if (result) {
+         if (result != boost::asio::error::operation_aborted && isRunning()) {
+            std::ostringstream msg;
+            msg << "Serial read error: " << result.message();
+            CBoostLog::log(msg.str());
+            // when the port is closed, we reset and hope it re-opens soon
+            resetPicardConnection();
          }
+         return;
+      }
+
+      if (bytes > 0) {
+         // ACK latency is measured from here
+         m_rxTime = monotonicMicroseconds();
          // the HDLC parser calls frameComplete
+         decode(&m_input[0], bytes);
+         // the dump is done after decoding, so it doesn't delay the ACKs
+         CBoostLog::logDump(LOG_TRACE, "Serial:Read", &m_input[0], bytes);
       }
-      catch (const std::exception&) {
-         CBoostLog::log("exception (Serial read)");
-         portClosed = true;
+
+      // frameComplete may have reset the connection
+      if (isRunning()) {
+         startRead();
       }
+   }
 
-      if (portClosed) {
-         // when the port is closed, we reset and hope it re-opens soon
-         resetConnection();
-      }      
+   void CPicardBoost_Serial::startHellos()
+   {
+      // the first Hello goes out as soon as the io_service runs
+      m_helloInterval = m_reconnect.initialInterval;
+      m_helloTimer.expires_from_now(0);
+      m_helloTimer.async_wait(
+         m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleHelloTimer, this,
+                                   boost::asio::placeholders::error)));
    }
 
-   // read 
-   void CPicardBoost_Serial::read(const std::string& context, int timeout)
+   // Hellos are repeated, backing off, until Picard responds
+   void CPicardBoost_Serial::handleHelloTimer(const boost::system::error_code& result)
+   {
+      if (result || !isRunning()) {
+         return;
+      }
+      if (sendHelloIfNeeded()) {
+         m_helloTimer.expires_from_now(timerMilliseconds(m_helloInterval));
+         m_helloInterval = m_reconnect.nextInterval(m_helloInterval);
+         m_helloTimer.async_wait(
+            m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleHelloTimer, this,
+                                      boost::asio::placeholders::error)));
+      }
+   }
+
+   void CPicardBoost_Serial::handleStatsTimer(const boost::system::error_code& result)
    {
-      read_async(context, timeout);
-   }   
+      if (result || !isRunning()) {
+         return;
+      }
+      logLinkStats(LOG_ALWAYS, "periodic");
+      logAckStats(LOG_ALWAYS, "periodic");
+      logNotifStats(LOG_ALWAYS, "periodic");
+      if (m_impairment != NULL) {
+         m_impairment->logStats(LOG_ALWAYS, "periodic");
+      }
+      m_statsTimer.expires_from_now(timerMilliseconds(m_statsInterval * 1000));
+      m_statsTimer.async_wait(
+         m_strand.wrap(boost::bind(&CPicardBoost_Serial::handleStatsTimer, this,
+                                   boost::asio::placeholders::error)));
+   }
 
    
    CPicardBoost_UDP::CPicardBoost_UDP(boost::asio::io_service& io_service, uint16_t port, int readTimeout)
       : m_io_service(io_service),
         m_endpoint(udp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port)),
         m_socket(io_service, udp::v4()),
+        m_txLock(),
+        m_txBuffer(MAX_SERIAL_API_FRAME_LEN + 1),
         m_readTimeout(readTimeout)
-   {
-      struct timeval recvtimeout = { m_readTimeout / 1000,
-                                     (m_readTimeout % 1000) * 1000 };
-      
-      // not pretty, but easier than rewriting to use async methods
-      // if/when we convert to async, we should use a deadline timer
-      setsockopt(m_socket.native(), SOL_SOCKET, SO_RCVTIMEO,
-                 (const char*)&recvtimeout, sizeof(struct timeval));
-   }
+   { ; }
 
    CPicardBoost_UDP::~CPicardBoost_UDP() { 
       // TODO: cleanup
    }
 
-   void CPicardBoost_UDP::sendRaw(const ByteVector& data)
+   void CPicardBoost_UDP::writeFrame(const uint8_t* header, size_t headerLen,
+                                     const uint8_t* payload, size_t payloadLen)
    {
+      boost::mutex::scoped_lock guard(m_txLock);
+
       // insert a dummy byte in the front
-      ByteVector withDummy(data.size() + 1);
-      withDummy[0] = 0;
-      copy(data.begin(), data.end(), withDummy.begin()+1);
+      m_txBuffer[0] = 0;
+      std::copy(header, header + headerLen, m_txBuffer.begin()+1);
+      std::copy(payload, payload + payloadLen, m_txBuffer.begin()+1+headerLen);
+      const uint8_t* data = &m_txBuffer[1];
+      size_t len = headerLen + payloadLen;
+
+      int copies = 1;
+      if (m_impairment != NULL) {
+         switch (m_impairment->impair(CLinkImpairment::IMPAIR_TX, &m_txBuffer[1], len,
+                                      monotonicMicroseconds())) {
+         case CLinkImpairment::IMPAIR_DROP:
+            return;
+         case CLinkImpairment::IMPAIR_DUPLICATE:
+            copies = 2;
+            break;
+         case CLinkImpairment::IMPAIR_DELAY:
+            // the writers wait behind the delayed frame
+            boost::this_thread::sleep(boost::posix_time::microseconds(m_impairment->getDelay()));
+            break;
+         default:
+            break;
+         }
+      }
       
       try {
-         m_socket.send_to(boost::asio::buffer(withDummy), m_endpoint);
+         for (int i = 0; i < copies; i++) {
+            m_socket.send_to(boost::asio::buffer(&m_txBuffer[0], len + 1), m_endpoint);
+         }
       }
       catch (const std::exception&) {
          CBoostLog::log("exception (UDP write)");
       }
       
-      CBoostLog::logDump("UDP:Write (first byte excluded)", data);
+      CBoostLog::logDump(LOG_TRACE, "UDP:Write (first byte excluded)", data, len);
    }
 
    // read 
@@ -235,10 +695,23 @@ namespace DustSerialMux {
       CBoostLog::log(LOG_TRACE, "Starting read()");
 
       try {
+         // not pretty, but easier than rewriting to use async methods
+         // if/when we convert to async, we should use a deadline timer
+         // note: SO_RCVTIMEO doesn't do, the blocking receive goes on
+         // waiting for the socket after the timeout
+         fd_set readable;
+         FD_ZERO(&readable);
+         FD_SET(m_socket.native(), &readable);
+         struct timeval readTimeout = { m_readTimeout / 1000, (m_readTimeout % 1000) * 1000 };
+         if (select((int)m_socket.native() + 1, &readable, NULL, NULL, &readTimeout) <= 0) {
+            return;
+         }
+
          ByteVector data(INPUT_BUFFER_LEN);
          
          size_t len = m_socket.receive_from(boost::asio::buffer(data, INPUT_BUFFER_LEN),
                                             m_endpoint);
+         inputReceived();
          // limit input to actual len and strip the first byte
          ByteVector input(data.begin()+1, data.begin()+len);
          
@@ -246,7 +719,10 @@ namespace DustSerialMux {
          prefix << "UDP:Read (" << context << ")";
          CBoostLog::logDump(prefix.str(), input);
          
-         frameComplete(input);
+         if (!input.empty()) {
+            frameComplete(&input[0], input.size());
+            flushNotifs();
+         }
       }
       catch (const std::exception& ex) {
          std::ostringstream msg;
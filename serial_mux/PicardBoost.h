@@ -9,65 +9,170 @@
 
 
 #include "BasePicard.h"
+#include "TxScheduler.h"
+#include "MonotonicTimer.h"
+#include "IoStrand.h"
 
 #include <boost/thread/mutex.hpp>
-#include <boost/thread/condition_variable.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/serial_port.hpp>
 
+#include <deque>
+
 
 namespace DustSerialMux {
 
-   // The output class 
-   class CPicardBoost_Serial : public CBasePicardIO {
+   // The output class, its handlers run on the strand
+   class CPicardBoost_Serial : public CPicardIO<CPicardBoost_Serial> {
    public:
-      CPicardBoost_Serial(boost::asio::io_service& io_service, const std::string& port,
-                          int rtsDelay, bool hwFlowControl, int readTimeout);
+      // baudRate may be any rate the port's driver supports, the rate in
+      // effect is logged
+      // With hwFlowControl (Linux), each frame waits up to writeTimeout for
+      // CTS and then up to writeTimeout to drain from the port
+      CPicardBoost_Serial(CIoStrand& strand, const std::string& port, uint32_t baudRate,
+                          int rtsDelay, bool hwFlowControl, int writeTimeout,
+                          int readTimeout, size_t maxFrameLen, int statsInterval);
 
       virtual ~CPicardBoost_Serial();
 
+      // start reading and sending Hellos on the io_service
+      virtual void start();
+      // the cancelled handlers have run once the strand is idle
+      virtual void stop();
+
+      // input is decoded in the read completion handler
+      virtual bool needsReadThread() const { return false; }
+
       // Callbacks 
       void handleRead(const boost::system::error_code& result, std::size_t bytes);
-      void handleReadTimeout(const boost::system::error_code& result);
+      void handleWrite(const boost::system::error_code& result, std::size_t bytes);
+      void handleHelloTimer(const boost::system::error_code& result);
+      void handleStatsTimer(const boost::system::error_code& result);
+      void handleTxDelayTimer(const boost::system::error_code& result);
+      void handleRxDelayTimer(const boost::system::error_code& result);
+      void handleFlowTimer(const boost::system::error_code& result);
+
+      SAckStats getAckStats() const;
+
+      // Returns: the baud rate read back from the port
+      uint32_t getBaudRate() const { return m_baudRate; }
+
+      void logAckStats(LogLevel level, const std::string& context) const;
+
+      // encode and queue a frame, may be called from any thread
+      void writeFrame(const uint8_t* header, size_t headerLen,
+                      const uint8_t* payload, size_t payloadLen);
 
    protected:
-      virtual void sendRaw(const ByteVector& data);
-      
-      virtual void read(const std::string& context, int timeout);
+      // ACKs are sent from the read completion handler, ahead of the queue
+      virtual void sendAckFrame(uint8_t type, uint8_t seqNo);
+      // called on the strand, from start() and the read handler
+      virtual void startHellos();
+      // delayed frames wait on a timer, the strand isn't stalled
+      virtual void receiveImpaired(const uint8_t* frame, size_t len, uint64_t delay);
 
    private:
-      void read_async(const std::string& context, int timeout);
-
-      boost::asio::io_service& m_io_service;
+      // start reading and sending Hellos, runs on the strand
+      void startIO();
+      void startRead();
+      // write the next queued frame if no write is in progress,
+      // runs on the strand
+      void startWrite();
+      // write m_writing to the port
+      void writeCurrent();
+      // write the rest of m_writing, from m_writeOffset
+      void writeRemaining();
+      // write m_writing, after the RTS/CTS handshake with flow control
+      void sendCurrent();
+      // cancel the outstanding operations, runs on the strand
+      void cancelIO();
+      // set and read back the rate, from the constructor
+      void setBaudRate(const std::string& port, uint32_t baudRate);
+
+      // RTS/CTS handshake, on the strand: RTS is asserted for a frame, the
+      // frame is written once CTS is asserted, and RTS is deasserted once
+      // the port's output has drained (and no other frame is waiting)
+      void requestToSend();
+      void checkCts();
+      void startDrain(size_t bytes);
+      void checkDrain();
+      void releaseRts();
+      void waitFlow(int64_t delay);
+      // Returns: microseconds to send the bytes at the port's rate
+      int64_t sendTime(size_t bytes) const;
+
+      CIoStrand& m_strand;
       
       // serial port options
-      int m_rtsDelay; // millisecond delay before deasserting RTS
+      uint32_t m_baudRate;
+      int m_rtsDelay; // millisecond delay before deasserting RTS, when the
+                      // driver doesn't report its output queue
       bool m_hwFlowControl;
+      int m_writeTimeout; // milliseconds to wait for CTS, and for a frame to drain
       int m_readTimeout; // millisecond timeout for read operations
-      size_t m_readLen;  // bytes read
+      ByteVector m_input; // read buffer, reused for every read
       
       // serial port used for reading from Picard
       boost::asio::serial_port m_serial;
-      boost::mutex m_readLock;
-      boost::condition_variable m_readSem;
-      bool m_readComplete;
+      // HDLC encoded output waiting for the port, the lock protects the queue
+      // and the ACK statistics
+      mutable boost::mutex m_txLock;
+      CTxQueue m_txQueue;
+      STxFrame* m_writing; // frame being written, NULL when the port is idle
+      size_t m_writeOffset; // bytes of m_writing written so far
+      CAckTemplate m_notifAck;
+      SAckStats m_ackStats;
+      uint64_t m_rxTime;   // when the read being decoded completed
+
+      MonotonicTimer m_helloTimer;
+      int m_helloInterval; // milliseconds until the next Hello
+      MonotonicTimer m_statsTimer;
+
+      // link impairment, on the strand
+      struct SDelayedFrame {
+         uint64_t   due;
+         ByteVector frame;
+      };
+      bool m_txRepeat;     // m_writing is written again (duplicated)
+      MonotonicTimer m_txDelayTimer; // holds m_writing
+      std::deque<SDelayedFrame> m_rxDelayed;
+      MonotonicTimer m_rxDelayTimer;
+
+      // flow control, on the strand
+      enum EFlowState {
+         FLOW_IDLE,      // RTS deasserted
+         FLOW_WAIT_CTS,  // RTS asserted for m_writing
+         FLOW_WRITING,
+         FLOW_DRAINING,  // the port's output queue is emptying
+      };
+      EFlowState m_flowState;
+      uint64_t m_flowDeadline; // monotonic microseconds
+      bool m_rtsDelayed;       // the RTS delay replaces the drain
+      MonotonicTimer m_flowTimer;
+      int m_ctsTimeouts;
+      int m_drainTimeouts;
    };
 
-   class CPicardBoost_UDP : public CBasePicardIO {
+   class CPicardBoost_UDP : public CPicardIO<CPicardBoost_UDP> {
    public:
       CPicardBoost_UDP(boost::asio::io_service& io_service, uint16_t port, int readTimeout);
 
       virtual ~CPicardBoost_UDP();
 
+      // send a frame as one datagram
+      void writeFrame(const uint8_t* header, size_t headerLen,
+                      const uint8_t* payload, size_t payloadLen);
+
    protected:
-      virtual void sendRaw(const ByteVector& data);
-      
       virtual void read(const std::string& context, int timeout);
 
    private:
       boost::asio::io_service& m_io_service;
       boost::asio::ip::udp::endpoint m_endpoint;
       boost::asio::ip::udp::socket m_socket;
+      // output datagram, reused for every write
+      boost::mutex m_txLock;
+      ByteVector m_txBuffer;
       
       int m_readTimeout; // millisecond timeout for read operations
       
@@ -8,7 +8,6 @@
 #include "BoostLog.h"
 #include "CLRUtils.h"
 
-#include "serial_mux.h"    // for resetConnection
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 using namespace boost::posix_time;
@@ -1,42 +1,103 @@
-/*
- * Copyright (c) 2010, Dust Networks, Inc.
- */
-
-#ifndef PicardInterfaces_H_
-#define PicardInterfaces_H_
-
-
-#pragma once
-
-#include "Common.h"
-#include "MuxMessageParser.h"
-
-
-namespace DustSerialMux {
-
-   /**
-    * IPicardIO  provides the interface for sending commands to Picard
-    */
-   class IPicardIO {
-   public:
-      virtual uint8_t sendCommand(const CMuxMessage& cmd,
-                                  uint8_t& seqNo, bool retransmit = false) = 0;
-
-      virtual void sendAck(uint8_t type, uint8_t seqNo) = 0;
-   };
-
-   // ----------------------------------------------------------
-   // Picard response/notification callback interface
-
-   class IPicardCallback {
-   public:
-      virtual void commandComplete(uint8_t cmdType, uint8_t seqNo, uint8_t respCode, 
-                                   const ByteVector& payload) = 0;
-
-      virtual void handleNotif(uint8_t notifType, const ByteVector& notif) = 0;
-   };
-
-   
-} // namespace DustSerialMux
-
-#endif  /* ! PicardInterfaces_H_ */
+/*
+ * Copyright (c) 2010, Dust Networks, Inc.
+ */
+
+#ifndef PicardInterfaces_H_
+#define PicardInterfaces_H_
+
+
+#pragma once
+
+#include "Common.h"
+#include "MuxMessageParser.h"
+#include "ApiFrame.h"
+
+
+namespace DustSerialMux {
+
+   /**
+    * A burst of notifications from Picard
+    *
+    * The payloads are views into the received frames, they are only valid
+    * during the handleNotifs call.
+    */
+   class CNotifBatch {
+   public:
+      // the largest batch, a full batch is passed on before the next frame
+      static const size_t MAX_NOTIFS = 16;
+
+      struct SNotif {
+         uint8_t   type;
+         CByteView payload;
+      };
+
+      CNotifBatch() : m_count(0) { ; }
+
+      // the caller passes on a full batch first
+      void push(uint8_t type, const CByteView& payload)
+      {
+         assert(m_count < MAX_NOTIFS);
+         m_notifs[m_count].type = type;
+         m_notifs[m_count].payload = payload;
+         m_count++;
+      }
+
+      void clear() { m_count = 0; }
+
+      size_t size() const { return m_count; }
+      bool empty() const { return m_count == 0; }
+      bool full() const { return m_count == MAX_NOTIFS; }
+
+      const SNotif& operator[](size_t i) const
+      {
+         assert(i < m_count);
+         return m_notifs[i];
+      }
+
+   private:
+      SNotif m_notifs[MAX_NOTIFS];
+      size_t m_count;
+   };
+
+   /**
+    * IPicardIO  provides the interface for sending commands to Picard
+    */
+   class IPicardIO {
+   public:
+      virtual uint8_t sendCommand(const CMuxMessage& cmd,
+                                  uint8_t& seqNo, bool retransmit = false) = 0;
+
+      virtual void sendAck(uint8_t type, uint8_t seqNo) = 0;
+
+      // send a Hello to check that Picard is still there, the Hello Response
+      // starts a new Serial API session
+      // Returns: whether Picard responded within timeout milliseconds
+      virtual bool probe(int timeout) = 0;
+   };
+
+   // ----------------------------------------------------------
+   // Picard response/notification callback interface
+
+   // The payload views point into the frame received from Picard, they are
+   // only valid for the duration of the call.
+   class IPicardCallback {
+   public:
+      virtual void commandComplete(uint8_t cmdType, uint8_t seqNo, uint8_t respCode, 
+                                   const CByteView& payload) = 0;
+
+      // the notifications completed by one read from Picard, in order
+      virtual void handleNotifs(const CNotifBatch& notifs) = 0;
+
+      // the Serial API session to the Manager went down (the Manager reset)
+      // or came back up (Hello Response), only used in soft reset mode
+      virtual void linkStateChanged(bool isUp) = 0;
+
+      // a Hello Response while connected (a probe) started a new Serial API
+      // session, the Manager has dropped the subscriptions
+      virtual void sessionRestarted() = 0;
+   };
+
+   
+} // namespace DustSerialMux
+
+#endif  /* ! PicardInterfaces_H_ */
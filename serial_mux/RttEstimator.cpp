@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "RttEstimator.h"
+
+#include <sstream>
+#include <algorithm>
+
+
+namespace DustSerialMux {
+
+   // the smallest variation term, the timer granularity in RFC 6298
+   const int64_t MIN_RTT_VARIATION = 1000; // microseconds
+
+   CRttEstimator::CRttEstimator(int minTimeout, int maxTimeout)
+      : m_minTimeout(minTimeout),
+        m_maxTimeout(std::max(minTimeout, maxTimeout)),
+        m_overall()
+   { ; }
+
+   int CRttEstimator::timeout(uint8_t type) const
+   {
+      const SRttEstimate& estimate = m_types[type];
+      int result;
+      if (estimate.samples > 0) {
+         result = baseTimeout(estimate);
+      }
+      else if (m_overall.samples > 0) {
+         result = baseTimeout(m_overall);
+      }
+      else {
+         return m_maxTimeout;
+      }
+      for (int i = 0; i < estimate.backoff && result < m_maxTimeout; i++) {
+         result *= 2;
+      }
+      return std::min(result, m_maxTimeout);
+   }
+
+   void CRttEstimator::sample(uint8_t type, uint64_t rtt)
+   {
+      update(m_types[type], (int64_t)rtt);
+      update(m_overall, (int64_t)rtt);
+      m_types[type].backoff = 0;
+   }
+
+   void CRttEstimator::timedOut(uint8_t type)
+   {
+      // enough to reach any maxTimeout from a 1 ms timeout
+      if (m_types[type].backoff < 31) {
+         m_types[type].backoff++;
+      }
+   }
+
+   void CRttEstimator::update(SRttEstimate& estimate, int64_t rtt)
+   {
+      if (estimate.samples == 0) {
+         estimate.srtt = rtt;
+         estimate.rttvar = rtt / 2;
+      }
+      else {
+         // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+         int64_t delta = estimate.srtt - rtt;
+         if (delta < 0) {
+            delta = -delta;
+         }
+         estimate.rttvar = (3 * estimate.rttvar + delta) / 4;
+         estimate.srtt = (7 * estimate.srtt + rtt) / 8;
+      }
+      estimate.samples++;
+   }
+
+   int CRttEstimator::baseTimeout(const SRttEstimate& estimate) const
+   {
+      int64_t rto = estimate.srtt + std::max(MIN_RTT_VARIATION, 4 * estimate.rttvar);
+      // round up to milliseconds
+      int64_t millis = (rto + 999) / 1000;
+      return (int)std::max<int64_t>(m_minTimeout, std::min<int64_t>(millis, m_maxTimeout));
+   }
+
+   void CRttEstimator::logEstimates(LogLevel level, const std::string& context) const
+   {
+      if (m_overall.samples == 0) {
+         return;
+      }
+
+      std::ostringstream msg;
+      msg << "command rtt (" << context << "): all srtt=" << m_overall.srtt
+          << "us rttvar=" << m_overall.rttvar << "us samples=" << m_overall.samples;
+      for (int type = 0; type < 256; type++) {
+         const SRttEstimate& estimate = m_types[type];
+         if (estimate.samples > 0) {
+            msg << ", type " << type << " srtt=" << estimate.srtt
+                << "us rttvar=" << estimate.rttvar << "us timeout="
+                << timeout((uint8_t)type) << "ms samples=" << estimate.samples;
+         }
+      }
+      CBoostLog::log(level, msg.str());
+   }
+
+} // namespace DustSerialMux
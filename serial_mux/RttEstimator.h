@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef RttEstimator_H_
+#define RttEstimator_H_
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "BoostLog.h"
+
+
+namespace DustSerialMux {
+
+   /**
+    * Smoothed round trip time of the commands to Picard
+    */
+   struct SRttEstimate {
+      SRttEstimate() : samples(0), srtt(0), rttvar(0), backoff(0) { ; }
+
+      uint32_t samples;
+      int64_t  srtt;    // smoothed RTT, microseconds
+      int64_t  rttvar;  // RTT variation, microseconds
+      int      backoff; // timeouts since the last sample, each doubles the timeout
+   };
+
+
+   /**
+    * Command timeouts derived from the measured round trip times
+    *
+    * Works like the TCP retransmission timer (RFC 6298): the timeout is the
+    * smoothed RTT plus four times its variation, kept between minTimeout and
+    * maxTimeout. Each command type has its own estimate, because some
+    * commands take much longer for the Manager to process. A type with no
+    * samples yet uses the estimate over all types, and maxTimeout before
+    * the first response.
+    *
+    * Responses to retransmitted commands are not sampled, it's not known
+    * which attempt they answer (Karn's algorithm). Instead, the timeout
+    * backs off after a timeout until the next sample.
+    *
+    * Not thread-safe, only used by the command thread.
+    */
+   class CRttEstimator {
+   public:
+      // timeouts in milliseconds
+      CRttEstimator(int minTimeout, int maxTimeout);
+
+      // Returns: the timeout for the next attempt of a command, in milliseconds
+      int timeout(uint8_t type) const;
+
+      // record the round trip time (in microseconds) of a command that was
+      // answered on the first attempt
+      void sample(uint8_t type, uint64_t rtt);
+
+      // record an attempt without a response
+      void timedOut(uint8_t type);
+
+      const SRttEstimate& getEstimate(uint8_t type) const { return m_types[type]; }
+
+      const SRttEstimate& getOverall() const { return m_overall; }
+
+      // log the estimates of the command types that have samples
+      void logEstimates(LogLevel level, const std::string& context) const;
+
+   private:
+      static void update(SRttEstimate& estimate, int64_t rtt);
+
+      // Returns: the timeout from an estimate without backoff, in milliseconds
+      int baseTimeout(const SRttEstimate& estimate) const;
+
+      int m_minTimeout;
+      int m_maxTimeout;
+      SRttEstimate m_overall;
+      SRttEstimate m_types[256];
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! RttEstimator_H_ */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "SeqWindow.h"
+
+
+namespace DustSerialMux {
+
+   void CSeqWindow::reset()
+   {
+      m_empty = true;
+      m_newest = 0;
+      m_received = 0;
+   }
+
+   bool CSeqWindow::accept(uint8_t seqNo)
+   {
+      m_stats.reliable++;
+      if (m_empty) {
+         m_empty = false;
+         m_newest = seqNo;
+         m_received = 1;
+         return true;
+      }
+
+      int distance = (int8_t)(seqNo - m_newest);
+      if (distance > 0) {
+         // newer than anything so far, the sequence numbers in between are
+         // missing unless they show up late
+         if (distance > 1) {
+            m_stats.gaps++;
+            m_stats.missing += distance - 1;
+         }
+         m_received = (distance < WINDOW_SIZE) ? (m_received << distance) : 0;
+         m_received |= 1;
+         m_newest = seqNo;
+         return true;
+      }
+
+      int age = -distance;
+      if (age < WINDOW_SIZE) {
+         uint64_t bit = (uint64_t)1 << age;
+         if (m_received & bit) {
+            m_stats.duplicates++;
+            return false;
+         }
+         m_received |= bit;
+      }
+      // older than the window, there's no way to tell: pass it on
+      m_stats.outOfOrder++;
+      return true;
+   }
+
+} // namespace DustSerialMux
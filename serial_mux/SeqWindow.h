@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef SeqWindow_H_
+#define SeqWindow_H_
+
+#pragma once
+
+#include <stdint.h>
+
+
+namespace DustSerialMux {
+
+   /**
+    * Reliable notification counters for a Manager session
+    */
+   struct SNotifStats {
+      SNotifStats() : reliable(0), duplicates(0), gaps(0), missing(0), outOfOrder(0) { ; }
+
+      uint32_t reliable;    // reliable notifications received, including duplicates
+      uint32_t duplicates;  // retransmissions that were not passed on
+      uint32_t gaps;        // jumps forward in the sequence numbers
+      uint32_t missing;     // sequence numbers skipped by the gaps
+      uint32_t outOfOrder;  // notifications older than the newest one received
+   };
+
+
+   /**
+    * Duplicate detection for the Manager's 8-bit sequence numbers
+    *
+    * The window remembers which of the last WINDOW_SIZE sequence numbers
+    * (counting back from the newest one) have been received, so a
+    * retransmission is recognized even if other notifications arrived in
+    * between. Sequence numbers are compared modulo 256: anything up to 127
+    * ahead of the newest is new, anything behind it is old.
+    */
+   class CSeqWindow {
+   public:
+      static const int WINDOW_SIZE = 64;
+
+      CSeqWindow() { reset(); }
+
+      // forget the sequence numbers received, for a new Manager session
+      void reset();
+
+      // record a reliable notification
+      // Returns: false if it's a duplicate
+      bool accept(uint8_t seqNo);
+
+      const SNotifStats& getStats() const { return m_stats; }
+
+      void resetStats() { m_stats = SNotifStats(); }
+
+   private:
+      bool     m_empty;
+      uint8_t  m_newest;
+      uint64_t m_received; // bit i: m_newest - i was received
+      SNotifStats m_stats;
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! SeqWindow_H_ */
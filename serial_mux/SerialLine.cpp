@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "SerialLine.h"
+
+#ifdef __linux__
+// the kernel's termios2, <termios.h> can't be included with it
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#endif
+
+
+namespace DustSerialMux {
+
+#ifdef __linux__
+   static boost::system::error_code lastError()
+   {
+      return boost::system::error_code(errno, boost::system::system_category());
+   }
+
+   uint32_t setSerialBaudRate(int fd, uint32_t baudRate, boost::system::error_code& err)
+   {
+      struct termios2 tio;
+      if (ioctl(fd, TCGETS2, &tio) < 0) {
+         err = lastError();
+         return 0;
+      }
+      // BOTHER takes the rate from c_ospeed, a zero input rate is the
+      // output rate
+      tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+      tio.c_cflag |= BOTHER;
+      tio.c_ospeed = baudRate;
+      tio.c_ispeed = 0;
+      if (ioctl(fd, TCSETS2, &tio) < 0) {
+         err = lastError();
+      }
+      // the driver may round the rate to what its clock can divide
+      boost::system::error_code readErr;
+      uint32_t rate = getSerialBaudRate(fd, readErr);
+      if (!err) {
+         err = readErr;
+      }
+      return rate;
+   }
+
+   uint32_t getSerialBaudRate(int fd, boost::system::error_code& err)
+   {
+      struct termios2 tio;
+      if (ioctl(fd, TCGETS2, &tio) < 0) {
+         err = lastError();
+         return 0;
+      }
+      return tio.c_ospeed;
+   }
+
+   void setSerialRts(int fd, bool rts, boost::system::error_code& err)
+   {
+      int bits = TIOCM_RTS;
+      if (ioctl(fd, rts ? TIOCMBIS : TIOCMBIC, &bits) < 0) {
+         err = lastError();
+      }
+   }
+
+   bool getSerialCts(int fd, boost::system::error_code& err)
+   {
+      int bits = 0;
+      if (ioctl(fd, TIOCMGET, &bits) < 0) {
+         err = lastError();
+         return false;
+      }
+      return (bits & TIOCM_CTS) != 0;
+   }
+
+   int getSerialOutputQueue(int fd, boost::system::error_code& err)
+   {
+      int queued = 0;
+      if (ioctl(fd, TIOCOUTQ, &queued) < 0) {
+         err = lastError();
+         return 0;
+      }
+      // the last byte leaves the UART after the queue is empty, USB
+      // adapters and ptys don't report the transmitter
+      unsigned int lsr = 0;
+      if (queued == 0 && ioctl(fd, TIOCSERGETLSR, &lsr) == 0 && !(lsr & TIOCSER_TEMT)) {
+         queued = 1;
+      }
+      return queued;
+   }
+
+   void flushSerialOutput(int fd, boost::system::error_code& err)
+   {
+      if (ioctl(fd, TCFLSH, TCOFLUSH) < 0) {
+         err = lastError();
+      }
+   }
+#endif
+
+} // namespace DustSerialMux
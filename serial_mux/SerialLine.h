@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef SerialLine_H_
+#define SerialLine_H_
+
+#pragma once
+
+#include <stdint.h>
+
+#include <boost/system/error_code.hpp>
+
+
+namespace DustSerialMux {
+
+#ifdef __linux__
+   /**
+    * Linux serial line settings that boost::asio::serial_port doesn't
+    * provide. They take the port's native handle, so that the kernel
+    * termios definitions stay out of the files including asio.
+    */
+
+   // Set the baud rate of the port, standard or not (termios2 and BOTHER),
+   // for both directions
+   // Returns: the rate read back from the driver, 0 if it can't be read
+   uint32_t setSerialBaudRate(int fd, uint32_t baudRate, boost::system::error_code& err);
+
+   // Returns: the output rate of the port, 0 if it can't be read
+   uint32_t getSerialBaudRate(int fd, boost::system::error_code& err);
+
+   // assert or deassert RTS
+   void setSerialRts(int fd, bool rts, boost::system::error_code& err);
+
+   // Returns: whether CTS is asserted
+   bool getSerialCts(int fd, boost::system::error_code& err);
+
+   // Returns: the bytes the driver has yet to send, counting one for a
+   // transmitter that isn't empty if the driver reports it
+   int getSerialOutputQueue(int fd, boost::system::error_code& err);
+
+   // discard the bytes the driver has yet to send
+   void flushSerialOutput(int fd, boost::system::error_code& err);
+#endif
+
+} // namespace DustSerialMux
+
+#endif  /* ! SerialLine_H_ */
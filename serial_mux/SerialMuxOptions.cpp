@@ -7,6 +7,7 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
 
 #include <boost/program_options.hpp>
 using namespace boost::program_options;
@@ -14,6 +15,7 @@ using namespace boost::program_options;
 #include <boost/filesystem.hpp>
 
 #include "Version.h"  // for command line version output
+#include "Common.h"   // for isPicardApiCommand
 
 namespace DustSerialMux {
 
@@ -60,6 +62,87 @@ namespace DustSerialMux {
    }
 
 
+   // Parse a list of Serial API command types, separated by commas or spaces
+   // Returns: false if the list contains anything else
+   bool parseCommandTypes(const std::string& str, std::vector<uint8_t>& types)
+   {
+      std::string list(str);
+      std::replace(list.begin(), list.end(), ',', ' ');
+      std::istringstream in(list);
+      int type;
+      while (in >> type) {
+         if (type < 0 || type > 255 || !isPicardApiCommand((uint8_t)type)) {
+            return false;
+         }
+         types.push_back((uint8_t)type);
+      }
+      return in.eof();
+   }
+
+
+   void setPicardPort(SMuxSessionOptions& session, const std::string& port)
+   {
+      session.serialPort = port;
+      int emulatorPort = atoi(port.c_str());
+      session.useSerial = !(emulatorPort > 0 && emulatorPort < 65535);
+      if (!session.useSerial) {
+         session.emulatorPort = (uint16_t)emulatorPort;
+      }
+   }
+
+
+   // Parse a session option: the Picard port, the listener port, an
+   // optional authentication token and an optional secondary Picard port,
+   // separated by commas. An empty token is the default token.
+   // Returns: false if the option is not valid
+   bool parseSession(const std::string& str, SMuxSessionOptions& session)
+   {
+      std::vector<std::string> fields;
+      std::istringstream in(str);
+      std::string field;
+      while (std::getline(in, field, ',')) {
+         fields.push_back(field);
+      }
+      if (fields.size() < 2 || fields.size() > 4 || fields[0].empty()) {
+         return false;
+      }
+      setPicardPort(session, fields[0]);
+
+      char* end = NULL;
+      long listenerPort = strtol(fields[1].c_str(), &end, 10);
+      if (fields[1].empty() || *end != 0 || listenerPort <= 0 || listenerPort > 65535) {
+         return false;
+      }
+      session.listenerPort = (uint16_t)listenerPort;
+
+      if (fields.size() >= 3 && !fields[2].empty() &&
+          hexToBin(fields[2].c_str(), session.authToken, AUTHENTICATION_LEN) == 0) {
+         return false;
+      }
+      if (fields.size() == 4) {
+         session.secondaryPort = fields[3];
+      }
+      return true;
+   }
+
+
+   // Returns: whether two sessions use the same Picard port, as the Picard
+   // port or the secondary port
+   static bool sharePicardPort(const SMuxSessionOptions& a, const SMuxSessionOptions& b)
+   {
+      const std::string portsA[] = { a.serialPort, a.secondaryPort };
+      const std::string portsB[] = { b.serialPort, b.secondaryPort };
+      for (size_t i = 0; i < ARRAY_LEN(portsA); i++) {
+         for (size_t j = 0; j < ARRAY_LEN(portsB); j++) {
+            if (!portsA[i].empty() && portsA[i] == portsB[j]) {
+               return true;
+            }
+         }
+      }
+      return false;
+   }
+
+
    // parseConfiguration
    // Parse the command line and configuration file.
    // Sets values in options structure.
@@ -70,6 +153,8 @@ namespace DustSerialMux {
                           int argc, char* argv[], std::ostream& out)
    {
       std::string logLevel;
+      std::string idempotentCommands;
+      std::vector<std::string> sessions;
       
       // General options are allowed anywhere
       options_description g("General options");
@@ -77,22 +162,113 @@ namespace DustSerialMux {
          ("port,p",
           value<std::string>(&options.serialPort)->default_value(DEFAULT_SERIAL_PORT),
           "Picard port")
+         ("secondary-port",
+          value<std::string>(&options.secondaryPort)->default_value(std::string(), ""),
+          "Picard port of a redundant Manager or a second adapter, used when the Picard "
+          "port stops answering Hellos. The client connections are kept, as with --soft-reset")
          ("listen,l",
           value<uint16_t>(&options.listenerPort)->default_value(DEFAULT_LISTENER_PORT),
           "Listener port")
          ("accept-anyhost", "Accept connections from any host (instead of localhost only)")
+         ("session",
+          value<std::vector<std::string> >(&sessions)->composing(),
+          "A Manager served by this Serial Mux: \"PORT,LISTEN[,AUTHTOKEN[,SECONDARY]]\", "
+          "once for each Manager. Replaces the port, listen, authToken and secondary-port "
+          "options")
+         ("io-threads",
+          value<int>(&options.ioThreads)->default_value(DEFAULT_IO_THREADS),
+          "Threads serving the Picard ports and the client connections of all the Managers")
+         ("baud",
+          value<uint32_t>(&options.baudRate)->default_value(DEFAULT_BAUD_RATE),
+          "Picard baud rate, any rate the serial port supports (e.g. 460800, 921600)")
          ("rts-delay,d",
-          value<int>(&options.rtsDelay)->default_value(DEFAULT_RTS_DELAY), "RTS delay")
+          value<int>(&options.rtsDelay)->default_value(DEFAULT_RTS_DELAY),
+          "Milliseconds to hold RTS after a write (flow control), when the serial port "
+          "doesn't report how much output it has yet to send")
+         ("write-timeout",
+          value<int>(&options.writeTimeout)->default_value(DEFAULT_WRITE_TIMEOUT),
+          "Milliseconds a frame to Picard waits for CTS, and then to be sent, with "
+          "flow control")
          ("picard-timeout",
           value<int>(&options.picardTimeout)->default_value(DEFAULT_PICARD_TIMEOUT),
           "Picard command timeout")
          ("picard-retries",
           value<int>(&options.picardRetries)->default_value(DEFAULT_PICARD_RETRIES),
           "Picard command retries")
+         ("min-picard-timeout",
+          value<int>(&options.minPicardTimeout)->default_value(DEFAULT_MIN_PICARD_TIMEOUT),
+          "Shortest Picard command timeout, the timeout adapts to the round trip time "
+          "between this and the Picard command timeout")
+         ("failures-before-reset",
+          value<int>(&options.failuresBeforeReset)->default_value(DEFAULT_FAILURES_BEFORE_RESET),
+          "Consecutive Picard commands without a response before the connection is reset")
+         ("probe-timeout",
+          value<int>(&options.probeTimeout)->default_value(DEFAULT_PROBE_TIMEOUT),
+          "Milliseconds to wait for Picard to answer a Hello after a command fails, "
+          "the connection is reset without an answer. 0 to not probe")
          ("read-timeout",
           value<int>(&options.readTimeout)->default_value(DEFAULT_READ_TIMEOUT),
           "Low-level read operation timeout")
-         ("flow-control", "Use RTS flow control")
+         ("max-frame-len",
+          value<int>(&options.maxFrameLen)->default_value(DEFAULT_MAX_FRAME_LEN),
+          "Maximum length of a frame from Picard, longer frames are discarded")
+         ("stats-interval",
+          value<int>(&options.statsInterval)->default_value(DEFAULT_STATS_INTERVAL),
+          "Seconds between serial link statistics log messages, 0 to disable")
+         ("hello-interval",
+          value<int>(&options.helloInterval)->default_value(DEFAULT_HELLO_INTERVAL),
+          "Milliseconds between the first Hellos to Picard, doubles after each Hello")
+         ("max-hello-interval",
+          value<int>(&options.maxHelloInterval)->default_value(DEFAULT_MAX_HELLO_INTERVAL),
+          "Longest interval between Hellos to Picard, milliseconds")
+         ("reopen-interval",
+          value<int>(&options.reopenInterval)->default_value(DEFAULT_REOPEN_INTERVAL),
+          "Milliseconds before retrying to open the Picard port, doubles up to a second")
+         ("soft-reset",
+          "Keep the client connections open when the Manager or the serial link resets, "
+          "clients get a link state event instead")
+         ("hold-commands",
+          value<int>(&options.holdCommands)->default_value(DEFAULT_HOLD_COMMANDS),
+          "Milliseconds to hold client commands while the link to the Manager is down "
+          "(with --soft-reset), held commands are sent when the link is up again")
+         ("failover-timeout",
+          value<int>(&options.failoverTimeout)->default_value(DEFAULT_FAILOVER_TIMEOUT),
+          "Milliseconds to wait for Picard to answer a Hello before failing over to the "
+          "secondary port (or back to the Picard port); a link that is quiet for as long "
+          "is probed with a Hello")
+         ("idempotent-commands",
+          value<std::string>(&idempotentCommands),
+          "Serial API command types that are sent again when the Manager resets while "
+          "they are in progress, e.g. \"46,47\". Other commands fail with a link reset error")
+         ("impair-corrupt",
+          value<double>(&options.impairCorrupt)->default_value(0),
+          "Testing: percentage of the frames to and from Picard with a corrupted byte")
+         ("impair-drop",
+          value<double>(&options.impairDrop)->default_value(0),
+          "Testing: percentage of the frames to and from Picard that are dropped")
+         ("impair-duplicate",
+          value<double>(&options.impairDuplicate)->default_value(0),
+          "Testing: percentage of the frames to and from Picard that are duplicated")
+         ("impair-delay",
+          value<double>(&options.impairDelay)->default_value(0),
+          "Testing: percentage of the frames to and from Picard that are delayed, "
+          "the frames behind a delayed frame wait for it")
+         ("impair-delay-time",
+          value<int>(&options.impairDelayTime)->default_value(DEFAULT_IMPAIR_DELAY),
+          "Testing: milliseconds a delayed frame waits")
+         ("impair-outage",
+          value<double>(&options.impairOutage)->default_value(0),
+          "Testing: percentage of the frames that start an outage of the link, "
+          "all frames are dropped during the outage")
+         ("impair-outage-time",
+          value<int>(&options.impairOutageTime)->default_value(DEFAULT_IMPAIR_OUTAGE),
+          "Testing: milliseconds of a link outage")
+         ("impair-seed",
+          value<uint32_t>(&options.impairSeed)->default_value(DEFAULT_IMPAIR_SEED),
+          "Testing: random seed of the link impairment, the same seed impairs the same frames")
+         ("flow-control",
+          "Use the RTS/CTS handshake with Picard: RTS is asserted for each frame, "
+          "the frame is sent once CTS is asserted (Linux)")
          ("log-level",
           value<std::string>(&logLevel),
           "Minimum level of messages to log")
@@ -159,7 +335,6 @@ namespace DustSerialMux {
       conf_options.add(g);
       conf_options.add_options()
          ("authToken", value<std::string>(&authTokenStr), "Authentication token")
-         ("baud", value<uint32_t>(&options.baudRate), "Picard baud rate")
          ;
 
       // Read config file
@@ -201,6 +376,60 @@ namespace DustSerialMux {
          }
       }
 
+      // the Managers served, sessions without a token use authToken
+      SMuxSessionOptions defaultSession;
+      setPicardPort(defaultSession, options.serialPort);
+      defaultSession.secondaryPort = options.secondaryPort;
+      defaultSession.listenerPort = options.listenerPort;
+      std::copy(options.authToken, options.authToken + AUTHENTICATION_LEN,
+                defaultSession.authToken);
+      options.sessions.clear();
+      for (size_t i = 0; i < sessions.size(); i++) {
+         SMuxSessionOptions session(defaultSession);
+         session.secondaryPort.clear();
+         if (!parseSession(sessions[i], session)) {
+            std::ostringstream msg;
+            msg << "invalid session: " << sessions[i];
+            throw std::invalid_argument(msg.str());
+         }
+         for (size_t j = 0; j < options.sessions.size(); j++) {
+            if (sharePicardPort(options.sessions[j], session) ||
+                options.sessions[j].listenerPort == session.listenerPort) {
+               std::ostringstream msg;
+               msg << "session " << sessions[i] << " shares a port with another session";
+               throw std::invalid_argument(msg.str());
+            }
+         }
+         options.sessions.push_back(session);
+      }
+      if (options.sessions.empty()) {
+         options.sessions.push_back(defaultSession);
+      }
+      for (size_t i = 0; i < options.sessions.size(); i++) {
+         if (options.sessions[i].secondaryPort == options.sessions[i].serialPort) {
+            std::ostringstream msg;
+            msg << "the secondary port is the Picard port: " << options.sessions[i].serialPort;
+            throw std::invalid_argument(msg.str());
+         }
+      }
+
+      if (options.baudRate == 0) {
+         throw std::invalid_argument("invalid baud rate: 0");
+      }
+
+      if (options.rtsDelay < 0 || options.writeTimeout <= 0) {
+         std::ostringstream msg;
+         msg << "invalid flow control timing: RTS delay " << options.rtsDelay
+             << ", write timeout " << options.writeTimeout;
+         throw std::invalid_argument(msg.str());
+      }
+
+      if (options.ioThreads <= 0) {
+         std::ostringstream msg;
+         msg << "invalid number of I/O threads: " << options.ioThreads;
+         throw std::invalid_argument(msg.str());
+      }
+
       // check whether anyhost was specified
       if (vm.count("accept-anyhost")) {
          options.acceptAnyhost = true;
@@ -211,11 +440,72 @@ namespace DustSerialMux {
          options.useFlowControl = true;
       }
 
+      // check whether soft reset was specified
+      if (vm.count("soft-reset")) {
+         options.softReset = true;
+      }
+
       // check whether daemon mode was specified
       if (vm.count("daemon")) {
          options.runAsDaemon = true;
       }
 
+      if (options.helloInterval <= 0 || options.maxHelloInterval < options.helloInterval) {
+         std::ostringstream msg;
+         msg << "invalid hello interval: " << options.helloInterval
+             << ", max " << options.maxHelloInterval;
+         throw std::invalid_argument(msg.str());
+      }
+
+      if (options.minPicardTimeout <= 0 || options.picardTimeout < options.minPicardTimeout) {
+         std::ostringstream msg;
+         msg << "invalid Picard command timeout: " << options.picardTimeout
+             << ", min " << options.minPicardTimeout;
+         throw std::invalid_argument(msg.str());
+      }
+
+      if (options.failuresBeforeReset <= 0 || options.probeTimeout < 0) {
+         std::ostringstream msg;
+         msg << "invalid command failure policy: " << options.failuresBeforeReset
+             << " failures before reset, probe timeout " << options.probeTimeout;
+         throw std::invalid_argument(msg.str());
+      }
+
+      if (options.failoverTimeout <= 0) {
+         std::ostringstream msg;
+         msg << "invalid failover timeout: " << options.failoverTimeout;
+         throw std::invalid_argument(msg.str());
+      }
+
+      if (options.holdCommands < 0) {
+         std::ostringstream msg;
+         msg << "invalid hold time for commands: " << options.holdCommands;
+         throw std::invalid_argument(msg.str());
+      }
+
+      if (vm.count("idempotent-commands") &&
+          !parseCommandTypes(idempotentCommands, options.idempotentCommands)) {
+         std::ostringstream msg;
+         msg << "invalid list of idempotent commands: " << idempotentCommands;
+         throw std::invalid_argument(msg.str());
+      }
+
+      double rates[] = { options.impairCorrupt, options.impairDrop, options.impairDuplicate,
+                         options.impairDelay, options.impairOutage };
+      for (size_t i = 0; i < ARRAY_LEN(rates); i++) {
+         if (rates[i] < 0 || rates[i] > 100) {
+            std::ostringstream msg;
+            msg << "invalid link impairment rate: " << rates[i] << "%";
+            throw std::invalid_argument(msg.str());
+         }
+      }
+      if (options.impairDelayTime < 0 || options.impairOutageTime < 0) {
+         std::ostringstream msg;
+         msg << "invalid link impairment time: delay " << options.impairDelayTime
+             << ", outage " << options.impairOutageTime;
+         throw std::invalid_argument(msg.str());
+      }
+
       // parse the log level
       if (vm.count("log-level")) {
          options.logLevel = stringToEnum(logLevel);
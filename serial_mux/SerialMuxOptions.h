@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include <string>
+#include <vector>
 #include <iostream>
 
 #include "BoostLog.h"  // for log level parameter
@@ -21,16 +22,47 @@ namespace DustSerialMux {
    // Serial parameters
    const char   DEFAULT_SERIAL_PORT[] = "COM1";
    const uint32_t DEFAULT_BAUD_RATE = 115200;
-   const int    DEFAULT_RTS_DELAY = 5; // milliseconds to delay deasserting RTS after a write
+   const int    DEFAULT_RTS_DELAY = 5; // milliseconds to delay deasserting RTS after a write,
+                                       // when the port doesn't report its output queue
    const bool   DEFAULT_FLOW_CONTROL = false;
+   const int    DEFAULT_WRITE_TIMEOUT = 500; // milliseconds to wait for CTS, and for
+                                             // a frame to drain (flow control)
 
    const bool   DEFAULT_TO_SERIAL = true;
 
    const int DEFAULT_PICARD_TIMEOUT = 3000;  // command timeout (how long to wait for
                                              // a response from Picard), milliseconds
    const int DEFAULT_PICARD_RETRIES = 2; // number of times to retry the command to Picard
+   const int DEFAULT_MIN_PICARD_TIMEOUT = 50; // shortest command timeout, milliseconds; the
+                                              // timeout adapts to the command round trip time
+   const int DEFAULT_FAILURES_BEFORE_RESET = 3; // consecutive commands without a response
+                                                // before the connection is reset
+   const int DEFAULT_PROBE_TIMEOUT = 1000; // milliseconds to wait for the Hello Response
+                                           // after a command failure, 0 to not probe
 
    const int DEFAULT_READ_TIMEOUT = 1000; // millisecond timeout for read operation
+
+   const int DEFAULT_MAX_FRAME_LEN = 1024; // longer HDLC frames from Picard are discarded
+   const int DEFAULT_STATS_INTERVAL = 300; // seconds between link statistics log messages
+
+   // Reconnect policy
+   const int DEFAULT_HELLO_INTERVAL = 250;      // milliseconds between the first Hellos,
+                                                // doubles after each Hello
+   const int DEFAULT_MAX_HELLO_INTERVAL = 6000; // longest interval between Hellos
+   const int DEFAULT_REOPEN_INTERVAL = 100;     // milliseconds before retrying to open
+                                                // the Picard port, doubles after each try
+   const int MAX_REOPEN_INTERVAL = 1000;
+   const bool DEFAULT_SOFT_RESET = false;      // keep the client connections when
+                                               // the Manager or the serial link resets
+   const int DEFAULT_HOLD_COMMANDS = 5000;     // milliseconds to hold client commands
+                                               // while the link is down (soft reset)
+   const int DEFAULT_FAILOVER_TIMEOUT = 3000;  // milliseconds to wait for a Hello Response
+                                               // before failing over to the other Picard port
+
+   // Link impairment, for testing: percentages of the frames, none by default
+   const int DEFAULT_IMPAIR_DELAY = 200;        // milliseconds a delayed frame waits
+   const int DEFAULT_IMPAIR_OUTAGE = 2000;      // milliseconds of an outage
+   const uint32_t DEFAULT_IMPAIR_SEED = 1;
    
    // Command line defaults
    const uint16_t DEFAULT_LISTENER_PORT = 9900;
@@ -43,6 +75,9 @@ namespace DustSerialMux {
    const int AUTHENTICATION_LEN = 8;
    const uint8_t DEFAULT_AUTHENTICATION[] = { 48, 49, 50, 51, 52, 53, 54, 55 };
 
+   // threads serving the Picard ports and the clients of all the Managers
+   const int DEFAULT_IO_THREADS = 1;
+
    // Run as daemon / service
    const bool DEFAULT_RUN_AS_DAEMON = false;
    const char DEFAULT_SERVICE_NAME[] = "SerialMux";
@@ -53,6 +88,39 @@ namespace DustSerialMux {
    const int  DEFAULT_MAX_LOG_SIZE = 1000000; // max log size in bytes
    const LogLevel  DEFAULT_LOG_LEVEL = LOG_ERROR;  // see BoostLog.h
    
+   /**
+    * A Manager served by the Serial Mux: its Picard port, client listener
+    * port and authentication token. The session fails over to the
+    * secondary Picard port, if there is one, when the Picard port stops
+    * answering Hellos.
+    */
+   struct SMuxSessionOptions
+   {
+      std::string  serialPort;
+      bool         useSerial;
+      uint16_t     emulatorPort;  // when the Picard port is a UDP port number
+      std::string  secondaryPort; // empty for none
+      uint16_t     listenerPort;
+      uint8_t      authToken[AUTHENTICATION_LEN];
+
+      SMuxSessionOptions()
+         : serialPort(DEFAULT_SERIAL_PORT),
+           useSerial(DEFAULT_TO_SERIAL),
+           emulatorPort(DEFAULT_EMULATOR_PORT),
+           secondaryPort(),
+           listenerPort(DEFAULT_LISTENER_PORT)
+      {
+         std::copy(DEFAULT_AUTHENTICATION, DEFAULT_AUTHENTICATION + AUTHENTICATION_LEN,
+            authToken);
+      }
+   };
+
+   /**
+    * Set the Picard port of a session, a port number selects the UDP
+    * connection to the Manager emulator
+    */
+   void setPicardPort(SMuxSessionOptions& session, const std::string& port);
+
    /** 
     * Serial Mux Options structure
     */
@@ -64,20 +132,47 @@ namespace DustSerialMux {
       // Picard connection
       bool         useSerial;
       std::string  serialPort;
+      std::string  secondaryPort;
       // Serial port parameters
       uint32_t     baudRate;
       bool         useFlowControl;
       int          rtsDelay;
+      int          writeTimeout;
       // Emulator parameters
       uint16_t     emulatorPort;
       // Mux client parameters
       uint16_t     listenerPort;
       bool         acceptAnyhost;
       uint8_t      authToken[AUTHENTICATION_LEN];
+      // the Managers served, from the session options, or the Picard port,
+      // listener port and authentication token above
+      std::vector<SMuxSessionOptions> sessions;
+      int          ioThreads;
       // Picard protocol
       int          picardTimeout;
       int          picardRetries;
+      int          minPicardTimeout;
+      int          failuresBeforeReset;
+      int          probeTimeout;
       int          readTimeout;  // TODO: should this match the higher-level command timeout ?
+      int          maxFrameLen;
+      int          statsInterval;
+      int          helloInterval;
+      int          maxHelloInterval;
+      int          reopenInterval;
+      bool         softReset;
+      int          holdCommands;
+      int          failoverTimeout;
+      std::vector<uint8_t> idempotentCommands; // command types sent again after a reset
+      // Link impairment
+      double       impairCorrupt;
+      double       impairDrop;
+      double       impairDuplicate;
+      double       impairDelay;
+      int          impairDelayTime;
+      double       impairOutage;
+      int          impairOutageTime;
+      uint32_t     impairSeed;
       // Run as daemon / service
       bool         runAsDaemon;
       std::string  serviceName;
@@ -92,15 +187,39 @@ namespace DustSerialMux {
          : configFile(DEFAULT_CONFIG_FILE),
            useSerial(DEFAULT_TO_SERIAL),
            serialPort(DEFAULT_SERIAL_PORT),
+           secondaryPort(),
            baudRate(DEFAULT_BAUD_RATE),
            useFlowControl(DEFAULT_FLOW_CONTROL),
            rtsDelay(DEFAULT_RTS_DELAY),
+           writeTimeout(DEFAULT_WRITE_TIMEOUT),
            emulatorPort(DEFAULT_EMULATOR_PORT),
            listenerPort(DEFAULT_LISTENER_PORT),
            acceptAnyhost(DEFAULT_ACCEPT_ANYHOST),
+           sessions(),
+           ioThreads(DEFAULT_IO_THREADS),
            picardTimeout(DEFAULT_PICARD_TIMEOUT),
            picardRetries(DEFAULT_PICARD_RETRIES),
+           minPicardTimeout(DEFAULT_MIN_PICARD_TIMEOUT),
+           failuresBeforeReset(DEFAULT_FAILURES_BEFORE_RESET),
+           probeTimeout(DEFAULT_PROBE_TIMEOUT),
            readTimeout(DEFAULT_READ_TIMEOUT),
+           maxFrameLen(DEFAULT_MAX_FRAME_LEN),
+           statsInterval(DEFAULT_STATS_INTERVAL),
+           helloInterval(DEFAULT_HELLO_INTERVAL),
+           maxHelloInterval(DEFAULT_MAX_HELLO_INTERVAL),
+           reopenInterval(DEFAULT_REOPEN_INTERVAL),
+           softReset(DEFAULT_SOFT_RESET),
+           holdCommands(DEFAULT_HOLD_COMMANDS),
+           failoverTimeout(DEFAULT_FAILOVER_TIMEOUT),
+           idempotentCommands(),
+           impairCorrupt(0),
+           impairDrop(0),
+           impairDuplicate(0),
+           impairDelay(0),
+           impairDelayTime(DEFAULT_IMPAIR_DELAY),
+           impairOutage(0),
+           impairOutageTime(DEFAULT_IMPAIR_OUTAGE),
+           impairSeed(DEFAULT_IMPAIR_SEED),
            runAsDaemon(DEFAULT_RUN_AS_DAEMON),
            serviceName(DEFAULT_SERVICE_NAME),
            logLevel(DEFAULT_LOG_LEVEL),
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "TxScheduler.h"
+
+#include <string.h>
+#include <algorithm>
+
+
+namespace DustSerialMux {
+
+   // -----------------------------------------------
+   // CTxQueue
+
+   CTxQueue::CTxQueue(size_t capacity)
+      : m_capacity(capacity),
+        m_acks(),
+        m_frames(),
+        m_free(NULL)
+   { ; }
+
+   CTxQueue::~CTxQueue()
+   {
+      STxFrame* frame;
+      while ((frame = pop()) != NULL) {
+         release(frame);
+      }
+      while (m_free != NULL) {
+         frame = m_free;
+         m_free = frame->next;
+         delete frame;
+      }
+   }
+
+   STxFrame* CTxQueue::alloc()
+   {
+      STxFrame* frame = m_free;
+      if (frame != NULL) {
+         m_free = frame->next;
+      } else {
+         frame = new STxFrame(m_capacity);
+      }
+      frame->len = 0;
+      frame->isAck = false;
+      frame->rxTime = 0;
+      frame->next = NULL;
+      return frame;
+   }
+
+   void CTxQueue::push(STxFrame* frame)
+   {
+      if (frame->isAck) {
+         m_acks.push(frame);
+      } else {
+         m_frames.push(frame);
+      }
+   }
+
+   STxFrame* CTxQueue::pop()
+   {
+      STxFrame* frame = m_acks.pop();
+      if (frame == NULL) {
+         frame = m_frames.pop();
+      }
+      return frame;
+   }
+
+   void CTxQueue::release(STxFrame* frame)
+   {
+      frame->next = m_free;
+      m_free = frame;
+   }
+
+   void CTxQueue::SList::push(STxFrame* frame)
+   {
+      frame->next = NULL;
+      if (tail != NULL) {
+         tail->next = frame;
+      } else {
+         head = frame;
+      }
+      tail = frame;
+   }
+
+   STxFrame* CTxQueue::SList::pop()
+   {
+      STxFrame* frame = head;
+      if (frame != NULL) {
+         head = frame->next;
+         if (head == NULL) {
+            tail = NULL;
+         }
+         frame->next = NULL;
+      }
+      return frame;
+   }
+
+
+   // -----------------------------------------------
+   // CAckTemplate
+
+   // Returns: pointer to the next output byte
+   static inline uint8_t* escapeByte(uint8_t* dst, uint8_t b)
+   {
+      if (b == SHDLC::PADDING || b == SHDLC::ESCCHAR) {
+         *dst++ = SHDLC::ESCCHAR;
+         *dst++ = b ^ SHDLC::XORBYTE;
+      } else {
+         *dst++ = b;
+      }
+      return dst;
+   }
+
+   CAckTemplate::CAckTemplate(uint8_t type)
+      : m_type(type),
+        m_prefixLen(0)
+   {
+      const uint8_t control = 3; // Response (ACK) | RELIABLE
+      uint8_t* out = m_prefix;
+      *out++ = SHDLC::PADDING;
+      *out++ = control;
+      out = escapeByte(out, type);
+      m_prefixLen = out - m_prefix;
+
+      uint16_t fcs = CFcs16::update(CFcs16::update(CFcs16::init(), control), type);
+      for (int seqNo = 0; seqNo < 256; seqNo++) {
+         // length = 1, response code = 0
+         uint16_t frameFcs = CFcs16::update(fcs, (uint8_t)seqNo);
+         frameFcs = CFcs16::update(frameFcs, 1);
+         frameFcs = CFcs16::update(frameFcs, 0);
+         m_fcs[seqNo] = CFcs16::close(frameFcs);
+      }
+   }
+
+   size_t CAckTemplate::encode(uint8_t seqNo, uint8_t* dst) const
+   {
+      memcpy(dst, m_prefix, m_prefixLen);
+      uint8_t* out = escapeByte(dst + m_prefixLen, seqNo);
+      *out++ = 1;  // length
+      *out++ = 0;  // response code
+      // the FCS is sent least significant byte first
+      uint16_t fcs = m_fcs[seqNo];
+      out = escapeByte(out, fcs & 0xFF);
+      out = escapeByte(out, (fcs >> 8) & 0xFF);
+      *out++ = SHDLC::PADDING;
+      return out - dst;
+   }
+
+
+   // -----------------------------------------------
+   // SAckStats
+
+   SAckStats::SAckStats()
+      : acks(0),
+        totalLatency(0),
+        maxLatency(0)
+   {
+      std::fill(latencyHistogram, latencyHistogram + LATENCY_BUCKETS, 0);
+   }
+
+   void SAckStats::record(uint64_t latency)
+   {
+      acks++;
+      totalLatency += latency;
+      maxLatency = std::max(maxLatency, latency);
+      latencyHistogram[latencyBucket(latency)]++;
+   }
+
+   double SAckStats::meanLatency() const
+   {
+      return acks ? (double)totalLatency / acks : 0.0;
+   }
+
+   // Returns: floor(log2(latency)), limited to the last bucket
+   int SAckStats::latencyBucket(uint64_t latency)
+   {
+      int bucket = 0;
+      while (latency > 1 && bucket < LATENCY_BUCKETS - 1) {
+         latency >>= 1;
+         bucket++;
+      }
+      return bucket;
+   }
+
+} // namespace DustSerialMux
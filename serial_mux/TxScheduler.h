@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef TxScheduler_H_
+#define TxScheduler_H_
+
+#pragma once
+
+/*
+ * Output scheduling for the serial link to Picard
+ *
+ * Frames are HDLC encoded when they are queued and written one at a time.
+ * ACKs for reliable notifications go ahead of everything else: the Manager
+ * retransmits a notification that isn't acknowledged in time, so an ACK
+ * stuck behind a queue of client commands costs link bandwidth and delays
+ * all the notifications behind it.
+ */
+#include "Common.h"
+#include "HDLC.h"
+
+
+namespace DustSerialMux {
+
+   /**
+    * An HDLC encoded frame waiting for the serial port
+    */
+   struct STxFrame {
+      explicit STxFrame(size_t capacity)
+         : data(capacity), len(0), isAck(false), rxTime(0), next(NULL)
+      { ; }
+
+      ByteVector data;
+      size_t     len;     // encoded length
+      bool       isAck;
+      uint64_t   rxTime;  // ACKs: when the acknowledged notification arrived
+      STxFrame*  next;    // queue link
+   };
+
+
+   /**
+    * Two level output queue: ACKs, then everything else in FIFO order
+    *
+    * The frames are recycled, so the queue stops allocating once it has
+    * seen its largest backlog. The queue is not thread-safe, the transport
+    * serializes access.
+    */
+   class CTxQueue {
+   public:
+      // capacity is the size of each frame buffer
+      explicit CTxQueue(size_t capacity);
+      ~CTxQueue();
+
+      // get an empty frame to fill in, from the pool if possible
+      STxFrame* alloc();
+
+      // queue a filled frame, ACKs go ahead of all other frames
+      void push(STxFrame* frame);
+
+      // Returns: the next frame to send, or NULL if the queue is empty
+      STxFrame* pop();
+
+      // return a frame to the pool once it's sent (or dropped)
+      void release(STxFrame* frame);
+
+      bool empty() const { return m_acks.head == NULL && m_frames.head == NULL; }
+
+      size_t getCapacity() const { return m_capacity; }
+
+   private:
+      struct SList {
+         SList() : head(NULL), tail(NULL) { ; }
+         void push(STxFrame* frame);
+         STxFrame* pop();
+         STxFrame* head;
+         STxFrame* tail;
+      };
+
+      // not copyable, the queue owns its frames
+      CTxQueue(const CTxQueue&);
+      CTxQueue& operator=(const CTxQueue&);
+
+      size_t m_capacity;
+      SList  m_acks;
+      SList  m_frames;
+      STxFrame* m_free;
+   };
+
+
+   /**
+    * Pre-encoded ACK for one Serial API type
+    *
+    * An ACK is [control=3, type, seqNo, length=1, rc=0]. For a given type only
+    * the sequence number and the FCS change, so the encoded frame is built
+    * from a fixed prefix, the escaped sequence number, a fixed tail and the
+    * FCS looked up by sequence number.
+    */
+   class CAckTemplate {
+   public:
+      // flag, 5 bytes of frame and 2 of FCS, all escaped, and flag
+      static const size_t MAX_ENCODED_LEN = 2 + 2 * (5 + SHDLC::FCS_LEN);
+
+      explicit CAckTemplate(uint8_t type);
+
+      uint8_t getType() const { return m_type; }
+
+      // write the encoded ACK to dst, at least MAX_ENCODED_LEN bytes
+      // Returns: the encoded length
+      size_t encode(uint8_t seqNo, uint8_t* dst) const;
+
+   private:
+      uint8_t  m_type;
+      uint8_t  m_prefix[4]; // flag, control, escaped type
+      size_t   m_prefixLen;
+      uint16_t m_fcs[256];  // closed FCS for each sequence number
+   };
+
+
+   /**
+    * ACK latency statistics
+    *
+    * Latency is measured from the completion of the read that contained the
+    * notification's closing flag to the completion of the ACK write.
+    */
+   struct SAckStats {
+      // log2 buckets of microseconds: [0,1], [2,3], [4,7], ... [2^19,)
+      static const int LATENCY_BUCKETS = 20;
+
+      SAckStats();
+
+      void record(uint64_t latency);
+
+      // Returns: mean latency in microseconds
+      double meanLatency() const;
+
+      uint32_t acks;          // ACKs written
+      uint64_t totalLatency;  // microseconds
+      uint64_t maxLatency;    // microseconds
+      uint32_t latencyHistogram[LATENCY_BUCKETS];
+
+      static int latencyBucket(uint64_t latency);
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! TxScheduler_H_ */
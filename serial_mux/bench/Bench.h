@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#pragma once
+
+#ifndef Bench_H_
+#define Bench_H_
+
+/*
+ * Minimal micro-benchmark helpers for the Serial Mux codecs
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sstream>
+
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+
+namespace DustSerialMux {
+namespace Bench {
+
+   // number of timing rounds, the fastest round is reported
+   const int BENCH_ROUNDS = 5;
+
+   // Reproducible input data: a simple LCG so every run sees the same bytes
+   std::vector<uint8_t> makeInput(size_t len, uint32_t seed = 1);
+
+   // Reproducible input with a given share (in percent) of HDLC flag and
+   // escape characters; random data has about 1%
+   std::vector<uint8_t> makeEscapedInput(size_t len, uint32_t seed, int escapePercent);
+
+   // Number of operator new calls made by the calling thread
+   uint64_t allocationCount();
+
+   struct SBenchResult {
+      double nsPerOp;      // fastest round
+      double allocsPerOp;  // heap allocations per call
+   };
+
+   // Time op() for 'iterations' calls, repeated BENCH_ROUNDS times.
+   // Returns: nanoseconds per call for the fastest round, allocations per call
+   template <typename Op>
+   SBenchResult timeOp(Op& op, int iterations)
+   {
+      SBenchResult result = { 0, 0 };
+      for (int r = 0; r < BENCH_ROUNDS; r++) {
+         uint64_t allocs = allocationCount();
+         boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+         for (int i = 0; i < iterations; i++) {
+            op();
+         }
+         boost::posix_time::time_duration elapsed =
+            boost::posix_time::microsec_clock::universal_time() - start;
+         double ns = elapsed.total_microseconds() * 1000.0 / iterations;
+         if (r == 0 || ns < result.nsPerOp) {
+            result.nsPerOp = ns;
+         }
+         if (r == 0) {
+            result.allocsPerOp = (double)(allocationCount() - allocs) / iterations;
+         }
+      }
+      return result;
+   }
+
+   // Print one result line, with the change from the baseline if there is one
+   void report(const std::string& name, size_t bytesPerOp, const SBenchResult& result);
+
+   // Benchmark groups
+   int benchFcs();
+   int benchHdlc();
+   int benchMux();
+   int benchLog();
+   int benchTx();
+
+} // namespace Bench
+} // namespace DustSerialMux
+
+#endif /* ! Bench_H_ */
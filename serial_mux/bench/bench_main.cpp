@@ -0,0 +1,255 @@
+/*
+ * Serial Mux codec micro-benchmarks
+ *
+ * Usage: serial_mux_bench [--baseline FILE] [--save FILE] [--tolerance PERCENT]
+ *
+ * With --baseline, each result is compared with the stored result of the
+ * same name. A benchmark that is slower per byte by more than the tolerance
+ * (default 25%), or that makes more allocations per operation, is reported
+ * as a regression and the program exits with an error.
+ * --save writes the results of this run in the baseline format.
+ *
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "Bench.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <map>
+#include <new>
+
+#ifdef _MSC_VER
+#define BENCH_THREAD_LOCAL __declspec(thread)
+#else
+#define BENCH_THREAD_LOCAL __thread
+#endif
+
+// dynamic exception specifications are gone in C++17
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#define BENCH_NOEXCEPT noexcept
+#else
+#define BENCH_NOEXCEPT throw()
+#endif
+
+
+// Allocation counting
+//
+// Only the allocations of the benchmark thread are counted, the log thread
+// allocates on its own schedule.
+
+static BENCH_THREAD_LOCAL uint64_t allocations = 0;
+
+void* operator new(size_t size)
+{
+   allocations++;
+   void* p = malloc(size ? size : 1);
+   if (p == NULL) {
+      throw std::bad_alloc();
+   }
+   return p;
+}
+
+void* operator new[](size_t size)
+{
+   return operator new(size);
+}
+
+void operator delete(void* p) BENCH_NOEXCEPT
+{
+   free(p);
+}
+
+void operator delete[](void* p) BENCH_NOEXCEPT
+{
+   free(p);
+}
+
+// the sized forms (C++14) go with the replaced unsized ones
+void operator delete(void* p, size_t) BENCH_NOEXCEPT
+{
+   free(p);
+}
+
+void operator delete[](void* p, size_t) BENCH_NOEXCEPT
+{
+   free(p);
+}
+
+
+namespace DustSerialMux {
+namespace Bench {
+
+   // a stored result
+   struct SBaseline {
+      double nsPerByte;
+      double allocsPerOp;
+   };
+
+   typedef std::map<std::string, SBaseline> BaselineMap;
+
+   static BaselineMap baseline;
+   static std::vector<std::pair<std::string, SBaseline> > results;
+   static double tolerance = 0.25;
+   static int regressions = 0;
+
+   // Baseline file: one result per line, "<name> <ns/byte> <allocs/op>",
+   // lines starting with # are comments
+   static bool loadBaseline(const std::string& filename)
+   {
+      std::ifstream in(filename.c_str());
+      if (!in) {
+         return false;
+      }
+      std::string line;
+      while (std::getline(in, line)) {
+         if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+         }
+         // the name may contain spaces, the numbers are the last two fields
+         size_t allocsPos = line.find_last_of(' ');
+         size_t nsPos = (allocsPos == std::string::npos || allocsPos == 0) ?
+            std::string::npos : line.find_last_of(' ', allocsPos - 1);
+         if (line.empty() || line[0] == '#' || nsPos == std::string::npos) {
+            continue;
+         }
+         SBaseline entry;
+         entry.nsPerByte = atof(line.substr(nsPos + 1, allocsPos - nsPos - 1).c_str());
+         entry.allocsPerOp = atof(line.substr(allocsPos + 1).c_str());
+         baseline[line.substr(0, line.find_last_not_of(' ', nsPos) + 1)] = entry;
+      }
+      return true;
+   }
+
+   static bool saveBaseline(const std::string& filename)
+   {
+      std::ofstream out(filename.c_str());
+      if (!out) {
+         return false;
+      }
+      out << "# Serial Mux benchmark baseline: <name> <ns/byte> <allocs/op>" << std::endl;
+      out << std::fixed;
+      for (size_t i = 0; i < results.size(); i++) {
+         out << results[i].first << " "
+             << std::setprecision(3) << results[i].second.nsPerByte << " "
+             << std::setprecision(2) << results[i].second.allocsPerOp << std::endl;
+      }
+      return true;
+   }
+
+   std::vector<uint8_t> makeInput(size_t len, uint32_t seed)
+   {
+      std::vector<uint8_t> data(len);
+      uint32_t x = seed;
+      for (size_t i = 0; i < len; i++) {
+         x = x * 1103515245 + 12345;
+         data[i] = (x >> 16) & 0xFF;
+      }
+      return data;
+   }
+
+   std::vector<uint8_t> makeEscapedInput(size_t len, uint32_t seed, int escapePercent)
+   {
+      std::vector<uint8_t> data(len);
+      uint32_t x = seed;
+      for (size_t i = 0; i < len; i++) {
+         x = x * 1103515245 + 12345;
+         uint8_t b = (x >> 16) & 0xFF;
+         if ((int)((x >> 24) % 100) < escapePercent) {
+            b = (b & 1) ? 0x7E : 0x7D;
+         } else if (b == 0x7E || b == 0x7D) {
+            b ^= 0x01;
+         }
+         data[i] = b;
+      }
+      return data;
+   }
+
+   uint64_t allocationCount()
+   {
+      return allocations;
+   }
+
+   void report(const std::string& name, size_t bytesPerOp, const SBenchResult& result)
+   {
+      SBaseline current;
+      current.nsPerByte = bytesPerOp ? result.nsPerOp / bytesPerOp : 0.0;
+      current.allocsPerOp = result.allocsPerOp;
+      results.push_back(std::make_pair(name, current));
+
+      std::cout << std::left << std::setw(40) << name
+                << std::right << std::fixed << std::setprecision(2)
+                << std::setw(12) << result.nsPerOp << " ns/op"
+                << std::setw(10) << current.nsPerByte << " ns/byte"
+                << std::setw(8) << result.allocsPerOp << " allocs/op";
+
+      BaselineMap::const_iterator base = baseline.find(name);
+      if (base != baseline.end() && base->second.nsPerByte > 0) {
+         double change = current.nsPerByte / base->second.nsPerByte - 1.0;
+         std::cout << std::showpos << std::setw(8) << std::setprecision(0)
+                   << change * 100 << "%" << std::noshowpos;
+         // allocation counts are exact, any increase is a regression
+         if (change > tolerance ||
+             floor(current.allocsPerOp + 0.5) > floor(base->second.allocsPerOp + 0.5)) {
+            std::cout << "  REGRESSION";
+            regressions++;
+         }
+      }
+      std::cout << std::endl;
+   }
+
+} // namespace Bench
+} // namespace DustSerialMux
+
+
+int main(int argc, char* argv[])
+{
+   using namespace DustSerialMux::Bench;
+
+   std::string baselineFile;
+   std::string saveFile;
+   for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--baseline" && i + 1 < argc) {
+         baselineFile = argv[++i];
+      } else if (arg == "--save" && i + 1 < argc) {
+         saveFile = argv[++i];
+      } else if (arg == "--tolerance" && i + 1 < argc) {
+         tolerance = atof(argv[++i]) / 100.0;
+      } else {
+         std::cout << "usage: " << argv[0]
+                   << " [--baseline FILE] [--save FILE] [--tolerance PERCENT]" << std::endl;
+         return 2;
+      }
+   }
+
+   if (!baselineFile.empty() && !loadBaseline(baselineFile)) {
+      std::cout << "error: can not read baseline " << baselineFile << std::endl;
+      return 2;
+   }
+
+   int result = 0;
+   result |= benchFcs();
+   result |= benchHdlc();
+   result |= benchMux();
+   result |= benchLog();
+   result |= benchTx();
+
+   if (!baselineFile.empty()) {
+      std::cout << regressions << " regression(s) against " << baselineFile
+                << " (tolerance " << tolerance * 100 << "%)" << std::endl;
+      if (regressions > 0) {
+         result = 1;
+      }
+   }
+   if (!saveFile.empty() && !saveBaseline(saveFile)) {
+      std::cout << "error: can not write " << saveFile << std::endl;
+      result = 1;
+   }
+
+   return result;
+}
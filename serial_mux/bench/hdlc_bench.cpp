@@ -0,0 +1,185 @@
+/*
+ * HDLC benchmarks: encoding into a vector vs. a caller-owned buffer,
+ * decoding per byte vs. bulk input, virtual handler (CHDLC) vs. static
+ * dispatch (CHDLCDecoder)
+ *
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "Bench.h"
+
+#include "HDLC.h"
+#include "Common.h"
+
+#include <iostream>
+
+
+namespace DustSerialMux {
+namespace Bench {
+
+   struct NullParser : public IHDLCParser {
+      NullParser() : frames(0) { ; }
+      virtual void frameComplete(const uint8_t* frame, size_t len) { frames++; }
+      int frames;
+   };
+
+   // same work as NullParser, called directly by the decoder
+   struct NullHandler {
+      NullHandler() : frames(0) { ; }
+      void frameComplete(const uint8_t* frame, size_t len) { frames++; }
+      int frames;
+   };
+   typedef CHDLCDecoder<NullHandler, 1024> StaticDecoder;
+
+   // Serial API frame sizes: a short command, typical notifications and
+   // the largest frame
+   static const size_t FRAME_LENS[] = { 16, 64, 128, 259 };
+   // share of flag and escape characters in the payload, in percent
+   static const int ESCAPE_PERCENTS[] = { 0, 1, 10 };
+
+   // a serial read's worth of encoded frames
+   static std::vector<uint8_t> encodedStream(size_t frameLen, size_t numFrames, int escapePercent)
+   {
+      std::vector<uint8_t> stream;
+      for (size_t i = 0; i < numFrames; i++) {
+         std::vector<uint8_t> encoded =
+            encodeHDLC(makeEscapedInput(frameLen, (uint32_t)i + 1, escapePercent));
+         stream.insert(stream.end(), encoded.begin(), encoded.end());
+      }
+      return stream;
+   }
+
+   struct EncodeVectorOp {
+      EncodeVectorOp(const std::vector<uint8_t>& in) : data(in), encodedLen(0) { ; }
+      void operator()() { encodedLen += encodeHDLC(data).size(); }
+      const std::vector<uint8_t>& data;
+      size_t encodedLen;
+   };
+
+   struct EncodeBufferOp {
+      EncodeBufferOp(const std::vector<uint8_t>& in)
+         : data(in), buffer(maxEncodedHDLC(in.size())), encodedLen(0) { ; }
+      void operator()() { encodedLen += encodeHDLC(&data[0], data.size(), &buffer[0]); }
+      const std::vector<uint8_t>& data;
+      std::vector<uint8_t> buffer;
+      size_t encodedLen;
+   };
+
+   // CHDLC + NullParser or StaticDecoder + NullHandler
+   template <typename Parser, typename Decoder>
+   struct AddByteOp {
+      AddByteOp(const std::vector<uint8_t>& in) : data(in), parser(), hdlc(1024, &parser) { ; }
+      void operator()() {
+         for (size_t i = 0; i < data.size(); i++) {
+            hdlc.addByte(data[i]);
+         }
+      }
+      const std::vector<uint8_t>& data;
+      Parser parser;
+      Decoder hdlc;
+   };
+
+   template <typename Parser, typename Decoder>
+   struct AddBytesOp {
+      AddBytesOp(const std::vector<uint8_t>& in) : data(in), parser(), hdlc(1024, &parser) { ; }
+      void operator()() { hdlc.addBytes(&data[0], data.size()); }
+      const std::vector<uint8_t>& data;
+      Parser parser;
+      Decoder hdlc;
+   };
+
+   // StaticDecoder with the same constructor as CHDLC
+   struct StaticHDLC : public StaticDecoder {
+      StaticHDLC(size_t maxFrameLen, NullHandler* handler)
+         : StaticDecoder(handler, maxFrameLen) { ; }
+   };
+
+   static int benchEncode()
+   {
+      int result = 0;
+
+      std::cout << "* encodeHDLC" << std::endl;
+      for (size_t f = 0; f < ARRAY_LEN(FRAME_LENS); f++) {
+         for (size_t e = 0; e < ARRAY_LEN(ESCAPE_PERCENTS); e++) {
+            std::vector<uint8_t> data = makeEscapedInput(FRAME_LENS[f], 1, ESCAPE_PERCENTS[e]);
+            int iterations = (int)(2000000 / data.size());
+
+            EncodeVectorOp toVector(data);
+            EncodeBufferOp toBuffer(data);
+            SBenchResult vectorResult = timeOp(toVector, iterations);
+            SBenchResult bufferResult = timeOp(toBuffer, iterations);
+            if (toVector.encodedLen != toBuffer.encodedLen) {
+               std::cout << "error: encoded length mismatch at len=" << FRAME_LENS[f] << std::endl;
+               result = 1;
+            }
+
+            std::ostringstream name;
+            name << "encodeHDLC vector frame=" << FRAME_LENS[f] << " esc=" << ESCAPE_PERCENTS[e] << "%";
+            report(name.str(), data.size(), vectorResult);
+            name.str("");
+            name << "encodeHDLC buffer frame=" << FRAME_LENS[f] << " esc=" << ESCAPE_PERCENTS[e] << "%";
+            report(name.str(), data.size(), bufferResult);
+         }
+      }
+      return result;
+   }
+
+   static int benchDecode()
+   {
+      int result = 0;
+
+      std::cout << "* CHDLC decode" << std::endl;
+      for (size_t f = 0; f < ARRAY_LEN(FRAME_LENS); f++) {
+         for (size_t e = 0; e < ARRAY_LEN(ESCAPE_PERCENTS); e++) {
+            std::vector<uint8_t> stream = encodedStream(FRAME_LENS[f], 8, ESCAPE_PERCENTS[e]);
+            int iterations = (int)(2000000 / stream.size());
+
+            AddByteOp<NullParser, CHDLC> perByte(stream);
+            AddBytesOp<NullParser, CHDLC> bulk(stream);
+            SBenchResult perByteResult = timeOp(perByte, iterations);
+            SBenchResult bulkResult = timeOp(bulk, iterations);
+            if (perByte.parser.frames != bulk.parser.frames) {
+               std::cout << "error: frame count mismatch at len=" << FRAME_LENS[f] << std::endl;
+               result = 1;
+            }
+
+            std::ostringstream suffix;
+            suffix << " frame=" << FRAME_LENS[f] << " esc=" << ESCAPE_PERCENTS[e] << "%";
+            report("hdlc addByte" + suffix.str(), stream.size(), perByteResult);
+            report("hdlc addBytes" + suffix.str(), stream.size(), bulkResult);
+            std::cout << "  speedup: " << perByteResult.nsPerOp / bulkResult.nsPerOp << "x" << std::endl;
+
+            // static dispatch, for typical data only
+            if (ESCAPE_PERCENTS[e] != 1) {
+               continue;
+            }
+            AddByteOp<NullHandler, StaticHDLC> staticPerByte(stream);
+            AddBytesOp<NullHandler, StaticHDLC> staticBulk(stream);
+            SBenchResult staticPerByteResult = timeOp(staticPerByte, iterations);
+            SBenchResult staticBulkResult = timeOp(staticBulk, iterations);
+            if (perByte.parser.frames != staticPerByte.parser.frames ||
+                perByte.parser.frames != staticBulk.parser.frames) {
+               std::cout << "error: frame count mismatch at len=" << FRAME_LENS[f] << std::endl;
+               result = 1;
+            }
+            report("static addByte" + suffix.str(), stream.size(), staticPerByteResult);
+            report("static addBytes" + suffix.str(), stream.size(), staticBulkResult);
+            std::cout << "  static dispatch speedup: addByte "
+                      << perByteResult.nsPerOp / staticPerByteResult.nsPerOp
+                      << "x, addBytes " << bulkResult.nsPerOp / staticBulkResult.nsPerOp
+                      << "x" << std::endl;
+         }
+      }
+      return result;
+   }
+
+   int benchHdlc()
+   {
+      int result = 0;
+      result |= benchEncode();
+      result |= benchDecode();
+      return result;
+   }
+
+} // namespace Bench
+} // namespace DustSerialMux
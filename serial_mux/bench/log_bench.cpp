@@ -0,0 +1,65 @@
+/*
+ * Logging benchmark: hex dumps of serial I/O, filtered and written
+ *
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "Bench.h"
+
+#include "BoostLog.h"
+
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+
+namespace DustSerialMux {
+namespace Bench {
+
+   // the benchmark log, written by the log thread to the temp directory
+   // and deleted, with its backup, when the benchmark is done
+   const char BENCH_LOG_FILE[] = "serial_mux_bench-%%%%%%%%.log";
+
+   struct LogDumpOp {
+      LogDumpOp(LogLevel lvl, const std::vector<uint8_t>& in) : level(lvl), data(in) { ; }
+      void operator()() { CBoostLog::logDump(level, "Serial:Read (bench)", &data[0], data.size()); }
+      LogLevel level;
+      const std::vector<uint8_t>& data;
+   };
+
+   int benchLog()
+   {
+      const size_t sizes[] = { 16, 128, 259 };
+
+      boost::filesystem::path logFile =
+         boost::filesystem::temp_directory_path() / boost::filesystem::unique_path(BENCH_LOG_FILE);
+      // trace output is filtered, as in a production configuration
+      CBoostLog::getInstance().openLog(logFile.string(), 1, 1000000, LOG_INFO);
+
+      std::cout << "* CBoostLog::logDump" << std::endl;
+      for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+         std::vector<uint8_t> data = makeInput(sizes[s], (uint32_t)s + 1);
+
+         LogDumpOp filtered(LOG_TRACE, data);
+         LogDumpOp written(LOG_INFO, data);
+         SBenchResult filteredResult = timeOp(filtered, 100000);
+         // limited so the log thread keeps up
+         SBenchResult writtenResult = timeOp(written, 2000);
+
+         std::ostringstream name;
+         name << "logDump filtered len=" << sizes[s];
+         report(name.str(), sizes[s], filteredResult);
+         name.str("");
+         name << "logDump written len=" << sizes[s];
+         report(name.str(), sizes[s], writtenResult);
+      }
+
+      CBoostLog::getInstance().stop();
+      boost::system::error_code ignored;
+      boost::filesystem::remove(logFile, ignored);
+      boost::filesystem::remove(logFile.string() + ".1", ignored);
+      return 0;
+   }
+
+} // namespace Bench
+} // namespace DustSerialMux
@@ -0,0 +1,100 @@
+/*
+ * Mux protocol benchmarks: client command parsing and response serialization
+ *
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "Bench.h"
+
+#include "MuxMessageParser.h"
+#include "Common.h"
+
+#include <iostream>
+
+
+namespace DustSerialMux {
+namespace Bench {
+
+   // payload sizes, up to the largest Serial API payload
+   static const size_t PAYLOAD_LENS[] = { 16, 64, 128, 255 };
+
+   // number of commands in one client read
+   static const int COMMANDS_PER_READ = 8;
+
+   struct CommandCounter : public ICommandCallback {
+      CommandCounter() : commands(0) { ; }
+      virtual void handleCommand(const CMuxMessage& command) { commands++; }
+      int commands;
+   };
+
+   struct ParserReadOp {
+      ParserReadOp(const ByteVector& in) : data(in), handler(), parser(&handler) { ; }
+      void operator()() { parser.read(data); }
+      const ByteVector& data;
+      CommandCounter handler;
+      CMuxParser parser;
+   };
+
+   struct OutputSerializeOp {
+      OutputSerializeOp(const CMuxOutput& out) : output(out), outputLen(0) { ; }
+      void operator()() { outputLen += output.serialize().size(); }
+      const CMuxOutput& output;
+      size_t outputLen;
+   };
+
+   // what the client manager does for each notification
+   struct OutputBuildOp {
+      OutputBuildOp(const ByteVector& in) : payload(in), outputLen(0) { ; }
+      void operator()() {
+         CMuxOutput output(NOTIFICATION, 0, 1, payload);
+         outputLen += output.serialize().size();
+      }
+      const ByteVector& payload;
+      size_t outputLen;
+   };
+
+   int benchMux()
+   {
+      int result = 0;
+
+      std::cout << "* CMuxParser / CMuxOutput" << std::endl;
+      for (size_t p = 0; p < ARRAY_LEN(PAYLOAD_LENS); p++) {
+         ByteVector payload = makeInput(PAYLOAD_LENS[p], (uint32_t)p + 1);
+
+         // a client read with several commands
+         ByteVector input;
+         for (int i = 0; i < COMMANDS_PER_READ; i++) {
+            ByteVector cmd = CMuxMessage(SUBSCRIBE, payload).serialize();
+            input.insert(input.end(), cmd.begin(), cmd.end());
+         }
+         int iterations = (int)(1000000 / input.size());
+
+         ParserReadOp readOp(input);
+         SBenchResult readResult = timeOp(readOp, iterations);
+         if (readOp.handler.commands != COMMANDS_PER_READ * iterations * BENCH_ROUNDS) {
+            std::cout << "error: command count mismatch at len=" << PAYLOAD_LENS[p] << std::endl;
+            result = 1;
+         }
+
+         CMuxOutput output(NOTIFICATION, 0, 1, payload);
+         OutputSerializeOp serializeOp(output);
+         OutputBuildOp buildOp(payload);
+         iterations = (int)(1000000 / payload.size());
+         SBenchResult serializeResult = timeOp(serializeOp, iterations);
+         SBenchResult buildResult = timeOp(buildOp, iterations);
+
+         std::ostringstream name;
+         name << "CMuxParser read payload=" << PAYLOAD_LENS[p];
+         report(name.str(), input.size(), readResult);
+         name.str("");
+         name << "CMuxOutput serialize payload=" << PAYLOAD_LENS[p];
+         report(name.str(), payload.size(), serializeResult);
+         name.str("");
+         name << "CMuxOutput build+serialize payload=" << PAYLOAD_LENS[p];
+         report(name.str(), payload.size(), buildResult);
+      }
+      return result;
+   }
+
+} // namespace Bench
+} // namespace DustSerialMux
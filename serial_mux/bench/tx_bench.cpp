@@ -0,0 +1,98 @@
+/*
+ * Picard TX path benchmarks: a command from the client's message to an
+ * HDLC encoded frame, through the virtual sendRaw (CBasePicardIO) vs. the
+ * compile-time transport (CPicardIO)
+ *
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "Bench.h"
+
+#include "BasePicard.h"
+#include "Common.h"
+
+#include <iostream>
+
+
+namespace DustSerialMux {
+namespace Bench {
+
+   // payload sizes, up to the largest Serial API payload
+   static const size_t PAYLOAD_LENS[] = { 16, 64, 128, 255 };
+
+   // the frame is built in a temporary buffer and encoded by sendRaw
+   class VirtualTxIO : public CBasePicardIO {
+   public:
+      VirtualTxIO() : encoded(maxEncodedHDLC(MAX_SERIAL_API_FRAME_LEN)), encodedLen(0) { ; }
+
+      std::vector<uint8_t> encoded;
+      size_t encodedLen;
+
+   protected:
+      virtual void sendRaw(const uint8_t* data, size_t len)
+      {
+         encodedLen = encodeHDLC(data, len, &encoded[0]);
+      }
+   };
+
+   // the header and the payload are encoded in place by writeFrame
+   class StaticTxIO : public CPicardIO<StaticTxIO> {
+   public:
+      StaticTxIO() : encoded(maxEncodedHDLC(MAX_SERIAL_API_FRAME_LEN)), encodedLen(0) { ; }
+
+      void writeFrame(const uint8_t* header, size_t headerLen,
+                      const uint8_t* payload, size_t payloadLen)
+      {
+         CHDLCEncoder encoder(&encoded[0]);
+         encoder.append(header, headerLen);
+         encoder.append(payload, payloadLen);
+         encodedLen = encoder.finish();
+      }
+
+      std::vector<uint8_t> encoded;
+      size_t encodedLen;
+   };
+
+   // sendCommand through IPicardIO, as the command thread calls it
+   struct SendCommandOp {
+      SendCommandOp(IPicardIO& io, const CMuxMessage& cmd) : picard(io), command(cmd) { ; }
+      void operator()() { picard.sendCommand(command, seqNo, false); }
+      IPicardIO& picard;
+      const CMuxMessage& command;
+      uint8_t seqNo;
+   };
+
+   int benchTx()
+   {
+      int result = 0;
+
+      std::cout << "* Picard sendCommand" << std::endl;
+      for (size_t p = 0; p < ARRAY_LEN(PAYLOAD_LENS); p++) {
+         CMuxMessage command(0x25, makeInput(PAYLOAD_LENS[p]));
+         int iterations = (int)(4000000 / PAYLOAD_LENS[p]);
+
+         VirtualTxIO virtualIO;
+         StaticTxIO staticIO;
+         SendCommandOp virtualOp(virtualIO, command);
+         SendCommandOp staticOp(staticIO, command);
+         SBenchResult virtualResult = timeOp(virtualOp, iterations);
+         SBenchResult staticResult = timeOp(staticOp, iterations);
+         if (virtualIO.encodedLen != staticIO.encodedLen ||
+             !std::equal(virtualIO.encoded.begin(), virtualIO.encoded.begin() + virtualIO.encodedLen,
+                         staticIO.encoded.begin())) {
+            std::cout << "error: encoded frame mismatch at len=" << PAYLOAD_LENS[p] << std::endl;
+            result = 1;
+         }
+
+         std::ostringstream suffix;
+         suffix << " payload=" << PAYLOAD_LENS[p];
+         report("tx virtual" + suffix.str(), PAYLOAD_LENS[p], virtualResult);
+         report("tx static" + suffix.str(), PAYLOAD_LENS[p], staticResult);
+         std::cout << "  saved per frame: " << virtualResult.nsPerOp - staticResult.nsPerOp
+                   << " ns" << std::endl;
+      }
+      return result;
+   }
+
+} // namespace Bench
+} // namespace DustSerialMux
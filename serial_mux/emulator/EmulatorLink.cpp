@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "EmulatorLink.h"
+
+#include "ApiFrame.h"
+
+#include <boost/bind.hpp>
+
+#include <stdexcept>
+#include <iostream>
+
+#ifndef _WIN32
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#if defined(__APPLE__)
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+#endif
+
+using boost::asio::ip::udp;
+
+
+namespace DustSerialMux {
+
+   // a Serial API frame: header and the largest payload
+   const size_t MAX_FRAME_LEN = CApiFrame::HEADER_LEN + 255;
+
+   const size_t READ_BUFFER_LEN = 4096;
+
+
+   CUdpEmulatorLink::CUdpEmulatorLink(boost::asio::io_service& io_service, uint16_t port)
+      : m_socket(io_service,
+                 udp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port)),
+        m_sender(),
+        m_peer(),
+        m_hasPeer(false),
+        m_input(READ_BUFFER_LEN),
+        m_output(MAX_FRAME_LEN + 1),
+        m_emulator(NULL),
+        m_received()
+   { ; }
+
+   void CUdpEmulatorLink::start(CManagerEmulator* emulator, EmulatorWakeup received)
+   {
+      m_emulator = emulator;
+      m_received = received;
+      startRead();
+   }
+
+   void CUdpEmulatorLink::startRead()
+   {
+      m_socket.async_receive_from(boost::asio::buffer(m_input), m_sender,
+                                  boost::bind(&CUdpEmulatorLink::handleRead, this,
+                                              boost::asio::placeholders::error,
+                                              boost::asio::placeholders::bytes_transferred));
+   }
+
+   void CUdpEmulatorLink::handleRead(const boost::system::error_code& result, std::size_t bytes)
+   {
+      if (result == boost::asio::error::operation_aborted) {
+         return;
+      }
+      if (!result && bytes > 1) {
+         m_peer = m_sender;
+         m_hasPeer = true;
+         // strip the dummy first byte
+         m_emulator->receiveFrame(&m_input[1], bytes - 1, monotonicMicroseconds());
+         m_received();
+      }
+      startRead();
+   }
+
+   void CUdpEmulatorLink::sendFrame(const uint8_t* frame, size_t len)
+   {
+      if (!m_hasPeer || len > MAX_FRAME_LEN) {
+         return;
+      }
+      m_output[0] = 0;
+      std::copy(frame, frame + len, m_output.begin() + 1);
+      boost::system::error_code error;
+      m_socket.send_to(boost::asio::buffer(&m_output[0], len + 1), m_peer, 0, error);
+      if (error) {
+         std::cerr << "UDP write failed: " << error.message() << std::endl;
+      }
+   }
+
+
+#ifndef _WIN32
+   CPtyEmulatorLink::CPtyEmulatorLink(boost::asio::io_service& io_service)
+      : m_master(io_service),
+        m_slave(-1),
+        m_slaveName(),
+        m_decoder(this, MAX_FRAME_LEN),
+        m_input(READ_BUFFER_LEN),
+        m_output(maxEncodedHDLC(MAX_FRAME_LEN)),
+        m_emulator(NULL),
+        m_received()
+   {
+      int master = -1;
+      char name[256] = "";
+      struct termios raw;
+      memset(&raw, 0, sizeof(raw));
+      cfmakeraw(&raw);
+      if (openpty(&master, &m_slave, name, &raw, NULL) < 0) {
+         throw std::runtime_error("can not open a pseudo-terminal");
+      }
+      m_slaveName = name;
+      m_master.assign(master);
+   }
+
+   CPtyEmulatorLink::~CPtyEmulatorLink()
+   {
+      if (m_slave >= 0) {
+         close(m_slave);
+      }
+   }
+
+   void CPtyEmulatorLink::start(CManagerEmulator* emulator, EmulatorWakeup received)
+   {
+      m_emulator = emulator;
+      m_received = received;
+      startRead();
+   }
+
+   void CPtyEmulatorLink::startRead()
+   {
+      m_master.async_read_some(boost::asio::buffer(m_input),
+                               boost::bind(&CPtyEmulatorLink::handleRead, this,
+                                           boost::asio::placeholders::error,
+                                           boost::asio::placeholders::bytes_transferred));
+   }
+
+   void CPtyEmulatorLink::handleRead(const boost::system::error_code& result, std::size_t bytes)
+   {
+      if (result) {
+         if (result != boost::asio::error::operation_aborted) {
+            std::cerr << "pty read failed: " << result.message() << std::endl;
+         }
+         return;
+      }
+      m_decoder.addBytes(&m_input[0], bytes);
+      m_received();
+      startRead();
+   }
+
+   void CPtyEmulatorLink::frameComplete(const uint8_t* frame, size_t len)
+   {
+      m_emulator->receiveFrame(frame, len, monotonicMicroseconds());
+   }
+
+   void CPtyEmulatorLink::sendFrame(const uint8_t* frame, size_t len)
+   {
+      if (len > MAX_FRAME_LEN) {
+         return;
+      }
+      size_t encodedLen = encodeHDLC(frame, len, &m_output[0]);
+      boost::system::error_code error;
+      boost::asio::write(m_master, boost::asio::buffer(&m_output[0], encodedLen),
+                         boost::asio::transfer_all(), error);
+      if (error) {
+         std::cerr << "pty write failed: " << error.message() << std::endl;
+      }
+   }
+#endif
+
+} // namespace DustSerialMux
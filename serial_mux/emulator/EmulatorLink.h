@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef EmulatorLink_H_
+#define EmulatorLink_H_
+
+#pragma once
+
+/*
+ * Transports between the Manager emulator and the mux
+ *
+ * UDP: the datagrams CPicardBoost_UDP sends to 127.0.0.1:<port>, one Serial
+ * API frame after a dummy first byte.
+ * Pseudo-terminal: HDLC frames, as on the Manager's serial port. The mux
+ * opens the slave side like a serial port.
+ */
+#include "ManagerEmulator.h"
+#include "HDLC.h"
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#ifndef _WIN32
+#include <boost/asio/posix/stream_descriptor.hpp>
+#endif
+
+#include <string>
+
+
+namespace DustSerialMux {
+
+   // same as the mux's --port default for the emulator
+   const uint16_t DEFAULT_EMULATOR_UDP_PORT = 60000;
+
+   // the emulator transports run on a single io_service thread, with the
+   // emulator's poll timer; received() is called after each frame, for the
+   // timer to pick up what the frame made due
+   typedef boost::function<void ()> EmulatorWakeup;
+
+   class CUdpEmulatorLink : public IEmulatorLink {
+   public:
+      CUdpEmulatorLink(boost::asio::io_service& io_service, uint16_t port);
+
+      // start reading, received frames go to the emulator
+      void start(CManagerEmulator* emulator, EmulatorWakeup received);
+
+      // to the last sender, nothing is sent before the mux's first datagram
+      virtual void sendFrame(const uint8_t* frame, size_t len);
+
+      void handleRead(const boost::system::error_code& result, std::size_t bytes);
+
+   private:
+      void startRead();
+
+      boost::asio::ip::udp::socket   m_socket;
+      boost::asio::ip::udp::endpoint m_sender;
+      boost::asio::ip::udp::endpoint m_peer;
+      bool       m_hasPeer;
+      ByteVector m_input;
+      ByteVector m_output;
+      CManagerEmulator* m_emulator;
+      EmulatorWakeup    m_received;
+   };
+
+
+#ifndef _WIN32
+   class CPtyEmulatorLink : public IEmulatorLink {
+   public:
+      // Throws: std::runtime_error if no pseudo-terminal can be opened
+      CPtyEmulatorLink(boost::asio::io_service& io_service);
+      virtual ~CPtyEmulatorLink();
+
+      // the device for the mux's --port
+      const std::string& getSlaveName() const { return m_slaveName; }
+
+      void start(CManagerEmulator* emulator, EmulatorWakeup received);
+
+      virtual void sendFrame(const uint8_t* frame, size_t len);
+
+      void handleRead(const boost::system::error_code& result, std::size_t bytes);
+
+      // called by the decoder
+      void frameComplete(const uint8_t* frame, size_t len);
+
+   private:
+      void startRead();
+
+      boost::asio::posix::stream_descriptor m_master;
+      int         m_slave; // kept open so that the master reads don't fail
+                           // while the mux isn't connected
+      std::string m_slaveName;
+      CHDLCDecoder<CPtyEmulatorLink> m_decoder;
+      ByteVector  m_input;
+      ByteVector  m_output;
+      CManagerEmulator* m_emulator;
+      EmulatorWakeup    m_received;
+   };
+#endif
+
+} // namespace DustSerialMux
+
+#endif  /* ! EmulatorLink_H_ */
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "ManagerEmulator.h"
+
+#include <algorithm>
+
+
+namespace DustSerialMux {
+
+   // protocol versions the emulator speaks, the first is the default
+   const uint8_t EMULATOR_PROTOCOL_VERSIONS[] = { 4, 3 };
+
+   // data notification ports, the default application port of the motes
+   const uint16_t DATA_PORT = 0xF0B8;
+
+   // events that come up in a running network: moteJoin, moteOperational,
+   // moteLost, pathCreate, pathDelete
+   const uint8_t EVENT_TYPES[] = { 0x03, 0x04, 0x05, 0x0A, 0x0B };
+
+   // length of the health report after the MAC address
+   const size_t HEALTH_REPORT_LEN = 28;
+
+   // never wait longer than this between polls
+   const uint64_t MAX_POLL_INTERVAL = 100000; // microseconds
+
+   // Returns: microseconds between notifications of one kind over the
+   // whole network, 0 if there are none
+   static uint64_t period(double seconds, int motes)
+   {
+      if (seconds <= 0 || motes <= 0) {
+         return 0;
+      }
+      return std::max<uint64_t>((uint64_t)(seconds * 1000000 / motes), 1);
+   }
+
+   // Returns: microseconds between events at rate per second, 0 for none
+   static uint64_t ratePeriod(double rate)
+   {
+      return rate > 0 ? std::max<uint64_t>((uint64_t)(1000000 / rate), 1) : 0;
+   }
+
+   static void appendUint32(ByteVector& payload, uint32_t value)
+   {
+      payload.push_back((value >> 24) & 0xFF);
+      payload.push_back((value >> 16) & 0xFF);
+      payload.push_back((value >> 8) & 0xFF);
+      payload.push_back(value & 0xFF);
+   }
+
+
+   CManagerEmulator::CManagerEmulator(IEmulatorLink* link, const SEmulatorWorkload& workload)
+      : m_link(link),
+        m_workload(workload),
+        m_stats(),
+        m_connected(false),
+        m_version(EMULATOR_PROTOCOL_VERSIONS[0]),
+        m_lastCmdSeqNo(0),
+        m_lastResponse(),
+        m_filter(),
+        m_responses(),
+        m_nextData(0),
+        m_nextEvent(0),
+        m_nextHealth(0),
+        m_dataMote(0),
+        m_eventMote(0),
+        m_healthMote(0),
+        m_eventId(0),
+        m_mgrSeqNo(0),
+        m_notifQueue(),
+        m_outstanding(false),
+        m_sentTime(0),
+        m_random(workload.seed)
+   { ; }
+
+   void CManagerEmulator::start(uint64_t now)
+   {
+      m_connected = false;
+      m_responses.clear();
+      m_outstanding = false;
+
+      uint8_t payload[] = { m_version, 0 /* mode */ };
+      sendFrame(0, MGR_HELLO, 0, payload, sizeof(payload));
+   }
+
+   void CManagerEmulator::receiveFrame(const uint8_t* frame, size_t len, uint64_t now)
+   {
+      CApiFrame apiFrame(frame, len);
+      if (!apiFrame.isValid()) {
+         return;
+      }
+
+      uint8_t type = apiFrame.type();
+      if (type == HELLO && apiFrame.length() >= 3) {
+         handleHello(apiFrame.seqNo(), apiFrame.payload());
+         // the workload starts over with the session
+         m_nextData = now + period(m_workload.dataInterval, m_workload.motes);
+         m_nextEvent = now + ratePeriod(m_workload.eventRate);
+         m_nextHealth = now + period(m_workload.healthInterval, m_workload.motes);
+      }
+      else if (!m_connected) {
+         // nothing else is handled before a Hello
+      }
+      else if (type == NOTIFICATION && apiFrame.isResponse()) {
+         handleAck(apiFrame.seqNo());
+         sendNotifs(now);
+      }
+      else if (isPicardApiCommand(type) && !apiFrame.isResponse()) {
+         handleCommand(type, apiFrame.seqNo(), apiFrame.payload(), now);
+      }
+   }
+
+   uint64_t CManagerEmulator::poll(uint64_t now)
+   {
+      uint64_t next = now + MAX_POLL_INTERVAL;
+
+      while (!m_responses.empty() && m_responses.front().due <= now) {
+         const ByteVector& frame = m_responses.front().frame;
+         m_link->sendFrame(&frame[0], frame.size());
+         m_responses.pop_front();
+      }
+      if (!m_responses.empty()) {
+         next = std::min(next, m_responses.front().due);
+      }
+
+      if (m_connected) {
+         generate(now);
+         sendNotifs(now);
+
+         if (m_nextData) {
+            next = std::min(next, m_nextData);
+         }
+         if (m_nextEvent) {
+            next = std::min(next, m_nextEvent);
+         }
+         if (m_nextHealth) {
+            next = std::min(next, m_nextHealth);
+         }
+         if (m_outstanding) {
+            next = std::min(next, m_sentTime + (uint64_t)m_workload.ackTimeout * 1000);
+         }
+      }
+      return std::max(next, now);
+   }
+
+   void CManagerEmulator::printStats(std::ostream& out) const
+   {
+      out << "hellos=" << m_stats.hellos
+          << " sessions=" << m_stats.sessions
+          << " commands=" << m_stats.commands
+          << " duplicate-commands=" << m_stats.duplicateCommands
+          << " notifs=" << m_stats.notifs
+          << " retransmits=" << m_stats.retransmits
+          << " acks=" << m_stats.acks
+          << " bad-acks=" << m_stats.badAcks
+          << " dropped=" << m_stats.dropped
+          << " queued=" << m_notifQueue.size() << std::endl;
+   }
+
+
+   // -------------------------------------------------------
+   // Serial API session
+
+   void CManagerEmulator::sendFrame(uint8_t control, uint8_t type, uint8_t seqNo,
+                                    const uint8_t* payload, size_t len)
+   {
+      uint8_t frame[CApiFrame::HEADER_LEN + 255];
+      len = std::min<size_t>(len, 255);
+      frame[0] = control;
+      frame[1] = type;
+      frame[2] = seqNo;
+      frame[3] = (uint8_t)len;
+      std::copy(payload, payload + len, frame + CApiFrame::HEADER_LEN);
+      m_link->sendFrame(frame, CApiFrame::HEADER_LEN + len);
+   }
+
+   void CManagerEmulator::handleHello(uint8_t seqNo, const CByteView& payload)
+   {
+      //struct  spl_hello {
+      //   uint8_t  version;
+      //   uint8_t  cliSeqNo;
+      //   uint8_t  mode;
+      //}
+      m_stats.hellos++;
+      uint8_t version = payload[0];
+      uint8_t cliSeqNo = payload[1];
+      uint8_t successCode = 0;
+      if (std::find(EMULATOR_PROTOCOL_VERSIONS,
+                    EMULATOR_PROTOCOL_VERSIONS + ARRAY_LEN(EMULATOR_PROTOCOL_VERSIONS),
+                    version) == EMULATOR_PROTOCOL_VERSIONS + ARRAY_LEN(EMULATOR_PROTOCOL_VERSIONS)) {
+         // unsupported version: answer with ours, the mux asks again
+         successCode = 1;
+         version = EMULATOR_PROTOCOL_VERSIONS[0];
+      }
+
+      uint8_t response[] = { successCode, version, m_mgrSeqNo, cliSeqNo, 0 /* mode */ };
+      sendFrame(0, HELLO_RESPONSE, seqNo, response, sizeof(response));
+      if (successCode != 0) {
+         return;
+      }
+
+      // a new session: the next command is cliSeqNo + 1, the reliable
+      // notification waiting for an ACK is sent again
+      m_stats.sessions++;
+      m_connected = true;
+      m_version = version;
+      m_lastCmdSeqNo = cliSeqNo;
+      m_lastResponse.clear();
+      m_responses.clear();
+      m_outstanding = false;
+   }
+
+   void CManagerEmulator::handleCommand(uint8_t type, uint8_t seqNo, const CByteView& payload,
+                                        uint64_t now)
+   {
+      if (seqNo == m_lastCmdSeqNo && !m_lastResponse.empty()) {
+         // the response was lost or is still on its way
+         m_stats.duplicateCommands++;
+         if (m_responses.empty()) {
+            m_link->sendFrame(&m_lastResponse[0], m_lastResponse.size());
+         }
+         return;
+      }
+
+      // the response code, then the command's own payload
+      ByteVector response(1, OK);
+      if (type == SUBSCRIBE && payload.size() >= (size_t)SUBSCRIBE_PARAMS_LENGTH) {
+         m_filter = vectorToFilter(payload.toVector());
+      } else {
+         response.insert(response.end(), payload.begin(), payload.end());
+      }
+
+      SPending pending;
+      pending.due = now + (uint64_t)m_workload.latency * 1000;
+      if (m_workload.latencyJitter > 0) {
+         pending.due += (uint64_t)(random() % (m_workload.latencyJitter * 1000 + 1));
+      }
+      // responses go out in order
+      if (!m_responses.empty()) {
+         pending.due = std::max(pending.due, m_responses.back().due);
+      }
+      pending.frame.push_back(CApiFrame::CONTROL_RESPONSE | CApiFrame::CONTROL_RELIABLE);
+      pending.frame.push_back(type);
+      pending.frame.push_back(seqNo);
+      pending.frame.push_back((uint8_t)std::min<size_t>(response.size(), 255));
+      pending.frame.insert(pending.frame.end(), response.begin(),
+                           response.begin() + pending.frame[3]);
+      m_responses.push_back(pending);
+
+      m_stats.commands++;
+      m_lastCmdSeqNo = seqNo;
+      m_lastResponse = pending.frame;
+   }
+
+   void CManagerEmulator::handleAck(uint8_t seqNo)
+   {
+      if (!m_outstanding || seqNo != m_mgrSeqNo) {
+         m_stats.badAcks++;
+         return;
+      }
+      m_stats.acks++;
+      m_notifQueue.pop_front();
+      m_outstanding = false;
+      m_mgrSeqNo++;
+   }
+
+
+   // -------------------------------------------------------
+   // notification workload
+
+   void CManagerEmulator::generate(uint64_t now)
+   {
+      uint64_t dataPeriod = period(m_workload.dataInterval, m_workload.motes);
+      uint64_t eventPeriod = ratePeriod(m_workload.eventRate);
+      uint64_t healthPeriod = period(m_workload.healthInterval, m_workload.motes);
+
+      while (dataPeriod && m_nextData <= now) {
+         queueNotif(NOTIF_DATA, dataNotif(m_dataMote, now));
+         m_dataMote = (m_dataMote + 1) % m_workload.motes;
+         m_nextData += dataPeriod;
+      }
+      while (eventPeriod && m_nextEvent <= now) {
+         queueNotif(NOTIF_EVENT, eventNotif(m_eventMote));
+         m_eventMote = (m_eventMote + 1) % std::max(m_workload.motes, 1);
+         m_nextEvent += eventPeriod;
+      }
+      while (healthPeriod && m_nextHealth <= now) {
+         queueNotif(NOTIF_HEALTH_REPORT, healthNotif(m_healthMote));
+         m_healthMote = (m_healthMote + 1) % m_workload.motes;
+         m_nextHealth += healthPeriod;
+      }
+   }
+
+   void CManagerEmulator::queueNotif(uint8_t notifType, const ByteVector& payload)
+   {
+      // only the subscribed types are sent
+      if (!subscribeFilterMatch(m_filter, notifType)) {
+         return;
+      }
+
+      ByteVector notif(1, notifType);
+      notif.insert(notif.end(), payload.begin(), payload.end());
+      if ((m_filter.unreliable & (1 << notifType)) != 0) {
+         m_stats.notifs++;
+         sendFrame(0, NOTIFICATION, m_mgrSeqNo, &notif[0], notif.size());
+      }
+      else if (m_notifQueue.size() < m_workload.queueLen) {
+         m_notifQueue.push_back(notif);
+      }
+      else {
+         m_stats.dropped++;
+      }
+   }
+
+   void CManagerEmulator::sendNotifs(uint64_t now)
+   {
+      if (m_notifQueue.empty()) {
+         return;
+      }
+      if (!m_outstanding) {
+         m_stats.notifs++;
+      }
+      else if (now >= m_sentTime + (uint64_t)m_workload.ackTimeout * 1000) {
+         m_stats.retransmits++;
+      }
+      else {
+         return;
+      }
+      const ByteVector& notif = m_notifQueue.front();
+      sendFrame(CApiFrame::CONTROL_RELIABLE, NOTIFICATION, m_mgrSeqNo, &notif[0], notif.size());
+      m_outstanding = true;
+      m_sentTime = now;
+   }
+
+   //struct  spl_notifData {
+   //   uint32_t utcSecs;
+   //   uint32_t utcUsecs;
+   //   uint8_t  macAddress[8];
+   //   uint16_t srcPort;
+   //   uint16_t dstPort;
+   //   uint8_t  data[];
+   //}
+   ByteVector CManagerEmulator::dataNotif(uint32_t mote, uint64_t now)
+   {
+      ByteVector payload;
+      appendUint32(payload, (uint32_t)(now / 1000000));
+      appendUint32(payload, (uint32_t)(now % 1000000));
+      appendMac(payload, mote);
+      payload.push_back(DATA_PORT >> 8);
+      payload.push_back(DATA_PORT & 0xFF);
+      payload.push_back(DATA_PORT >> 8);
+      payload.push_back(DATA_PORT & 0xFF);
+      for (int i = 0; i < m_workload.dataLen; i++) {
+         payload.push_back((uint8_t)(mote + i));
+      }
+      return payload;
+   }
+
+   //struct  spl_notifEvent {
+   //   uint32_t eventId;
+   //   uint8_t  eventType;
+   //   uint8_t  macAddress[8];
+   //}
+   ByteVector CManagerEmulator::eventNotif(uint32_t mote)
+   {
+      ByteVector payload;
+      appendUint32(payload, m_eventId);
+      payload.push_back(EVENT_TYPES[m_eventId % ARRAY_LEN(EVENT_TYPES)]);
+      appendMac(payload, mote);
+      m_eventId++;
+      return payload;
+   }
+
+   //struct  spl_notifHealthReport {
+   //   uint8_t  macAddress[8];
+   //   uint8_t  hrData[];
+   //}
+   ByteVector CManagerEmulator::healthNotif(uint32_t mote)
+   {
+      ByteVector payload;
+      appendMac(payload, mote);
+      for (size_t i = 0; i < HEALTH_REPORT_LEN; i++) {
+         payload.push_back((uint8_t)(i * 7 + mote));
+      }
+      return payload;
+   }
+
+   // 00-17-0D-00-00-xx-xx-xx, the mote number starts at 1 (the AP)
+   void CManagerEmulator::appendMac(ByteVector& payload, uint32_t mote)
+   {
+      const uint8_t OUI[] = { 0x00, 0x17, 0x0D, 0x00, 0x00 };
+      payload.insert(payload.end(), OUI, OUI + sizeof(OUI));
+      payload.push_back(((mote + 1) >> 16) & 0xFF);
+      payload.push_back(((mote + 1) >> 8) & 0xFF);
+      payload.push_back((mote + 1) & 0xFF);
+   }
+
+   uint32_t CManagerEmulator::random()
+   {
+      m_random = m_random * 1103515245 + 12345;
+      return (m_random >> 16) & 0x7FFF;
+   }
+
+} // namespace DustSerialMux
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#ifndef ManagerEmulator_H_
+#define ManagerEmulator_H_
+
+#pragma once
+
+/*
+ * SmartMesh Manager emulator
+ *
+ * The Manager side of the Serial API session that CBasePicardIO implements:
+ * Hello / Hello Response, MgrHello, command responses and reliable
+ * notifications with ACKs. The emulator is driven by the caller's clock, so
+ * the same engine runs behind a UDP socket, a pseudo-terminal or directly
+ * in a unit test.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#include <deque>
+#include <iostream>
+
+#include "Common.h"
+#include "ApiFrame.h"
+
+
+namespace DustSerialMux {
+
+   // notification types (the first payload byte of a notification)
+   enum EEmulatorNotifType {
+      NOTIF_EVENT  = 1,
+      NOTIF_DATA   = 4,
+      NOTIF_HEALTH_REPORT = 6,
+   };
+
+
+   /**
+    * Output of the emulator, one Serial API frame at a time
+    */
+   class IEmulatorLink {
+   public:
+      virtual ~IEmulatorLink() { ; }
+
+      // the frame is only valid during the call
+      virtual void sendFrame(const uint8_t* frame, size_t len) = 0;
+   };
+
+
+   /**
+    * What the emulated network sends, and how fast the Manager answers
+    *
+    * The notification rates are spread evenly over time and the motes take
+    * turns, so a run with the same workload sends the same notifications.
+    */
+   struct SEmulatorWorkload {
+      SEmulatorWorkload()
+         : motes(10), dataInterval(30.0), dataLen(40), eventRate(0.1),
+           healthInterval(900.0), latency(20), latencyJitter(0), ackTimeout(500),
+           queueLen(1000), seed(1)
+      { ; }
+
+      int      motes;
+      double   dataInterval;   // seconds between data notifications from a mote, 0 for none
+      int      dataLen;        // application payload of a data notification
+      double   eventRate;      // events per second from the whole network, 0 for none
+      double   healthInterval; // seconds between health reports from a mote, 0 for none
+      int      latency;        // milliseconds before a command is answered
+      int      latencyJitter;  // up to this many milliseconds more, at random
+      int      ackTimeout;     // milliseconds before a reliable notification is sent again
+      size_t   queueLen;       // notifications waiting for the link, more are dropped
+      uint32_t seed;           // for the latency jitter
+   };
+
+
+   struct SEmulatorStats {
+      SEmulatorStats()
+         : hellos(0), sessions(0), commands(0), duplicateCommands(0), notifs(0),
+           retransmits(0), acks(0), badAcks(0), dropped(0)
+      { ; }
+
+      uint32_t hellos;            // Hellos received
+      uint32_t sessions;          // Hello Responses sent
+      uint32_t commands;          // commands answered
+      uint32_t duplicateCommands; // retransmitted commands, answered from the cache
+      uint32_t notifs;            // notifications sent, not counting retransmits
+      uint32_t retransmits;       // reliable notifications sent again
+      uint32_t acks;              // ACKs received
+      uint32_t badAcks;           // ACKs for no outstanding notification
+      uint32_t dropped;           // notifications dropped on a full queue
+   };
+
+
+   /**
+    * One emulated Manager
+    *
+    * Reliable notifications are sent one at a time, the next one goes out
+    * when the previous one is acknowledged. Commands are answered with their
+    * own payload after the configured latency; a subscribe sets the
+    * notification types that are sent, and which of them are unreliable. A
+    * retransmitted command (same sequence number as the last one) gets the
+    * previous response again.
+    *
+    * Not thread-safe, the caller serializes the calls.
+    */
+   class CManagerEmulator {
+   public:
+      CManagerEmulator(IEmulatorLink* link, const SEmulatorWorkload& workload);
+
+      // boot: send a MgrHello and wait for a Hello
+      void start(uint64_t now);
+
+      // handle a Serial API frame from the mux, times are monotonic
+      // microseconds
+      void receiveFrame(const uint8_t* frame, size_t len, uint64_t now);
+
+      // send what's due
+      // Returns: the time of the next thing to do
+      uint64_t poll(uint64_t now);
+
+      bool isConnected() const { return m_connected; }
+
+      const SEmulatorStats& getStats() const { return m_stats; }
+
+      void printStats(std::ostream& out) const;
+
+   private:
+      struct SPending {
+         uint64_t   due;
+         ByteVector frame;
+      };
+
+      void sendFrame(uint8_t control, uint8_t type, uint8_t seqNo,
+                     const uint8_t* payload, size_t len);
+
+      void handleHello(uint8_t seqNo, const CByteView& payload);
+      void handleCommand(uint8_t type, uint8_t seqNo, const CByteView& payload, uint64_t now);
+      void handleAck(uint8_t seqNo);
+
+      // queue the notifications that are due at now
+      void generate(uint64_t now);
+      void queueNotif(uint8_t notifType, const ByteVector& payload);
+      // send the next reliable notification, or the current one again
+      void sendNotifs(uint64_t now);
+
+      ByteVector dataNotif(uint32_t mote, uint64_t now);
+      ByteVector eventNotif(uint32_t mote);
+      ByteVector healthNotif(uint32_t mote);
+      static void appendMac(ByteVector& payload, uint32_t mote);
+
+      uint32_t random();
+
+      IEmulatorLink*    m_link;
+      SEmulatorWorkload m_workload;
+      SEmulatorStats    m_stats;
+
+      bool     m_connected;
+      uint8_t  m_version;       // protocol version of the session
+      uint8_t  m_lastCmdSeqNo;  // sequence number of the last command answered
+      ByteVector m_lastResponse; // for a retransmitted command
+      SubscriptionParams m_filter;
+
+      std::deque<SPending> m_responses; // in order of their due time
+
+      // notification workload, each kind due at its own rate
+      uint64_t m_nextData;
+      uint64_t m_nextEvent;
+      uint64_t m_nextHealth;
+      uint32_t m_dataMote;
+      uint32_t m_eventMote;
+      uint32_t m_healthMote;
+      uint32_t m_eventId;
+
+      uint8_t  m_mgrSeqNo;      // sequence number of the next reliable notification
+      std::deque<ByteVector> m_notifQueue; // reliable notification payloads
+      bool     m_outstanding;   // the front of the queue is waiting for its ACK
+      uint64_t m_sentTime;      // of the outstanding notification
+
+      uint32_t m_random;
+   };
+
+} // namespace DustSerialMux
+
+#endif  /* ! ManagerEmulator_H_ */
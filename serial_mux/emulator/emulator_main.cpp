@@ -0,0 +1,241 @@
+/*
+ * SmartMesh Manager emulator
+ *
+ * Usage: serial_mux_emulator [--udp PORT | --pty] [workload options]
+ *
+ * --udp (the default) answers the mux started with --port PORT (a number
+ * selects the UDP transport of the mux). --pty creates a pseudo-terminal
+ * and prints the device to give to the mux's --port.
+ * The emulated network sends data notifications, events and health reports
+ * at the configured rates once the mux subscribes to them. The statistics
+ * are printed every --stats-interval seconds and at exit (SIGINT, SIGTERM
+ * or after --duration seconds).
+ *
+ * Copyright (c) 2011, Dust Networks, Inc.
+ */
+
+#include "ManagerEmulator.h"
+#include "EmulatorLink.h"
+#include "MonotonicTimer.h"
+#include "Version.h"
+
+#include <signal.h>
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/program_options.hpp>
+
+using namespace DustSerialMux;
+namespace po = boost::program_options;
+
+
+// largest application payload that fits in a data notification
+const int MAX_DATA_LEN = 255 - 1 /* notifType */ - 20 /* spl_notifData */;
+
+// how often the stop flag is checked
+const int STOP_CHECK_INTERVAL = 100; // milliseconds
+
+static volatile sig_atomic_t gStop = 0;
+
+extern "C" void handleSignal(int)
+{
+   gStop = 1;
+}
+
+
+class CEmulatorRunner {
+public:
+   CEmulatorRunner(boost::asio::io_service& io_service, CManagerEmulator& emulator,
+                   int duration, int statsInterval)
+      : m_io_service(io_service),
+        m_emulator(emulator),
+        m_timer(io_service),
+        m_startTime(monotonicMicroseconds()),
+        m_duration((uint64_t)duration * 1000000),
+        m_statsInterval((uint64_t)statsInterval * 1000000),
+        m_nextStats(m_startTime + m_statsInterval)
+   { ; }
+
+   void start()
+   {
+      m_emulator.start(monotonicMicroseconds());
+      schedule(monotonicMicroseconds());
+   }
+
+   // a frame from the mux: a command response may be due sooner than the
+   // timer
+   void received()
+   {
+      uint64_t next = m_emulator.poll(monotonicMicroseconds());
+      if (next < m_timer.expires_at()) {
+         schedule(next);
+      }
+   }
+
+   void handleTimer(const boost::system::error_code& result)
+   {
+      if (result == boost::asio::error::operation_aborted) {
+         return;
+      }
+      uint64_t now = monotonicMicroseconds();
+      if (gStop || (m_duration && now >= m_startTime + m_duration)) {
+         m_io_service.stop();
+         return;
+      }
+      if (m_statsInterval && now >= m_nextStats) {
+         m_emulator.printStats(std::cout);
+         m_nextStats += m_statsInterval;
+      }
+      schedule(m_emulator.poll(now));
+   }
+
+private:
+   void schedule(uint64_t next)
+   {
+      next = std::min(next, monotonicMicroseconds() + timerMilliseconds(STOP_CHECK_INTERVAL));
+      m_timer.expires_at(next);
+      m_timer.async_wait(boost::bind(&CEmulatorRunner::handleTimer, this,
+                                     boost::asio::placeholders::error));
+   }
+
+   boost::asio::io_service& m_io_service;
+   CManagerEmulator& m_emulator;
+   MonotonicTimer    m_timer;
+   uint64_t m_startTime;
+   uint64_t m_duration;
+   uint64_t m_statsInterval;
+   uint64_t m_nextStats;
+};
+
+
+int main(int argc, char* argv[])
+{
+   SEmulatorWorkload workload;
+   int udpPort = DEFAULT_EMULATOR_UDP_PORT;
+   int duration = 0;
+   int statsInterval = 0;
+   int seed = (int)workload.seed;
+   int queueLen = (int)workload.queueLen;
+
+   po::options_description desc("Options");
+   desc.add_options()
+      ("help,h", "print this message")
+      ("version,v", "print the version")
+      ("udp", po::value<int>(&udpPort),
+       "answer the mux's UDP transport on 127.0.0.1:PORT (default)")
+#ifndef _WIN32
+      ("pty", "create a pseudo-terminal for the mux's serial port")
+#endif
+      ("motes", po::value<int>(&workload.motes)->default_value(workload.motes),
+       "motes in the network")
+      ("data-interval", po::value<double>(&workload.dataInterval)->default_value(workload.dataInterval),
+       "seconds between data notifications from a mote, 0 for none")
+      ("data-len", po::value<int>(&workload.dataLen)->default_value(workload.dataLen),
+       "application payload of a data notification")
+      ("event-rate", po::value<double>(&workload.eventRate)->default_value(workload.eventRate),
+       "events per second from the network, 0 for none")
+      ("health-interval", po::value<double>(&workload.healthInterval)->default_value(workload.healthInterval),
+       "seconds between health reports from a mote, 0 for none")
+      ("latency", po::value<int>(&workload.latency)->default_value(workload.latency),
+       "milliseconds before a command is answered")
+      ("latency-jitter", po::value<int>(&workload.latencyJitter)->default_value(workload.latencyJitter),
+       "up to this many milliseconds more, at random")
+      ("ack-timeout", po::value<int>(&workload.ackTimeout)->default_value(workload.ackTimeout),
+       "milliseconds before a reliable notification is sent again")
+      ("queue-len", po::value<int>(&queueLen)->default_value(queueLen),
+       "notifications waiting for the mux, more are dropped")
+      ("seed", po::value<int>(&seed)->default_value(seed),
+       "random seed for the latency jitter")
+      ("duration", po::value<int>(&duration)->default_value(0),
+       "seconds to run, 0 to run until interrupted")
+      ("stats-interval", po::value<int>(&statsInterval)->default_value(0),
+       "seconds between statistics, 0 for statistics at exit only")
+      ;
+
+   po::variables_map vm;
+   try {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+   }
+   catch (const std::exception& ex) {
+      std::cerr << ex.what() << std::endl << desc << std::endl;
+      return 1;
+   }
+   if (vm.count("help")) {
+      std::cout << "Usage: serial_mux_emulator [options]" << std::endl << desc << std::endl;
+      return 0;
+   }
+   if (vm.count("version")) {
+      std::cout << "Serial Mux Manager emulator v" << getVersionString() << std::endl;
+      return 0;
+   }
+
+   std::string error;
+   if (udpPort <= 0 || udpPort > 65535) {
+      error = "invalid UDP port";
+   } else if (workload.motes <= 0) {
+      error = "motes must be positive";
+   } else if (workload.dataLen < 0 || workload.dataLen > MAX_DATA_LEN) {
+      error = "data-len must be between 0 and 234";
+   } else if (workload.dataInterval < 0 || workload.eventRate < 0 || workload.healthInterval < 0) {
+      error = "notification rates can not be negative";
+   } else if (workload.latency < 0 || workload.latencyJitter < 0 || workload.ackTimeout <= 0) {
+      error = "latency, latency-jitter must not be negative, ack-timeout must be positive";
+   } else if (queueLen <= 0) {
+      error = "queue-len must be positive";
+   } else if (duration < 0 || statsInterval < 0) {
+      error = "duration and stats-interval can not be negative";
+   }
+   if (!error.empty()) {
+      std::cerr << "error: " << error << std::endl;
+      return 1;
+   }
+   workload.seed = (uint32_t)seed;
+   workload.queueLen = (size_t)queueLen;
+
+   signal(SIGINT, handleSignal);
+   signal(SIGTERM, handleSignal);
+
+   try {
+      boost::asio::io_service io_service;
+      IEmulatorLink* link = NULL;
+      boost::scoped_ptr<CUdpEmulatorLink> udp;
+#ifndef _WIN32
+      boost::scoped_ptr<CPtyEmulatorLink> pty;
+      if (vm.count("pty")) {
+         pty.reset(new CPtyEmulatorLink(io_service));
+         link = pty.get();
+      } else
+#endif
+      {
+         udp.reset(new CUdpEmulatorLink(io_service, (uint16_t)udpPort));
+         link = udp.get();
+      }
+
+      CManagerEmulator emulator(link, workload);
+      CEmulatorRunner runner(io_service, emulator, duration, statsInterval);
+      EmulatorWakeup received = boost::bind(&CEmulatorRunner::received, &runner);
+#ifndef _WIN32
+      if (pty.get() != NULL) {
+         pty->start(&emulator, received);
+         std::cout << "Manager emulator on " << pty->getSlaveName() << std::endl;
+      }
+#endif
+      if (udp.get() != NULL) {
+         udp->start(&emulator, received);
+         std::cout << "Manager emulator on UDP port " << udpPort << std::endl;
+      }
+
+      runner.start();
+      io_service.run();
+
+      emulator.printStats(std::cout);
+   }
+   catch (const std::exception& ex) {
+      std::cerr << "error: " << ex.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
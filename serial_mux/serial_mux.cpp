@@ -15,20 +15,18 @@
 using namespace std;
 
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/asio.hpp>
 using boost::asio::ip::tcp;
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "BoostLog.h"
 
-#include "BoostClient.h"
-#include "PicardBoost.h"
-#include "BoostClientManager.h"
-#include "BoostClientListener.h"
+#include "MuxSession.h"
 
 #include "Version.h"
 #include "SerialMuxOptions.h"
-#include "serial_mux.h"
 
 
 #ifdef WIN32
@@ -38,200 +36,82 @@ using boost::asio::ip::tcp;
 
 using namespace DustSerialMux;
 
-#ifdef USE_PICARD_CLR
-SerialPort^ connectSerial(String^ port /* serial port */ ) 
-{
-   // Create a new SerialPort object with default settings.
-   SerialPort^ sp = gcnew SerialPort();
-
-   // Allow the user to set the appropriate properties.
-   sp->PortName = port;
-   sp->BaudRate = DEFAULT_BAUD_RATE;
-   //sp->Parity
-   //sp->DataBits
-   //sp->StopBits
-   sp->Handshake = Handshake::None;
-
-   // Set the read/write timeouts
-   sp->ReadTimeout = 500;
-   sp->WriteTimeout = 500;
-
-   sp->Open();
-
-   sp->DtrEnable = 1; // set CTS
-   sp->RtsEnable = 0; // unset RTS (until we're ready to send)
-   return sp;
-}
-#endif
-
 boost::asio::io_service io_service;
 
-CBasePicardIO*        gPicardIO = NULL;
-CBoostClientListener* gListener = NULL;
-CBoostClientManager*  gClientMgr = NULL;
+// the Managers served, the lock protects the list against a stop request
+// while the sessions are created
+std::vector<CMuxSession*> gSessions;
+boost::mutex gSessionsMutex;
 
 // signal to handle waiting for main loop completion from service/daemon stop() operation
 boost::mutex gMuxLoopMutex;
 boost::condition_variable gMuxLoopComplete;
 
-
-void resetConnection()
-{
-   // stop the listener
-   CBoostLog::log(LOG_ALWAYS, "picard connection reset");
-
-   if (gPicardIO) {
-      // close Picard read loop
-      CBoostLog::log("stopping Picard read loop");
-      gPicardIO->reset();
-      gPicardIO->stop();
-   }
-   if (gClientMgr) {
-      // close client connections
-      CBoostLog::log("closing client connections");
-      gClientMgr->closeClients();
-   }
-   if (gListener) {
-      // stop the listener
-      CBoostLog::log("stopping listener");
-      gListener->stop();
-   }
-
-   io_service.stop();
-}
-
-
 bool muxRunning = true;
 SerialMuxOptions opts;
 
 
-// listen thread is to assure we get the protocol version from
-// hello response before async listen get started
-void listen_thread()
+// the I/O threads serve the Picard ports and the clients of all the sessions,
+// a handler's exception is logged instead of taking down the other sessions
+void io_thread()
 {
-    uint8_t version;
-    std::ostringstream msg;
-    
-    CBoostLog::log("listen_thread: waiting for Hello Response");
-    bool picardReady = gPicardIO->waitForHello();
-    version = gPicardIO->getVersion();
-    msg << "listen_thread: got version " << std::dec << (int) version;
-    CBoostLog::log(msg.str());
-    gListener->set_protocolVersion(version);
-    gListener->asyncListen(); 
+   for (;;) {
+      try {
+         io_service.run();
+         return;
+      }
+      catch (const std::exception& ex) {
+         std::ostringstream msg;
+         msg << "error: exception in I/O thread: " << ex.what();
+         CBoostLog::log(LOG_ALWAYS, msg.str());
+      }
+   }
 }
 
+
 // main loop for Serial Mux
 void serial_mux_loop()
 {
-   // allow an external stop command
-   while (muxRunning) {
-      io_service.reset();
-      
-      // connect to Picard
-#ifdef USE_PICARD_CLR
-      SerialPort^ sp = nullptr;
-      UdpClient^ picardSim = nullptr;
+   // the I/O threads run until all the sessions are done
+   boost::scoped_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+   boost::thread_group ioThreads;
+   for (int i = 0; i < opts.ioThreads; i++) {
+      ioThreads.create_thread(io_thread);
+   }
 
-      try {
-         if (opts.useSerial) {
-            String^ serialDevice = gcnew String(opts.serialPort.c_str());
-            sp = connectSerial(serialDevice);
-            std::ostringstream msg;
-            msg << "Connected to serial port " << opts.serialPort;
-            CBoostLog::log(LOG_ALWAYS, msg.str());
-            gPicardIO = new CPicardCLR_Serial(sp, opts.rtsDelay, opts.useFlowControl, opts.readTimeout);
-         } else {
-            picardSim = gcnew UdpClient();
-            picardSim->Connect("127.0.0.1", opts.emulatorPort);
-            gPicardIO = new CPicardCLR_UDP(picardSim, opts.readTimeout);
-         }
-      }
-      catch (Exception^) {
-         CBoostLog::log("error: can not open a connection to Picard, retrying");
-         boost::this_thread::sleep(boost::posix_time::seconds(1));
-         continue;
-      }
-#else
-      try {
-         if (opts.useSerial) {
-            gPicardIO = new CPicardBoost_Serial(io_service, opts.serialPort,
-                                                opts.rtsDelay, opts.useFlowControl, opts.readTimeout);
-            std::ostringstream msg;
-            msg << "Connected to serial port " << opts.serialPort;
-            CBoostLog::log(LOG_ALWAYS, msg.str());
-         }
-         else {
-            gPicardIO = new CPicardBoost_UDP(io_service, opts.emulatorPort, opts.readTimeout);
-         }
-      }
-      catch (const std::exception& ex) {
-         std::ostringstream msg;
-         msg << "error: can not open a connection to Picard, retrying" << ex.what();
-         CBoostLog::log(msg.str());
-         boost::this_thread::sleep(boost::posix_time::seconds(1));
-         continue;
+   {
+      boost::mutex::scoped_lock guard(gSessionsMutex);
+      for (size_t i = 0; muxRunning && i < opts.sessions.size(); i++) {
+         gSessions.push_back(new CMuxSession(io_service, opts, opts.sessions[i]));
       }
-#endif
+   }
+   if (gSessions.size() > 1) {
+      std::ostringstream msg;
+      msg << "serving " << gSessions.size() << " Managers with "
+          << opts.ioThreads << " I/O thread(s)";
+      CBoostLog::log(LOG_ALWAYS, msg.str());
+   }
 
-      // create the client manager
-      gClientMgr = new CBoostClientManager(opts.picardRetries, opts.picardTimeout);
-      gPicardIO->registerCallback(gClientMgr);
+   // each session runs its own main loop, the last one on this thread
+   boost::thread_group sessionThreads;
+   for (size_t i = 0; i + 1 < gSessions.size(); i++) {
+      sessionThreads.create_thread(boost::bind(&CMuxSession::run, gSessions[i]));
+   }
+   if (!gSessions.empty()) {
+      gSessions.back()->run();
+   }
+   sessionThreads.join_all();
 
-      // start output
-      gPicardIO->start();
-      boost::thread picardThread(&CBasePicardIO::threadMain, gPicardIO);
-#ifdef WIN32
-      SetThreadPriority(picardThread.native_handle(), THREAD_PRIORITY_HIGHEST);
-#endif
+   work.reset();
+   io_service.stop();
+   ioThreads.join_all();
 
-      // start command processing thread
-      boost::thread clientThread(&CBoostClientManager::commandLoop,
-                                 gClientMgr, gPicardIO);
-      
-      // start listening
-      gListener = new CBoostClientListener(io_service, opts.listenerPort, !opts.acceptAnyhost,
-                                           *gClientMgr, opts.authToken, 0);
-      boost::thread listenThread(listen_thread);
-  
-      boost::asio::io_service::work work(io_service);
-      
-      io_service.run();
-      
-      CBoostLog::log("stopping components");
-      
-      io_service.reset();
-      
-      // close command processing thread
-      gPicardIO->registerCallback(NULL); // disable callbacks from Picard output
-      gClientMgr->stop();
-      clientThread.join();
-      listenThread.join();
-      
-      // shutdown output
-      gPicardIO->stop();
-      picardThread.join();
-
-      CBoostLog::log("deleting components");
-
-      delete gClientMgr;
-      gClientMgr = NULL;
-
-      delete gListener;
-      gListener = NULL;
-
-      delete gPicardIO;
-      gPicardIO = NULL;
-
-#ifdef USE_PICARD_CLR
-      // close connection to Picard
-      CBoostLog::log("closing Picard connection");
-      if (opts.useSerial) {
-         sp->Close();
-      } else {
-         picardSim->Close();
+   {
+      boost::mutex::scoped_lock guard(gSessionsMutex);
+      for (size_t i = 0; i < gSessions.size(); i++) {
+         delete gSessions[i];
       }
-#endif
+      gSessions.clear();
    }
    
    gMuxLoopComplete.notify_one();   
@@ -251,8 +131,11 @@ void WINAPI serial_mux_start(DWORD argc_, char_* argv_[])
 void serial_mux_stop()
 {
    try {
+      boost::mutex::scoped_lock guard(gSessionsMutex);
       muxRunning = false;
-      resetConnection();
+      for (size_t i = 0; i < gSessions.size(); i++) {
+         gSessions[i]->stop();
+      }
    }
    catch (std::exception& ex) {
       CBoostLog::log("serial_mux_stop: exception");
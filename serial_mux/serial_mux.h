@@ -8,6 +8,23 @@
 //#include <boost/thread.hpp>
 
 
-void resetConnection();
+namespace DustSerialMux {
 
+   /**
+    * A Manager session of the Serial Mux: the connection to one Picard, its
+    * client listener and client manager. The components reset their own
+    * session on fatal link errors, the other sessions are not affected.
+    */
+   class IMuxSession {
+   public:
+      virtual ~IMuxSession() { ; }
 
+      // restart the whole session, the client connections are closed
+      virtual void resetConnection() = 0;
+
+      // reset the connection to Picard after a link error, in soft reset mode
+      // the client connections are kept open
+      virtual void resetPicardConnection() = 0;
+   };
+
+} // namespace DustSerialMux
@@ -0,0 +1,220 @@
+// client_manager_tests.cpp : client manager command handling test cases
+//
+
+#include "BoostClientManager.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace DustSerialMux;
+
+
+// Picard I/O that never responds to commands, and answers probes or not
+class CSilentPicardIO : public IPicardIO {
+public:
+   explicit CSilentPicardIO(bool answerProbes)
+      : probes(0), m_answerProbes(answerProbes), m_commands(0)
+   { ; }
+
+   virtual uint8_t sendCommand(const CMuxMessage& cmd, uint8_t& seqNo, bool retransmit)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      seqNo = (uint8_t)m_commands;
+      if (!retransmit) {
+         m_commands++;
+         m_sent.notify_all();
+      }
+      return seqNo;
+   }
+
+   virtual void sendAck(uint8_t type, uint8_t seqNo) { ; }
+
+   virtual bool probe(int timeout)
+   {
+      probes++;
+      return m_answerProbes;
+   }
+
+   void waitForCommands(int count)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      while (m_commands < count) {
+         m_sent.wait(guard);
+      }
+   }
+
+   int probes;  // only read once the command thread is stopped
+
+private:
+   bool m_answerProbes;
+   boost::mutex m_lock;
+   boost::condition_variable m_sent;
+   int m_commands;
+};
+
+// Picard I/O that records the commands sent, the test answers them
+class CRecordingPicardIO : public IPicardIO {
+public:
+   virtual uint8_t sendCommand(const CMuxMessage& cmd, uint8_t& seqNo, bool retransmit)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      seqNo = (uint8_t)m_types.size();
+      m_types.push_back(cmd.type());
+      m_sent.notify_all();
+      return seqNo;
+   }
+
+   virtual void sendAck(uint8_t type, uint8_t seqNo) { ; }
+
+   virtual bool probe(int timeout) { return true; }
+
+   // Returns: the sequence number of the last command
+   uint8_t waitForCommands(size_t count)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      while (m_types.size() < count) {
+         m_sent.wait(guard);
+      }
+      return (uint8_t)(m_types.size() - 1);
+   }
+
+   std::vector<uint8_t> getTypes()
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      return m_types;
+   }
+
+private:
+   boost::mutex m_lock;
+   boost::condition_variable m_sent;
+   std::vector<uint8_t> m_types;
+};
+
+// take the link down under a command in progress and bring it back up
+static void linkReset(CBoostClientManager& clientMgr)
+{
+   clientMgr.linkStateChanged(false);
+   // let the command thread see the link go down
+   boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+   clientMgr.linkStateChanged(true);
+}
+
+// run commands that all time out through the command loop
+static SEscalationStats failCommands(int count, const SEscalationPolicy& policy,
+                                     CSilentPicardIO& picard)
+{
+   CBoostClientManager clientMgr(1 /* retries */, 1 /* timeout, ms */, 1, policy);
+   for (int i = 0; i < count; i++) {
+      clientMgr.addCommand(CBoostClient::pointer(), CMuxMessage(0x25, ByteVector(3, 0)));
+   }
+   boost::thread commandThread(&CBoostClientManager::commandLoop, &clientMgr, &picard);
+   picard.waitForCommands(count);
+   // the last command is handled before the loop sees the stop
+   clientMgr.stop();
+   commandThread.join();
+   return clientMgr.getEscalationStats();
+}
+
+
+BOOST_AUTO_TEST_CASE(commandFailuresEscalate)
+{
+   // Picard answers the probes: reset after 3 consecutive failures
+   CSilentPicardIO alive(true);
+   SEscalationStats stats = failCommands(7, SEscalationPolicy(3, 100), alive);
+   BOOST_CHECK_EQUAL(stats.commandFailures, 7u);
+   BOOST_CHECK_EQUAL(stats.probes, 5u);
+   BOOST_CHECK_EQUAL(stats.probeFailures, 0u);
+   BOOST_CHECK_EQUAL(stats.resets, 2u);
+   BOOST_CHECK_EQUAL(alive.probes, 5);
+
+   // no answer to the probe: reset right away
+   CSilentPicardIO silent(false);
+   stats = failCommands(2, SEscalationPolicy(3, 100), silent);
+   BOOST_CHECK_EQUAL(stats.probes, 2u);
+   BOOST_CHECK_EQUAL(stats.probeFailures, 2u);
+   BOOST_CHECK_EQUAL(stats.resets, 2u);
+
+   // the default policy resets on the first failure, without a probe
+   CSilentPicardIO unprobed(true);
+   stats = failCommands(2, SEscalationPolicy(), unprobed);
+   BOOST_CHECK_EQUAL(stats.probes, 0u);
+   BOOST_CHECK_EQUAL(stats.resets, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(commandsHeldAcrossLinkReset)
+{
+   const uint8_t IDEMPOTENT = 0x30;
+   const uint8_t UNSAFE = 0x31;
+   CBoostClientManager clientMgr(1 /* retries */, 5000 /* timeout, ms */, 1);
+   SHoldPolicy hold(2000);
+   hold.setIdempotent(IDEMPOTENT);
+   clientMgr.setHoldPolicy(hold);
+   BOOST_CHECK(hold.isIdempotent(SUBSCRIBE));
+   BOOST_CHECK(!hold.isIdempotent(UNSAFE));
+
+   CRecordingPicardIO picard;
+   clientMgr.addCommand(CBoostClient::pointer(), CMuxMessage(IDEMPOTENT, ByteVector(3, 0)));
+   clientMgr.addCommand(CBoostClient::pointer(), CMuxMessage(UNSAFE, ByteVector(3, 0)));
+   boost::thread commandThread(&CBoostClientManager::commandLoop, &clientMgr, &picard);
+
+   // the idempotent command is sent again in the new session
+   picard.waitForCommands(1);
+   linkReset(clientMgr);
+   uint8_t seqNo = picard.waitForCommands(2);
+   clientMgr.commandComplete(IDEMPOTENT, seqNo, 0, CByteView());
+
+   // the other one fails, and the next command goes out
+   picard.waitForCommands(3);
+   linkReset(clientMgr);
+   clientMgr.addCommand(CBoostClient::pointer(), CMuxMessage(IDEMPOTENT, ByteVector(3, 0)));
+   seqNo = picard.waitForCommands(4);
+   clientMgr.commandComplete(IDEMPOTENT, seqNo, 0, CByteView());
+
+   // a queued command waits for the link, and is sent when it's up
+   clientMgr.linkStateChanged(false);
+   clientMgr.addCommand(CBoostClient::pointer(), CMuxMessage(UNSAFE, ByteVector(3, 0)));
+   boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+   clientMgr.linkStateChanged(true);
+   seqNo = picard.waitForCommands(5);
+   clientMgr.commandComplete(UNSAFE, seqNo, 0, CByteView());
+
+   clientMgr.stop();
+   commandThread.join();
+
+   const uint8_t expected[] = { IDEMPOTENT, IDEMPOTENT, UNSAFE, IDEMPOTENT, UNSAFE };
+   BOOST_CHECK(picard.getTypes() == std::vector<uint8_t>(expected, expected + 5));
+}
+
+BOOST_AUTO_TEST_CASE(rttEstimatorTimeouts)
+{
+   CRttEstimator rtt(50, 3000);
+   // the longest timeout until there's a response
+   BOOST_CHECK_EQUAL(rtt.timeout(0x25), 3000);
+
+   // first sample: SRTT = R, RTTVAR = R/2, so the timeout is 3R
+   rtt.sample(0x25, 20000);
+   BOOST_CHECK_EQUAL(rtt.timeout(0x25), 60);
+   // a steady RTT converges on the RTT, not less than the shortest timeout
+   for (int i = 0; i < 50; i++) {
+      rtt.sample(0x25, 20000);
+   }
+   BOOST_CHECK_EQUAL(rtt.timeout(0x25), 50);
+   // a type without samples uses the estimate over all types
+   BOOST_CHECK_EQUAL(rtt.timeout(0x30), 50);
+
+   // timeouts back off up to the longest timeout, until the next sample
+   rtt.timedOut(0x25);
+   BOOST_CHECK_EQUAL(rtt.timeout(0x25), 100);
+   for (int i = 0; i < 10; i++) {
+      rtt.timedOut(0x25);
+   }
+   BOOST_CHECK_EQUAL(rtt.timeout(0x25), 3000);
+   rtt.sample(0x25, 20000);
+   BOOST_CHECK_EQUAL(rtt.timeout(0x25), 50);
+
+   // a slow command type gets its own timeout
+   rtt.sample(0x30, 500000);
+   BOOST_CHECK_EQUAL(rtt.timeout(0x30), 1500);
+   BOOST_CHECK_EQUAL(rtt.getEstimate(0x30).samples, 1u);
+   BOOST_CHECK_EQUAL(rtt.getOverall().samples, 53u);
+}
@@ -0,0 +1,181 @@
+// emulator_tests.cpp : Manager emulator test cases, against the mux's own
+// Serial API session
+//
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "BasePicard.h"
+#include "emulator/ManagerEmulator.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace DustSerialMux;
+
+
+const uint8_t TEST_CMD_TYPE = 0x25;
+
+// the session's frames go to the emulator and back, on the caller's thread
+class CEmulatedPicardIO : public CBasePicardIO, public IEmulatorLink {
+public:
+   CEmulatedPicardIO(const SEmulatorWorkload& workload)
+      : emulator(this, workload), m_now(0)
+   { ; }
+
+   CManagerEmulator emulator;
+
+   void connect()
+   {
+      sendHello(0);
+      run(m_now);
+   }
+
+   // deliver the frames sent so far, then move the clock to now and send
+   // what the emulator has due
+   void run(uint64_t now)
+   {
+      deliver();
+      m_now = now;
+      emulator.poll(m_now);
+      deliver();
+   }
+
+   // from the emulator
+   virtual void sendFrame(const uint8_t* frame, size_t len)
+   {
+      m_toMux.push_back(ByteVector(frame, frame + len));
+   }
+
+protected:
+   // from the session
+   virtual void sendRaw(const uint8_t* data, size_t len)
+   {
+      m_toManager.push_back(ByteVector(data, data + len));
+   }
+
+private:
+   // in both directions until neither side has anything more to say
+   void deliver()
+   {
+      while (!m_toManager.empty() || !m_toMux.empty()) {
+         if (!m_toManager.empty()) {
+            ByteVector frame = m_toManager.front();
+            m_toManager.pop_front();
+            emulator.receiveFrame(&frame[0], frame.size(), m_now);
+         }
+         if (!m_toMux.empty()) {
+            ByteVector frame = m_toMux.front();
+            m_toMux.pop_front();
+            frameComplete(&frame[0], frame.size());
+            flushNotifs();
+         }
+      }
+   }
+
+   std::deque<ByteVector> m_toManager;
+   std::deque<ByteVector> m_toMux;
+   uint64_t m_now;
+};
+
+// records what the session passes on
+struct EmulatorRecorder : public IPicardCallback {
+   virtual void commandComplete(uint8_t cmdType, uint8_t seqNo, uint8_t respCode,
+                                const CByteView& payload)
+   {
+      responses.push_back(payload.toVector());
+   }
+
+   virtual void handleNotifs(const CNotifBatch& batch)
+   {
+      for (size_t i = 0; i < batch.size(); i++) {
+         notifTypes.push_back(batch[i].type);
+      }
+   }
+
+   virtual void linkStateChanged(bool isUp) { ; }
+
+   virtual void sessionRestarted() { ; }
+
+   std::vector<ByteVector> responses;
+   std::vector<uint8_t> notifTypes;
+};
+
+static void subscribe(CEmulatedPicardIO& picard, int filter, uint64_t now)
+{
+   ByteVector params(SUBSCRIBE_PARAMS_LENGTH);
+   filterToVector(SubscriptionParams(filter, 0), params);
+   uint8_t seqNo;
+   picard.sendCommand(CMuxMessage(SUBSCRIBE, params), seqNo, false);
+   picard.run(now);
+}
+
+
+BOOST_AUTO_TEST_CASE(emulatorAnswersAfterLatency)
+{
+   SEmulatorWorkload workload;
+   workload.latency = 20;
+   CEmulatedPicardIO picard(workload);
+   EmulatorRecorder recorder;
+   picard.registerCallback(&recorder);
+
+   picard.connect();
+   BOOST_CHECK(picard.emulator.isConnected());
+   BOOST_CHECK_EQUAL(picard.getVersion(), 4);
+
+   ByteVector payload;
+   payload.push_back(1);
+   payload.push_back(2);
+   uint8_t seqNo;
+   picard.sendCommand(CMuxMessage(TEST_CMD_TYPE, payload), seqNo, false);
+   picard.run(10000);
+   // retransmitted while the response is on its way: answered once
+   picard.sendCommand(CMuxMessage(TEST_CMD_TYPE, payload), seqNo, true);
+   picard.run(19999);
+   BOOST_CHECK(recorder.responses.empty());
+   picard.run(20000);
+   BOOST_REQUIRE_EQUAL(recorder.responses.size(), 1U);
+   // the command's payload comes back
+   BOOST_CHECK(recorder.responses[0] == payload);
+   BOOST_CHECK_EQUAL(picard.emulator.getStats().commands, 1U);
+   BOOST_CHECK_EQUAL(picard.emulator.getStats().duplicateCommands, 1U);
+
+   // the next command has the next sequence number
+   picard.sendCommand(CMuxMessage(TEST_CMD_TYPE, payload), seqNo, false);
+   picard.run(40000);
+   BOOST_CHECK_EQUAL(recorder.responses.size(), 2U);
+   BOOST_CHECK_EQUAL(picard.emulator.getStats().commands, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(emulatorSendsSubscribedNotifs)
+{
+   SEmulatorWorkload workload;
+   workload.motes = 5;
+   workload.dataInterval = 1.0;  // a data notification every 200 ms
+   workload.eventRate = 0;
+   workload.healthInterval = 0;
+   workload.latency = 0;
+   CEmulatedPicardIO picard(workload);
+   EmulatorRecorder recorder;
+   picard.registerCallback(&recorder);
+
+   picard.connect();
+   // nothing is sent before the subscription
+   picard.run(1000000);
+   BOOST_CHECK(recorder.notifTypes.empty());
+
+   subscribe(picard, 1 << NOTIF_DATA, 1000000);
+   for (uint64_t now = 1000000; now <= 3000000; now += 100000) {
+      picard.run(now);
+   }
+   // one per mote per second, each acknowledged before the next
+   BOOST_CHECK_EQUAL(recorder.notifTypes.size(), 10U);
+   BOOST_CHECK(std::count(recorder.notifTypes.begin(), recorder.notifTypes.end(),
+                          (uint8_t)NOTIF_DATA) == 10);
+   const SEmulatorStats& stats = picard.emulator.getStats();
+   BOOST_CHECK_EQUAL(stats.notifs, 10U);
+   BOOST_CHECK_EQUAL(stats.acks, 10U);
+   BOOST_CHECK_EQUAL(stats.retransmits, 0U);
+   BOOST_CHECK_EQUAL(picard.getNotifStats().gaps, 0U);
+   BOOST_CHECK_EQUAL(picard.getNotifStats().duplicates, 0U);
+}
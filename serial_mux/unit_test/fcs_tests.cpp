@@ -0,0 +1,85 @@
+// fcs_tests.cpp : FCS-16 test cases
+//
+
+#include <vector>
+
+#include "FCS16.h"
+#include "HDLC.h"
+
+#include <boost/test/unit_test.hpp>
+
+
+// the FCS computed one bit at a time from the polynomial, independent of
+// the tables
+static uint16_t bitwiseFCS16(const std::vector<uint8_t>& data)
+{
+   uint16_t fcs = FCS16_INIT;
+   for (size_t i = 0; i < data.size(); i++) {
+      fcs ^= data[i];
+      for (int bit = 0; bit < 8; bit++) {
+         fcs = (fcs & 1) ? (fcs >> 1) ^ FCS16_POLY : fcs >> 1;
+      }
+   }
+   return fcs ^ 0xFFFF;
+}
+
+// reproducible test data
+static std::vector<uint8_t> testData(size_t len, uint32_t seed)
+{
+   std::vector<uint8_t> data(len);
+   uint32_t x = seed;
+   for (size_t i = 0; i < len; i++) {
+      x = x * 1103515245 + 12345;
+      data[i] = (x >> 16) & 0xFF;
+   }
+   return data;
+}
+
+
+BOOST_AUTO_TEST_CASE(fcsCheckValue)
+{
+   // standard check value for the X.25 CRC-16
+   const char check[] = "123456789";
+   BOOST_CHECK_EQUAL(computeFCS16((const uint8_t*)check, 9), 0x906E);
+
+   std::vector<uint8_t> empty;
+   BOOST_CHECK_EQUAL(computeFCS16(empty), 0);
+}
+
+BOOST_AUTO_TEST_CASE(fcsMatchesPolynomial)
+{
+   // every length around the 8 byte steps of the bulk update
+   for (size_t len = 1; len <= 40; len++) {
+      std::vector<uint8_t> data = testData(len, (uint32_t)len);
+      BOOST_CHECK_EQUAL(computeFCS16(data), bitwiseFCS16(data));
+   }
+   std::vector<uint8_t> data = testData(1000, 7);
+   BOOST_CHECK_EQUAL(computeFCS16(data), bitwiseFCS16(data));
+}
+
+BOOST_AUTO_TEST_CASE(fcsIncremental)
+{
+   std::vector<uint8_t> data = testData(300, 42);
+   uint16_t expected = computeFCS16(data);
+
+   // any split of the data gives the same result as the bulk calculation
+   for (size_t split = 0; split < data.size(); split += 13) {
+      uint16_t fcs = CFcs16::init();
+      fcs = CFcs16::update(fcs, &data[0], split);
+      for (size_t i = split; i < data.size(); i++) {
+         fcs = CFcs16::update(fcs, data[i]);
+      }
+      BOOST_CHECK_EQUAL(CFcs16::close(fcs), expected);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(fcsGood)
+{
+   // the running FCS over a frame and its FCS (low byte first) is the
+   // magic remainder
+   std::vector<uint8_t> data = testData(64, 3);
+   uint16_t fcs = computeFCS16(data);
+   data.push_back(fcs & 0xFF);
+   data.push_back(fcs >> 8);
+   BOOST_CHECK(CFcs16::isGood(CFcs16::update(CFcs16::init(), &data[0], data.size())));
+}
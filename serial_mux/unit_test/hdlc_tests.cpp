@@ -0,0 +1,371 @@
+// hdlc_tests.cpp : HDLC framing test cases
+//
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "HDLC.h"
+
+#include <boost/test/unit_test.hpp>
+
+
+// collects the frames generated by the HDLC parser
+struct FrameCollector : public IHDLCParser {
+   virtual void frameComplete(const uint8_t* frame, size_t len) {
+      frames.push_back(std::vector<uint8_t>(frame, frame + len));
+   }
+   std::vector<std::vector<uint8_t> > frames;
+};
+
+// reproducible test data with a high density of HDLC special characters
+static std::vector<uint8_t> testPayload(size_t len, uint32_t seed)
+{
+   std::vector<uint8_t> data(len);
+   uint32_t x = seed;
+   for (size_t i = 0; i < len; i++) {
+      x = x * 1103515245 + 12345;
+      uint8_t b = (x >> 16) & 0xFF;
+      // one byte in four is a flag or escape
+      if ((b & 0x3) == 0) {
+         b = (b & 0x4) ? 0x7E : 0x7D;
+      }
+      data[i] = b;
+   }
+   return data;
+}
+
+// a stream of encoded frames, with some noise and a corrupted frame
+static std::vector<uint8_t> testStream(std::vector<std::vector<uint8_t> >& payloads)
+{
+   std::vector<uint8_t> stream;
+   // garbage before the first flag, ended by an abort sequence
+   stream.push_back(0x11);
+   stream.push_back(0x7D);
+   stream.push_back(0x7E);
+   for (int i = 0; i < 20; i++) {
+      std::vector<uint8_t> payload = testPayload(1 + i * 7, i + 1);
+      std::vector<uint8_t> encoded = encodeHDLC(payload);
+      if (i == 5) {
+         // corrupt the FCS, the frame is dropped
+         encoded[encoded.size() - 2] ^= 0x01;
+      } else {
+         payloads.push_back(payload);
+      }
+      stream.insert(stream.end(), encoded.begin(), encoded.end());
+   }
+   return stream;
+}
+
+
+BOOST_AUTO_TEST_CASE(findSpecial)
+{
+   std::vector<uint8_t> data(100, 0x55);
+   BOOST_CHECK_EQUAL(CHDLC::findSpecial(&data[0], data.size()), 100);
+   for (size_t i = 0; i < data.size(); i++) {
+      data[i] = (i % 2) ? 0x7E : 0x7D;
+      BOOST_CHECK_EQUAL(CHDLC::findSpecial(&data[0], data.size()), i);
+      data[i] = 0x55;
+   }
+}
+
+BOOST_AUTO_TEST_CASE(decodeByteAtATime)
+{
+   std::vector<std::vector<uint8_t> > payloads;
+   std::vector<uint8_t> stream = testStream(payloads);
+
+   FrameCollector collector;
+   CHDLC hdlc(1024, &collector);
+   for (size_t i = 0; i < stream.size(); i++) {
+      hdlc.addByte(stream[i]);
+   }
+
+   BOOST_REQUIRE_EQUAL(collector.frames.size(), payloads.size());
+   for (size_t i = 0; i < payloads.size(); i++) {
+      BOOST_CHECK(collector.frames[i] == payloads[i]);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(decodeBulkMatchesByteAtATime)
+{
+   std::vector<std::vector<uint8_t> > payloads;
+   std::vector<uint8_t> stream = testStream(payloads);
+
+   FrameCollector reference;
+   {
+      CHDLC hdlc(1024, &reference);
+      for (size_t i = 0; i < stream.size(); i++) {
+         hdlc.addByte(stream[i]);
+      }
+   }
+
+   // chunk sizes that split frames (and escape sequences) at every offset
+   for (size_t chunk = 1; chunk < 40; chunk++) {
+      FrameCollector collector;
+      CHDLC hdlc(1024, &collector);
+      for (size_t i = 0; i < stream.size(); i += chunk) {
+         size_t len = std::min(chunk, stream.size() - i);
+         hdlc.addBytes(&stream[i], len);
+      }
+      BOOST_CHECK(collector.frames == reference.frames);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(escapeAcrossCalls)
+{
+   std::vector<uint8_t> payload;
+   payload.push_back(0x7E);
+   payload.push_back(0x7D);
+   payload.push_back(0x01);
+   std::vector<uint8_t> encoded = encodeHDLC(payload);
+
+   FrameCollector collector;
+   CHDLC hdlc(1024, &collector);
+   // split right after each escape character
+   size_t start = 0;
+   for (size_t i = 0; i < encoded.size(); i++) {
+      if (encoded[i] == 0x7D) {
+         hdlc.addBytes(&encoded[start], i + 1 - start);
+         start = i + 1;
+      }
+   }
+   hdlc.addBytes(&encoded[start], encoded.size() - start);
+
+   BOOST_REQUIRE_EQUAL(collector.frames.size(), 1);
+   BOOST_CHECK(collector.frames[0] == payload);
+}
+
+BOOST_AUTO_TEST_CASE(encodeKnownFrame)
+{
+   // FCS of "123456789" is 0x906E, sent least significant byte first
+   const char check[] = "123456789";
+   uint8_t encoded[32];
+   size_t len = encodeHDLC((const uint8_t*)check, 9, encoded);
+
+   const uint8_t expected[] = { 0x7E, '1', '2', '3', '4', '5', '6', '7', '8', '9',
+                                0x6E, 0x90, 0x7E };
+   BOOST_REQUIRE_EQUAL(len, sizeof(expected));
+   BOOST_CHECK(std::equal(expected, expected + len, encoded));
+}
+
+BOOST_AUTO_TEST_CASE(encodeWorstCase)
+{
+   // every byte escaped fits the worst case buffer
+   for (size_t n = 0; n < 40; n++) {
+      std::vector<uint8_t> payload(n, (n % 2) ? 0x7E : 0x7D);
+      std::vector<uint8_t> encoded(maxEncodedHDLC(n));
+      size_t len = encodeHDLC(payload.empty() ? NULL : &payload[0], n, &encoded[0]);
+      BOOST_CHECK(len >= 2 * n + 4);
+      BOOST_CHECK(len <= maxEncodedHDLC(n));
+      encoded.resize(len);
+      BOOST_CHECK(encoded == encodeHDLC(payload));
+
+      FrameCollector collector;
+      CHDLC hdlc(1024, &collector);
+      hdlc.addBytes(&encoded[0], encoded.size());
+      if (n > 0) {
+         BOOST_REQUIRE_EQUAL(collector.frames.size(), 1);
+         BOOST_CHECK(collector.frames[0] == payload);
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(encodePiecesMatchesWholeFrame)
+{
+   // a frame appended in pieces encodes the same as the whole frame, for
+   // every split point, including a split after a special character
+   std::vector<uint8_t> frame = testPayload(40, 7);
+   std::vector<uint8_t> whole = encodeHDLC(frame);
+   for (size_t split = 0; split <= frame.size(); split++) {
+      std::vector<uint8_t> encoded(maxEncodedHDLC(frame.size()));
+      CHDLCEncoder encoder(&encoded[0]);
+      encoder.append(&frame[0], split);
+      encoder.append(&frame[0] + split, frame.size() - split);
+      encoded.resize(encoder.finish());
+      BOOST_CHECK(encoded == whole);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(oversizeFrameDiscarded)
+{
+   std::vector<uint8_t> small = testPayload(20, 1);
+   std::vector<uint8_t> big = testPayload(65, 2);
+   std::vector<uint8_t> stream = encodeHDLC(small);
+   std::vector<uint8_t> encoded = encodeHDLC(big);
+   stream.insert(stream.end(), encoded.begin(), encoded.end());
+   // a line that never sends the closing flag
+   std::vector<uint8_t> noise(5000, 0x55);
+   stream.insert(stream.end(), noise.begin(), noise.end());
+   encoded = encodeHDLC(small);
+   stream.insert(stream.end(), encoded.begin(), encoded.end());
+
+   FrameCollector collector;
+   CHDLC hdlc(64, &collector);
+   hdlc.addBytes(&stream[0], stream.size());
+
+   BOOST_REQUIRE_EQUAL(collector.frames.size(), 2);
+   BOOST_CHECK(collector.frames[0] == small);
+   BOOST_CHECK(collector.frames[1] == small);
+   BOOST_CHECK_EQUAL(hdlc.getStats().oversizeFrames, 2);
+}
+
+// keeps pointers to the lent frames instead of copying them
+struct FrameBorrower : public IHDLCParser {
+   virtual void frameComplete(const uint8_t* frame, size_t len) {
+      data.push_back(frame);
+      lens.push_back(len);
+   }
+   std::vector<uint8_t> frame(size_t i) const {
+      return std::vector<uint8_t>(data[i], data[i] + lens[i]);
+   }
+   std::vector<const uint8_t*> data;
+   std::vector<size_t> lens;
+};
+
+BOOST_AUTO_TEST_CASE(lentFramesFromPool)
+{
+   const int POOL_SIZE = 3;
+   std::vector<std::vector<uint8_t> > payloads;
+   for (int i = 0; i < 10; i++) {
+      payloads.push_back(testPayload(30 + i, i + 1));
+   }
+
+   FrameBorrower borrower;
+   CHDLC hdlc(64, &borrower, POOL_SIZE);
+   for (size_t i = 0; i < payloads.size(); i++) {
+      std::vector<uint8_t> encoded = encodeHDLC(payloads[i]);
+      hdlc.addBytes(&encoded[0], encoded.size());
+
+      // the last (POOL_SIZE - 1) frames are still intact
+      for (size_t j = (i + 2 >= POOL_SIZE) ? i + 2 - POOL_SIZE : 0; j <= i; j++) {
+         BOOST_CHECK(borrower.frame(j) == payloads[j]);
+      }
+   }
+
+   // the frame buffers are recycled, never reallocated
+   for (size_t i = POOL_SIZE; i < borrower.data.size(); i++) {
+      BOOST_CHECK(borrower.data[i] == borrower.data[i - POOL_SIZE]);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(linkStats)
+{
+   std::vector<std::vector<uint8_t> > payloads;
+   std::vector<uint8_t> stream = testStream(payloads);
+   // a runt: one byte between flags
+   stream.push_back(0x42);
+   stream.push_back(0x7E);
+   // an oversize frame
+   std::vector<uint8_t> encoded = encodeHDLC(std::vector<uint8_t>(300, 0x11));
+   stream.insert(stream.end(), encoded.begin(), encoded.end());
+
+   FrameCollector collector;
+   CHDLC hdlc(256, &collector);
+   hdlc.addBytes(&stream[0], stream.size());
+
+   const SHDLCStats& stats = hdlc.getStats();
+   BOOST_CHECK_EQUAL(stats.goodFrames, payloads.size());
+   BOOST_CHECK_EQUAL(stats.fcsErrors, 1);
+   BOOST_CHECK_EQUAL(stats.runtFrames, 1);
+   BOOST_CHECK_EQUAL(stats.oversizeFrames, 1);
+   BOOST_CHECK_EQUAL(stats.aborts, 1);       // the garbage before the first frame
+   BOOST_CHECK_EQUAL(stats.bytesReceived, stream.size());
+
+   size_t escapes = std::count(stream.begin(), stream.end(), 0x7D);
+   BOOST_CHECK_EQUAL(stats.escapeBytes, escapes);
+
+   uint32_t histogramTotal = 0;
+   for (int i = 0; i < SHDLCStats::SIZE_BUCKETS; i++) {
+      histogramTotal += stats.sizeHistogram[i];
+   }
+   BOOST_CHECK_EQUAL(histogramTotal, stats.goodFrames);
+   // the first payload is a single byte
+   BOOST_CHECK(stats.sizeHistogram[0] >= 1);
+
+   BOOST_CHECK_EQUAL(SHDLCStats::sizeBucket(1), 0);
+   BOOST_CHECK_EQUAL(SHDLCStats::sizeBucket(3), 1);
+   BOOST_CHECK_EQUAL(SHDLCStats::sizeBucket(64), 6);
+   BOOST_CHECK_EQUAL(SHDLCStats::sizeBucket(100000), SHDLCStats::SIZE_BUCKETS - 1);
+}
+
+BOOST_AUTO_TEST_CASE(abortDropsFrame)
+{
+   std::vector<uint8_t> first = testPayload(40, 7);
+   std::vector<uint8_t> second = testPayload(30, 8);
+   // the first frame is aborted halfway, the abort's flag opens the second
+   std::vector<uint8_t> stream = encodeHDLC(first);
+   stream.resize(20);
+   if (stream.back() == 0x7D) {
+      stream.pop_back();
+   }
+   stream.push_back(0x7D);
+   stream.push_back(0x7E);
+   std::vector<uint8_t> encoded = encodeHDLC(second);
+   stream.insert(stream.end(), encoded.begin() + 1, encoded.end());
+
+   FrameCollector collector;
+   CHDLC hdlc(256, &collector);
+   hdlc.addBytes(&stream[0], stream.size());
+
+   BOOST_REQUIRE_EQUAL(collector.frames.size(), 1U);
+   BOOST_CHECK(collector.frames[0] == second);
+   const SHDLCStats& stats = hdlc.getStats();
+   BOOST_CHECK_EQUAL(stats.aborts, 1);
+   BOOST_CHECK_EQUAL(stats.fcsErrors, 0);
+   BOOST_CHECK_EQUAL(stats.runtFrames, 0);
+   BOOST_CHECK(stats.discardedBytes > 0);
+}
+
+BOOST_AUTO_TEST_CASE(linkStatsBulkMatchesByteAtATime)
+{
+   std::vector<std::vector<uint8_t> > payloads;
+   std::vector<uint8_t> stream = testStream(payloads);
+
+   CHDLC perByte(1024, NULL);
+   for (size_t i = 0; i < stream.size(); i++) {
+      perByte.addByte(stream[i]);
+   }
+   CHDLC bulk(1024, NULL);
+   for (size_t i = 0; i < stream.size(); i += 7) {
+      bulk.addBytes(&stream[i], std::min<size_t>(7, stream.size() - i));
+   }
+
+   BOOST_CHECK_EQUAL(bulk.getStats().goodFrames, perByte.getStats().goodFrames);
+   BOOST_CHECK_EQUAL(bulk.getStats().fcsErrors, perByte.getStats().fcsErrors);
+   BOOST_CHECK_EQUAL(bulk.getStats().runtFrames, perByte.getStats().runtFrames);
+   BOOST_CHECK_EQUAL(bulk.getStats().aborts, perByte.getStats().aborts);
+   BOOST_CHECK_EQUAL(bulk.getStats().bytesReceived, perByte.getStats().bytesReceived);
+   BOOST_CHECK_EQUAL(bulk.getStats().escapeBytes, perByte.getStats().escapeBytes);
+   BOOST_CHECK_EQUAL(bulk.getStats().discardedBytes, perByte.getStats().discardedBytes);
+}
+
+// a handler called directly by the decoder template
+struct StaticCollector {
+   void frameComplete(const uint8_t* frame, size_t len) {
+      frames.push_back(std::vector<uint8_t>(frame, frame + len));
+   }
+   std::vector<std::vector<uint8_t> > frames;
+};
+
+BOOST_AUTO_TEST_CASE(staticDecoderMatchesAdapter)
+{
+   std::vector<std::vector<uint8_t> > payloads;
+   std::vector<uint8_t> stream = testStream(payloads);
+   // longer than the compile-time limit below
+   std::vector<uint8_t> encoded = encodeHDLC(testPayload(300, 99));
+   stream.insert(stream.end(), encoded.begin(), encoded.end());
+
+   FrameCollector collector;
+   CHDLC adapter(256, &collector);
+   adapter.addBytes(&stream[0], stream.size());
+
+   StaticCollector handler;
+   CHDLCDecoder<StaticCollector, 256> decoder(&handler);
+   BOOST_CHECK_EQUAL(decoder.getMaxFrameLen(), 256);
+   decoder.addBytes(&stream[0], stream.size());
+
+   BOOST_REQUIRE_EQUAL(handler.frames.size(), payloads.size());
+   BOOST_CHECK(handler.frames == collector.frames);
+   BOOST_CHECK_EQUAL(decoder.getStats().oversizeFrames, 1);
+   BOOST_CHECK_EQUAL(decoder.getStats().discardedBytes, adapter.getStats().discardedBytes);
+}
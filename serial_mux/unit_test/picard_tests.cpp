@@ -0,0 +1,548 @@
+// picard_tests.cpp : Picard Serial API session test cases
+//
+
+#include <vector>
+#include <deque>
+#include <string.h>
+
+#include "BasePicard.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace DustSerialMux;
+
+
+const uint8_t TEST_CMD_TYPE = 0x25;
+
+// Picard I/O that captures its output instead of writing it
+class CCapturePicardIO : public CBasePicardIO {
+public:
+   CCapturePicardIO() : m_hellos(0) { createDecoder(); }
+
+   // the ACKs sent, in order
+   std::vector<uint8_t> ackSeqNos;
+
+   // Returns: whether a command was waiting for a response
+   bool popCommand(uint8_t& seqNo)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      if (m_commands.empty()) {
+         return false;
+      }
+      seqNo = m_commands.front();
+      m_commands.pop_front();
+      return true;
+   }
+
+   int getHellos()
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      return m_hellos;
+   }
+
+   // one read's worth of HDLC encoded input
+   void receive(const std::vector<uint8_t>& input)
+   {
+      decode(&input[0], input.size());
+   }
+
+protected:
+   // called from both threads
+   virtual void sendRaw(const uint8_t* data, size_t len)
+   {
+      boost::mutex::scoped_lock guard(m_lock);
+      if (data[0] == 3) {
+         ackSeqNos.push_back(data[2]);
+      } else if (data[0] == 2) {
+         m_commands.push_back(data[2]);
+      } else if (data[1] == HELLO) {
+         m_hellos++;
+      }
+   }
+
+private:
+   boost::mutex m_lock;
+   std::deque<uint8_t> m_commands;
+   int m_hellos;
+};
+
+// records what the Picard I/O passes on
+struct SessionRecorder : public IPicardCallback {
+   SessionRecorder() : responses(0), restarts(0) { ; }
+
+   virtual void commandComplete(uint8_t cmdType, uint8_t seqNo, uint8_t respCode,
+                                const CByteView& payload)
+   {
+      boost::mutex::scoped_lock guard(lock);
+      responseSeqNos.push_back(seqNo);
+      responses++;
+      done.notify_all();
+   }
+
+   virtual void handleNotifs(const CNotifBatch& batch)
+   {
+      for (size_t i = 0; i < batch.size(); i++) {
+         notifs.push_back((batch[i].payload[0] << 8) | batch[i].payload[1]);
+      }
+      batchSizes.push_back(batch.size());
+   }
+
+   virtual void linkStateChanged(bool isUp)
+   {
+      linkStates.push_back(isUp);
+   }
+
+   virtual void sessionRestarted()
+   {
+      restarts++;
+   }
+
+   void waitForResponses(size_t count)
+   {
+      boost::mutex::scoped_lock guard(lock);
+      while (responses < count) {
+         done.wait(guard);
+      }
+   }
+
+   boost::mutex lock;
+   boost::condition_variable done;
+   size_t responses;
+   std::vector<uint8_t> responseSeqNos;
+   std::vector<int> notifs;     // notification index, in order of arrival
+   std::vector<size_t> batchSizes;
+   std::vector<bool> linkStates;
+   int restarts;
+};
+
+static void helloResponse(CBasePicardIO& picard, uint8_t mgrSeqNo, uint8_t cliSeqNo)
+{
+   uint8_t frame[] = { 0, HELLO_RESPONSE, 0, 5, 0, KNOWN_API_PROTOCOL_VERSIONS[0],
+                       mgrSeqNo, cliSeqNo, 0 };
+   picard.frameComplete(frame, sizeof(frame));
+}
+
+static void reliableNotif(CBasePicardIO& picard, uint8_t seqNo, int index)
+{
+   uint8_t frame[] = { 2, NOTIFICATION, seqNo, 3, 1, (uint8_t)(index >> 8), (uint8_t)index };
+   // one notification per read
+   picard.frameComplete(frame, sizeof(frame));
+   picard.flushNotifs();
+}
+
+static void commandResponse(CBasePicardIO& picard, uint8_t seqNo)
+{
+   uint8_t frame[] = { 3, TEST_CMD_TYPE, seqNo, 1, 0 };
+   picard.frameComplete(frame, sizeof(frame));
+}
+
+
+BOOST_AUTO_TEST_CASE(reliableNotifDuplicates)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   helloResponse(picard, 10, 0);
+
+   reliableNotif(picard, 10, 0);
+   reliableNotif(picard, 11, 1);
+   // the ACK for 11 was lost
+   reliableNotif(picard, 11, 1);
+   reliableNotif(picard, 12, 2);
+
+   BOOST_REQUIRE_EQUAL(recorder.notifs.size(), 3u);
+   for (int i = 0; i < 3; i++) {
+      BOOST_CHECK_EQUAL(recorder.notifs[i], i);
+   }
+   // every copy is acknowledged
+   const uint8_t expectedAcks[] = { 10, 11, 11, 12 };
+   BOOST_CHECK(picard.ackSeqNos == std::vector<uint8_t>(expectedAcks, expectedAcks + 4));
+   picard.registerCallback(NULL);
+}
+
+// Manager side of the stress test: reliable notifications as fast as they
+// can be handled, with a retransmission every 16th, and a response to every
+// command as soon as it is sent
+static void managerThread(CCapturePicardIO* picard, int notifCount, int commandCount)
+{
+   uint8_t mgrSeqNo = 0;
+   int responses = 0;
+   for (int i = 0; i < notifCount || responses < commandCount; i++) {
+      if (i < notifCount) {
+         reliableNotif(*picard, mgrSeqNo, i);
+         if (i % 16 == 15) {
+            reliableNotif(*picard, mgrSeqNo, i);
+         }
+         mgrSeqNo++;
+      }
+      uint8_t seqNo;
+      if (picard->popCommand(seqNo)) {
+         commandResponse(*picard, seqNo);
+         responses++;
+      } else if (i >= notifCount) {
+         boost::this_thread::yield();
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(concurrentCommandsAndNotifs)
+{
+   const int NOTIF_COUNT = 50000;
+   const int COMMAND_COUNT = 5000;
+
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   helloResponse(picard, 0, 99);
+
+   boost::thread manager(managerThread, &picard, NOTIF_COUNT, COMMAND_COUNT);
+
+   // command thread: one command at a time, like the client manager
+   std::vector<uint8_t> sentSeqNos;
+   ByteVector data(3, 0);
+   for (int i = 0; i < COMMAND_COUNT; i++) {
+      uint8_t seqNo;
+      picard.sendCommand(CMuxMessage(TEST_CMD_TYPE, data), seqNo, false);
+      sentSeqNos.push_back(seqNo);
+      recorder.waitForResponses(i + 1);
+   }
+   manager.join();
+   picard.registerCallback(NULL);
+
+   // each response moves the command sequence number on by one
+   BOOST_REQUIRE_EQUAL(sentSeqNos.size(), (size_t)COMMAND_COUNT);
+   for (int i = 0; i < COMMAND_COUNT; i++) {
+      BOOST_REQUIRE_EQUAL(sentSeqNos[i], (uint8_t)(100 + i));
+   }
+   BOOST_CHECK(recorder.responseSeqNos == sentSeqNos);
+
+   // every notification passed on exactly once, in order, and every copy acked
+   BOOST_REQUIRE_EQUAL(recorder.notifs.size(), (size_t)NOTIF_COUNT);
+   for (int i = 0; i < NOTIF_COUNT; i++) {
+      BOOST_REQUIRE_EQUAL(recorder.notifs[i], i & 0xFFFF);
+   }
+   BOOST_CHECK_EQUAL(picard.ackSeqNos.size(), (size_t)(NOTIF_COUNT + NOTIF_COUNT / 16));
+}
+
+BOOST_AUTO_TEST_CASE(apiFrameView)
+{
+   const uint8_t frame[] = { 2, NOTIFICATION, 7, 3, 1, 0xAB, 0xCD };
+   CApiFrame apiFrame(frame, sizeof(frame));
+   BOOST_CHECK(apiFrame.isValid());
+   BOOST_CHECK(apiFrame.isReliable());
+   BOOST_CHECK(!apiFrame.isResponse());
+   BOOST_CHECK_EQUAL(apiFrame.type(), NOTIFICATION);
+   BOOST_CHECK_EQUAL(apiFrame.seqNo(), 7);
+
+   // the payload points into the frame, no copy
+   CByteView payload = apiFrame.payload();
+   BOOST_CHECK(payload.data() == frame + 4);
+   BOOST_CHECK_EQUAL(payload.size(), 3u);
+   BOOST_CHECK_EQUAL(payload.from(1)[1], 0xCD);
+   BOOST_CHECK(payload.from(5).empty());
+   BOOST_CHECK_THROW(payload.at(3), std::out_of_range);
+
+   // wrong length, and too short for a header
+   CApiFrame truncated(frame, sizeof(frame) - 1);
+   BOOST_CHECK(!truncated.isValid());
+   CApiFrame runt(frame, 2);
+   BOOST_CHECK(!runt.isValid());
+   BOOST_CHECK_EQUAL(runt.seqNo(), 0);
+   BOOST_CHECK(runt.payload().empty());
+}
+
+BOOST_AUTO_TEST_CASE(seqWindowDuplicatesAndGaps)
+{
+   CSeqWindow window;
+   BOOST_CHECK(window.accept(250));
+   BOOST_CHECK(window.accept(251));
+   BOOST_CHECK(window.accept(252));
+   // a retransmission after another notification
+   BOOST_CHECK(!window.accept(251));
+   // across the wrap, 253 and 254 are missing
+   BOOST_CHECK(window.accept(255));
+   BOOST_CHECK(window.accept(0));
+   // 253 arrives late, only once
+   BOOST_CHECK(window.accept(253));
+   BOOST_CHECK(!window.accept(253));
+   BOOST_CHECK(!window.accept(0));
+
+   SNotifStats stats = window.getStats();
+   BOOST_CHECK_EQUAL(stats.reliable, 9u);
+   BOOST_CHECK_EQUAL(stats.duplicates, 3u);
+   BOOST_CHECK_EQUAL(stats.gaps, 1u);
+   BOOST_CHECK_EQUAL(stats.missing, 2u);
+   BOOST_CHECK_EQUAL(stats.outOfOrder, 1u);
+
+   // a jump past the window forgets everything before it
+   BOOST_CHECK(window.accept(100));
+   BOOST_CHECK(window.accept(0));
+   BOOST_CHECK(!window.accept(100));
+
+   window.reset();
+   BOOST_CHECK(window.accept(100));
+}
+
+BOOST_AUTO_TEST_CASE(notifBatchPerRead)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   helloResponse(picard, 0, 0);
+
+   // one read: 3 notifications, a command response, 20 more notifications
+   std::vector<uint8_t> input;
+   for (int i = 0; i < 23; i++) {
+      if (i == 3) {
+         const uint8_t response[] = { 3, TEST_CMD_TYPE, 0, 1, 0 };
+         std::vector<uint8_t> encoded = encodeHDLC(std::vector<uint8_t>(response, response + 5));
+         input.insert(input.end(), encoded.begin(), encoded.end());
+      }
+      const uint8_t notif[] = { 2, NOTIFICATION, (uint8_t)i, 3, 1, 0, (uint8_t)i };
+      std::vector<uint8_t> encoded = encodeHDLC(std::vector<uint8_t>(notif, notif + 7));
+      input.insert(input.end(), encoded.begin(), encoded.end());
+   }
+   picard.receive(input);
+
+   // the response ends a batch, a full batch is passed on right away, and
+   // every notification still points at its own frame
+   const size_t expectedSizes[] = { 3, CNotifBatch::MAX_NOTIFS, 20 - CNotifBatch::MAX_NOTIFS };
+   BOOST_CHECK(recorder.batchSizes == std::vector<size_t>(expectedSizes, expectedSizes + 3));
+   BOOST_REQUIRE_EQUAL(recorder.notifs.size(), 23u);
+   for (int i = 0; i < 23; i++) {
+      BOOST_CHECK_EQUAL(recorder.notifs[i], i);
+   }
+   BOOST_CHECK_EQUAL(recorder.responses, 1u);
+   BOOST_CHECK_EQUAL(picard.ackSeqNos.size(), 23u);
+   picard.registerCallback(NULL);
+}
+
+BOOST_AUTO_TEST_CASE(notifBatchAcrossDuplicates)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   helloResponse(picard, 0, 0);
+
+   // one read: a notification, its retransmissions (our ACKs were lost)
+   // and short notifications that aren't passed on either, then more
+   // notifications; more frames than the decoder's pool
+   std::vector<uint8_t> input;
+   for (int i = 0; i < 40; i++) {
+      std::vector<uint8_t> frame;
+      if (i == 0 || i >= 30) {
+         const uint8_t notif[] = { 2, NOTIFICATION, (uint8_t)(i ? i - 29 : 0), 3, 1, 0,
+                                   (uint8_t)(i ? i - 29 : 0) };
+         frame.assign(notif, notif + 7);
+      } else if (i % 2) {
+         const uint8_t duplicate[] = { 2, NOTIFICATION, 0, 3, 1, 0xFF, (uint8_t)i };
+         frame.assign(duplicate, duplicate + 7);
+      } else {
+         const uint8_t shortNotif[] = { 0, NOTIFICATION, 0, 1, 1 };
+         frame.assign(shortNotif, shortNotif + 5);
+      }
+      std::vector<uint8_t> encoded = encodeHDLC(frame);
+      input.insert(input.end(), encoded.begin(), encoded.end());
+   }
+   picard.receive(input);
+
+   // the first notification is passed on before its frame is reused
+   BOOST_REQUIRE_EQUAL(recorder.notifs.size(), 11u);
+   for (int i = 0; i < 11; i++) {
+      BOOST_CHECK_EQUAL(recorder.notifs[i], i);
+   }
+   BOOST_CHECK_EQUAL(recorder.batchSizes.front(), 1u);
+   BOOST_CHECK_EQUAL(picard.ackSeqNos.size(), 26u);
+   picard.registerCallback(NULL);
+}
+
+BOOST_AUTO_TEST_CASE(softResetRestartsSession)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   picard.setSoftReset(true);
+   picard.start();
+   helloResponse(picard, 10, 0);
+   BOOST_CHECK(picard.getTimeToConnect() > 0);
+   reliableNotif(picard, 10, 0);
+
+   // the Manager resets: the session restarts on the same link
+   const uint8_t mgrHello[] = { 0, MGR_HELLO, 0, 2, KNOWN_API_PROTOCOL_VERSIONS[0], 0 };
+   picard.frameComplete(mgrHello, sizeof(mgrHello));
+   BOOST_CHECK_EQUAL(picard.getTimeToConnect(), 0u);
+
+   // the new session starts its sequence numbers over
+   helloResponse(picard, 0, 5);
+   reliableNotif(picard, 0, 1);
+   BOOST_REQUIRE_EQUAL(recorder.notifs.size(), 2u);
+   BOOST_CHECK_EQUAL(recorder.notifs[1], 1);
+
+   uint8_t seqNo;
+   picard.sendCommand(CMuxMessage(TEST_CMD_TYPE, ByteVector(3, 0)), seqNo, false);
+   BOOST_CHECK_EQUAL(seqNo, 6);
+
+   const bool expectedStates[] = { true, false, true };
+   BOOST_CHECK(recorder.linkStates == std::vector<bool>(expectedStates, expectedStates + 3));
+   picard.registerCallback(NULL);
+}
+
+// Manager side of the probe test: answer the second Hello
+static void answerProbe(CCapturePicardIO* picard)
+{
+   while (picard->getHellos() < 2) {
+      boost::this_thread::yield();
+   }
+   helloResponse(*picard, 0, 7);
+}
+
+BOOST_AUTO_TEST_CASE(probeWaitsForHelloResponse)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   picard.start();
+   helloResponse(picard, 0, 0);
+   BOOST_CHECK_EQUAL(recorder.restarts, 0);
+
+   BOOST_CHECK(!picard.probe(10));
+
+   boost::thread manager(answerProbe, &picard);
+   BOOST_CHECK(picard.probe(5000));
+   manager.join();
+
+   // the probe started a new session, the session's users are told
+   uint8_t seqNo;
+   picard.sendCommand(CMuxMessage(TEST_CMD_TYPE, ByteVector(3, 0)), seqNo, false);
+   BOOST_CHECK_EQUAL(seqNo, 8);
+   BOOST_CHECK_EQUAL(recorder.restarts, 1);
+   picard.registerCallback(NULL);
+}
+
+BOOST_AUTO_TEST_CASE(impairmentIsSeeded)
+{
+   SImpairmentPolicy policy;
+   policy.dropRate = 10;
+   policy.corruptRate = 5;
+   policy.duplicateRate = 5;
+   policy.delayRate = 5;
+   policy.delayTime = 100;
+   CLinkImpairment first(policy);
+   CLinkImpairment second(policy);
+
+   const int FRAMES = 10000;
+   int drops = 0;
+   const uint8_t ORIGINAL[] = { 2, TEST_CMD_TYPE, 0, 1, 0 };
+   for (int i = 0; i < FRAMES; i++) {
+      uint8_t frame[sizeof(ORIGINAL)];
+      uint8_t copy[sizeof(ORIGINAL)];
+      memcpy(frame, ORIGINAL, sizeof(ORIGINAL));
+      memcpy(copy, ORIGINAL, sizeof(ORIGINAL));
+      // the same seed impairs the same frames
+      CLinkImpairment::EAction action =
+         first.impair(CLinkImpairment::IMPAIR_TX, frame, sizeof(frame), i);
+      BOOST_REQUIRE_EQUAL(action, second.impair(CLinkImpairment::IMPAIR_TX, copy, sizeof(copy), i));
+      BOOST_CHECK(memcmp(frame, copy, sizeof(frame)) == 0);
+      if (action == CLinkImpairment::IMPAIR_DROP) {
+         drops++;
+      }
+
+      // a corrupted frame has one bit flipped
+      int bits = 0;
+      for (size_t b = 0; b < sizeof(frame); b++) {
+         for (uint8_t diff = frame[b] ^ ORIGINAL[b]; diff != 0; diff >>= 1) {
+            bits += diff & 1;
+         }
+      }
+      BOOST_CHECK_EQUAL(bits, action == CLinkImpairment::IMPAIR_CORRUPT ? 1 : 0);
+   }
+
+   SImpairmentStats stats = first.getStats(CLinkImpairment::IMPAIR_TX);
+   BOOST_CHECK_EQUAL(stats.frames, (uint32_t)FRAMES);
+   BOOST_CHECK_EQUAL(stats.dropped, (uint32_t)drops);
+   BOOST_CHECK(stats.dropped > FRAMES * 8 / 100 && stats.dropped < FRAMES * 12 / 100);
+   BOOST_CHECK(stats.corrupted > 0 && stats.duplicated > 0 && stats.delayed > 0);
+   BOOST_CHECK_EQUAL(first.getStats(CLinkImpairment::IMPAIR_RX).frames, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(impairmentOutageDropsBothDirections)
+{
+   SImpairmentPolicy policy;
+   policy.outageRate = 100;
+   policy.outageTime = 10; // milliseconds
+   CLinkImpairment impairment(policy);
+
+   uint8_t frame[] = { 2, TEST_CMD_TYPE, 0, 1, 0 };
+   BOOST_CHECK_EQUAL(impairment.impair(CLinkImpairment::IMPAIR_TX, frame, sizeof(frame), 0),
+                     CLinkImpairment::IMPAIR_DROP);
+   BOOST_CHECK_EQUAL(impairment.impair(CLinkImpairment::IMPAIR_RX, frame, sizeof(frame), 9999),
+                     CLinkImpairment::IMPAIR_DROP);
+   BOOST_CHECK_EQUAL(impairment.getOutages(), 1u);
+   // the next frame after the outage starts another one
+   impairment.impair(CLinkImpairment::IMPAIR_RX, frame, sizeof(frame), 10000);
+   BOOST_CHECK_EQUAL(impairment.getOutages(), 2u);
+   BOOST_CHECK_EQUAL(impairment.getStats(CLinkImpairment::IMPAIR_RX).outageDrops, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(impairedReceive)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   helloResponse(picard, 10, 0);
+
+   // a corrupted frame on an HDLC link fails the FCS check: not passed on,
+   // not acknowledged
+   SImpairmentPolicy corrupt;
+   corrupt.corruptRate = 100;
+   CLinkImpairment corruption(corrupt);
+   picard.setImpairment(&corruption);
+   reliableNotif(picard, 10, 0);
+   BOOST_CHECK(recorder.notifs.empty());
+   BOOST_CHECK(picard.ackSeqNos.empty());
+
+   // a duplicated notification is acknowledged twice and passed on once
+   SImpairmentPolicy duplicate;
+   duplicate.duplicateRate = 100;
+   CLinkImpairment duplication(duplicate);
+   picard.setImpairment(&duplication);
+   reliableNotif(picard, 10, 1);
+   BOOST_CHECK_EQUAL(recorder.notifs.size(), 1u);
+   BOOST_CHECK_EQUAL(picard.ackSeqNos.size(), 2u);
+   BOOST_CHECK_EQUAL(duplication.getStats(CLinkImpairment::IMPAIR_RX).duplicated, 1u);
+
+   picard.setImpairment(NULL);
+   picard.registerCallback(NULL);
+}
+
+BOOST_AUTO_TEST_CASE(impairedReceiveBatch)
+{
+   CCapturePicardIO picard;
+   SessionRecorder recorder;
+   picard.registerCallback(&recorder);
+   helloResponse(picard, 0, 0);
+
+   // the impairment copies each frame, the notifications of one read
+   // still reach the clients intact
+   SImpairmentPolicy duplicate;
+   duplicate.duplicateRate = 100;
+   CLinkImpairment duplication(duplicate);
+   picard.setImpairment(&duplication);
+   std::vector<uint8_t> input;
+   for (int i = 0; i < 5; i++) {
+      const uint8_t notif[] = { 2, NOTIFICATION, (uint8_t)i, 3, 1, 0, (uint8_t)i };
+      std::vector<uint8_t> encoded = encodeHDLC(std::vector<uint8_t>(notif, notif + 7));
+      input.insert(input.end(), encoded.begin(), encoded.end());
+   }
+   picard.receive(input);
+
+   BOOST_REQUIRE_EQUAL(recorder.notifs.size(), 5u);
+   for (int i = 0; i < 5; i++) {
+      BOOST_CHECK_EQUAL(recorder.notifs[i], i);
+   }
+   BOOST_CHECK_EQUAL(picard.ackSeqNos.size(), 10u);
+
+   picard.setImpairment(NULL);
+   picard.registerCallback(NULL);
+}
@@ -0,0 +1,96 @@
+// serial_line_tests.cpp : serial line settings, on a pseudo-terminal
+//
+
+#include "SerialLine.h"
+
+#include <boost/test/unit_test.hpp>
+
+#ifdef __linux__
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace DustSerialMux;
+
+
+// the slave side of a pseudo-terminal stands in for the serial port
+struct SPseudoTerminal {
+   SPseudoTerminal() : master(-1), slave(-1)
+   {
+      master = posix_openpt(O_RDWR | O_NOCTTY);
+      if (master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0) {
+         slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+      }
+   }
+
+   ~SPseudoTerminal()
+   {
+      if (slave >= 0) {
+         close(slave);
+      }
+      if (master >= 0) {
+         close(master);
+      }
+   }
+
+   int master;
+   int slave;
+};
+
+
+BOOST_AUTO_TEST_CASE(standardBaudRates)
+{
+   SPseudoTerminal pty;
+   BOOST_REQUIRE(pty.slave >= 0);
+   const uint32_t rates[] = { 9600, 115200, 460800, 921600 };
+   for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+      boost::system::error_code err;
+      BOOST_CHECK_EQUAL(setSerialBaudRate(pty.slave, rates[i], err), rates[i]);
+      BOOST_CHECK(!err);
+      BOOST_CHECK_EQUAL(getSerialBaudRate(pty.slave, err), rates[i]);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(nonStandardBaudRate)
+{
+   SPseudoTerminal pty;
+   BOOST_REQUIRE(pty.slave >= 0);
+   boost::system::error_code err;
+   BOOST_CHECK_EQUAL(setSerialBaudRate(pty.slave, 250000, err), 250000U);
+   BOOST_CHECK(!err);
+}
+
+BOOST_AUTO_TEST_CASE(outputQueue)
+{
+   SPseudoTerminal pty;
+   BOOST_REQUIRE(pty.slave >= 0);
+   const char frame[] = "~frame~";
+   BOOST_REQUIRE_EQUAL(write(pty.slave, frame, sizeof(frame)), (ssize_t)sizeof(frame));
+   // a pty passes its output on at once
+   boost::system::error_code err;
+   BOOST_CHECK_EQUAL(getSerialOutputQueue(pty.slave, err), 0);
+   BOOST_CHECK(!err);
+   flushSerialOutput(pty.slave, err);
+   BOOST_CHECK(!err);
+}
+
+BOOST_AUTO_TEST_CASE(modemLinesOfPty)
+{
+   // a pty has no modem lines, flow control is turned off for it
+   SPseudoTerminal pty;
+   BOOST_REQUIRE(pty.slave >= 0);
+   boost::system::error_code err;
+   setSerialRts(pty.slave, true, err);
+   BOOST_CHECK(err);
+   err = boost::system::error_code();
+   BOOST_CHECK(!getSerialCts(pty.slave, err));
+   BOOST_CHECK(err);
+}
+
+BOOST_AUTO_TEST_CASE(baudRateOfClosedPort)
+{
+   boost::system::error_code err;
+   BOOST_CHECK_EQUAL(setSerialBaudRate(-1, 115200, err), 0U);
+   BOOST_CHECK(err);
+}
+#endif
@@ -0,0 +1,291 @@
+// session_tests.cpp : Manager session test cases, the shared io_service,
+// the session options and the failover to the secondary Picard port
+//
+
+#include <vector>
+
+#include "Common.h"
+#include "IoStrand.h"
+#include "MuxSession.h"
+#include "MonotonicTimer.h"
+#include "SerialMuxOptions.h"
+#include "emulator/EmulatorLink.h"
+
+#include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace DustSerialMux;
+
+
+// counts the handlers running at the same time
+struct StrandRecorder {
+   StrandRecorder() : running(0), overlaps(0), calls(0) { ; }
+
+   void handler()
+   {
+      {
+         boost::mutex::scoped_lock guard(lock);
+         if (running++ > 0) {
+            overlaps++;
+         }
+      }
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      {
+         boost::mutex::scoped_lock guard(lock);
+         running--;
+         calls++;
+      }
+   }
+
+   void timerHandler(const boost::system::error_code& error)
+   {
+      handler();
+   }
+
+   boost::mutex lock;
+   int running;
+   int overlaps;
+   int calls;
+};
+
+static void runIoService(boost::asio::io_service* io_service)
+{
+   io_service->run();
+}
+
+static void cancelTimer(boost::asio::deadline_timer* timer)
+{
+   timer->cancel();
+}
+
+static void runSession(CMuxSession* session)
+{
+   session->run();
+}
+
+static void emulatorReceived()
+{
+   ;
+}
+
+// run an emulator's io_service on the caller's thread, for about timeout
+// milliseconds or until until() is true
+template <class Predicate>
+static bool pollEmulator(boost::asio::io_service& io_service, CManagerEmulator& emulator,
+                         int timeout, Predicate until)
+{
+   uint64_t deadline = monotonicMicroseconds() + timerMilliseconds(timeout);
+   while (monotonicMicroseconds() < deadline) {
+      io_service.poll();
+      io_service.reset();
+      emulator.poll(monotonicMicroseconds());
+      if (until()) {
+         return true;
+      }
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+   }
+   return false;
+}
+
+static bool never()
+{
+   return false;
+}
+
+static bool isConnected(const CManagerEmulator* emulator)
+{
+   return emulator->isConnected();
+}
+
+static bool hasFailedOver(const CMuxSession* session)
+{
+   return session->getFailovers() > 0;
+}
+
+static int parse(SerialMuxOptions& opts, const char* arg1 = NULL, const char* arg2 = NULL,
+                 const char* arg3 = NULL)
+{
+   const char* args[] = { "serial_mux", arg1, arg2, arg3 };
+   std::vector<char*> argv;
+   for (size_t i = 0; i < ARRAY_LEN(args) && args[i] != NULL; i++) {
+      argv.push_back(const_cast<char*>(args[i]));
+   }
+   return parseConfiguration(opts, (int)argv.size(), &argv[0], std::cout);
+}
+
+
+BOOST_AUTO_TEST_CASE(strandRunsHandlersInTurn)
+{
+   boost::asio::io_service io_service;
+   CIoStrand strand(io_service);
+   StrandRecorder recorder;
+
+   boost::asio::deadline_timer timer(io_service);
+   timer.expires_from_now(boost::posix_time::milliseconds(1));
+   timer.async_wait(strand.wrap(boost::bind(&StrandRecorder::timerHandler, &recorder, _1)));
+   for (int i = 0; i < 20; i++) {
+      strand.post(boost::bind(&StrandRecorder::handler, &recorder));
+   }
+   BOOST_CHECK_EQUAL(strand.getPending(), 21);
+
+   boost::thread_group threads;
+   for (int i = 0; i < 4; i++) {
+      threads.create_thread(boost::bind(runIoService, &io_service));
+   }
+   strand.waitIdle();
+   // all the handlers have run, on four threads, one at a time
+   BOOST_CHECK_EQUAL(recorder.calls, 21);
+   BOOST_CHECK_EQUAL(recorder.overlaps, 0);
+   BOOST_CHECK_EQUAL(strand.getPending(), 0);
+   threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(strandWaitsForCancelledHandlers)
+{
+   boost::asio::io_service io_service;
+   boost::scoped_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+   boost::thread thread(boost::bind(runIoService, &io_service));
+   CIoStrand strand(io_service);
+   StrandRecorder recorder;
+
+   boost::asio::deadline_timer timer(io_service);
+   timer.expires_from_now(boost::posix_time::hours(1));
+   timer.async_wait(strand.wrap(boost::bind(&StrandRecorder::timerHandler, &recorder, _1)));
+   BOOST_CHECK_EQUAL(strand.getPending(), 1);
+   // the cancelled handler runs before waitIdle returns, while the
+   // io_service keeps running
+   strand.post(boost::bind(cancelTimer, &timer));
+   strand.waitIdle();
+   BOOST_CHECK_EQUAL(recorder.calls, 1);
+
+   work.reset();
+   thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(defaultSession)
+{
+   SerialMuxOptions opts;
+   BOOST_REQUIRE_EQUAL(parse(opts, "--port", "/dev/ttyUSB3"), 0);
+   BOOST_REQUIRE_EQUAL(opts.sessions.size(), 1U);
+   BOOST_CHECK_EQUAL(opts.sessions[0].serialPort, "/dev/ttyUSB3");
+   BOOST_CHECK(opts.sessions[0].useSerial);
+   BOOST_CHECK_EQUAL(opts.sessions[0].listenerPort, DEFAULT_LISTENER_PORT);
+   BOOST_CHECK_EQUAL(opts.ioThreads, DEFAULT_IO_THREADS);
+}
+
+BOOST_AUTO_TEST_CASE(multipleSessions)
+{
+   SerialMuxOptions opts;
+   BOOST_REQUIRE_EQUAL(parse(opts, "--session=/dev/ttyUSB0,9900",
+                             "--session=60001,9901,0011223344556677", "--io-threads=2"), 0);
+   BOOST_REQUIRE_EQUAL(opts.sessions.size(), 2U);
+   BOOST_CHECK_EQUAL(opts.sessions[0].serialPort, "/dev/ttyUSB0");
+   BOOST_CHECK_EQUAL(opts.sessions[0].listenerPort, 9900);
+   // without a token, the session uses the default
+   BOOST_CHECK(std::equal(DEFAULT_AUTHENTICATION, DEFAULT_AUTHENTICATION + AUTHENTICATION_LEN,
+                          opts.sessions[0].authToken));
+   // a port number is the UDP port of the Manager emulator
+   BOOST_CHECK(!opts.sessions[1].useSerial);
+   BOOST_CHECK_EQUAL(opts.sessions[1].emulatorPort, 60001);
+   BOOST_CHECK_EQUAL(opts.sessions[1].listenerPort, 9901);
+   BOOST_CHECK_EQUAL(opts.sessions[1].authToken[1], 0x11);
+   BOOST_CHECK_EQUAL(opts.sessions[1].authToken[7], 0x77);
+   BOOST_CHECK_EQUAL(opts.ioThreads, 2);
+}
+
+BOOST_AUTO_TEST_CASE(invalidSessions)
+{
+   SerialMuxOptions opts;
+   BOOST_CHECK_THROW(parse(opts, "--session=/dev/ttyUSB0"), std::invalid_argument);
+   BOOST_CHECK_THROW(parse(opts, "--session=/dev/ttyUSB0,99x"), std::invalid_argument);
+   BOOST_CHECK_THROW(parse(opts, "--session=/dev/ttyUSB0,9900,xyz"), std::invalid_argument);
+   // the sessions don't share a port
+   BOOST_CHECK_THROW(parse(opts, "--session=/dev/ttyUSB0,9900", "--session=/dev/ttyUSB1,9900"),
+                     std::invalid_argument);
+   BOOST_CHECK_THROW(parse(opts, "--session=/dev/ttyUSB0,9900", "--session=/dev/ttyUSB0,9901"),
+                     std::invalid_argument);
+   BOOST_CHECK_THROW(parse(opts, "--io-threads=0"), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(secondaryPort)
+{
+   SerialMuxOptions opts;
+   BOOST_REQUIRE_EQUAL(parse(opts, "--port=/dev/ttyUSB0", "--secondary-port=/dev/ttyUSB1"), 0);
+   BOOST_REQUIRE_EQUAL(opts.sessions.size(), 1U);
+   BOOST_CHECK_EQUAL(opts.sessions[0].secondaryPort, "/dev/ttyUSB1");
+   BOOST_CHECK_EQUAL(opts.failoverTimeout, DEFAULT_FAILOVER_TIMEOUT);
+
+   // an empty token is the default token
+   BOOST_REQUIRE_EQUAL(parse(opts, "--session=/dev/ttyUSB0,9900,,/dev/ttyUSB1",
+                             "--session=/dev/ttyUSB2,9901", "--failover-timeout=500"), 0);
+   BOOST_REQUIRE_EQUAL(opts.sessions.size(), 2U);
+   BOOST_CHECK_EQUAL(opts.sessions[0].secondaryPort, "/dev/ttyUSB1");
+   BOOST_CHECK(std::equal(DEFAULT_AUTHENTICATION, DEFAULT_AUTHENTICATION + AUTHENTICATION_LEN,
+                          opts.sessions[0].authToken));
+   BOOST_CHECK(opts.sessions[1].secondaryPort.empty());
+   BOOST_CHECK_EQUAL(opts.failoverTimeout, 500);
+
+   // the secondary port belongs to its session only
+   BOOST_CHECK_THROW(parse(opts, "--session=/dev/ttyUSB0,9900,,/dev/ttyUSB1",
+                           "--session=/dev/ttyUSB1,9901"), std::invalid_argument);
+   BOOST_CHECK_THROW(parse(opts, "--port=/dev/ttyUSB0", "--secondary-port=/dev/ttyUSB0"),
+                     std::invalid_argument);
+   BOOST_CHECK_THROW(parse(opts, "--failover-timeout=0"), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(failoverWhenPrimaryStopsAnswering)
+{
+   const int FAILOVER_TIMEOUT = 300;
+   SerialMuxOptions opts;
+   opts.failoverTimeout = FAILOVER_TIMEOUT;
+   opts.readTimeout = 20;
+   SMuxSessionOptions sessionOpts;
+   setPicardPort(sessionOpts, "61201");
+   sessionOpts.secondaryPort = "61202";
+   sessionOpts.listenerPort = 61203;
+
+   // each Manager answers only while its io_service is polled
+   SEmulatorWorkload workload;
+   boost::asio::io_service primaryService;
+   CUdpEmulatorLink primaryLink(primaryService, 61201);
+   CManagerEmulator primary(&primaryLink, workload);
+   primaryLink.start(&primary, emulatorReceived);
+   primary.start(monotonicMicroseconds());
+   boost::asio::io_service secondaryService;
+   CUdpEmulatorLink secondaryLink(secondaryService, 61202);
+   CManagerEmulator secondary(&secondaryLink, workload);
+   secondaryLink.start(&secondary, emulatorReceived);
+   secondary.start(monotonicMicroseconds());
+
+   boost::asio::io_service io_service;
+   boost::scoped_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+   boost::thread ioThread(boost::bind(runIoService, &io_service));
+   CMuxSession session(io_service, opts, sessionOpts);
+   boost::thread sessionThread(boost::bind(runSession, &session));
+
+   BOOST_REQUIRE(pollEmulator(primaryService, primary, 10 * FAILOVER_TIMEOUT,
+                              boost::bind(isConnected, &primary)));
+   // the quiet link is probed, the answered probes keep the primary port
+   pollEmulator(primaryService, primary, 3 * FAILOVER_TIMEOUT, never);
+   BOOST_CHECK_EQUAL(session.getFailovers(), 0);
+   BOOST_CHECK(!secondary.isConnected());
+
+   // the primary Manager stops answering: a quiet failover timeout, and
+   // then the probe's
+   uint64_t stopped = monotonicMicroseconds();
+   BOOST_CHECK(pollEmulator(secondaryService, secondary, 10 * FAILOVER_TIMEOUT,
+                            boost::bind(hasFailedOver, &session)));
+   uint64_t failedOver = monotonicMicroseconds() - stopped;
+   BOOST_CHECK(secondary.isConnected());
+   BOOST_CHECK_EQUAL(session.getFailovers(), 1);
+   BOOST_CHECK_GE(session.getMaxFailoverLatency(), (uint64_t)timerMilliseconds(2 * FAILOVER_TIMEOUT));
+   BOOST_CHECK_LT(session.getMaxFailoverLatency(), (uint64_t)timerMilliseconds(3 * FAILOVER_TIMEOUT));
+   BOOST_CHECK_LT(failedOver, (uint64_t)timerMilliseconds(3 * FAILOVER_TIMEOUT));
+
+   session.stop();
+   sessionThread.join();
+   work.reset();
+   io_service.stop();
+   ioThread.join();
+}
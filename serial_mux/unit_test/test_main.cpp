@@ -0,0 +1,2 @@
+#define BOOST_TEST_MODULE "Serial Mux unit tests"
+#include <boost/test/unit_test.hpp>
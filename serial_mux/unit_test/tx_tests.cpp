@@ -0,0 +1,103 @@
+// tx_tests.cpp : serial output scheduling test cases
+//
+
+#include <vector>
+
+#include "TxScheduler.h"
+#include "HDLC.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace DustSerialMux;
+
+
+static STxFrame* queueFrame(CTxQueue& queue, uint8_t tag, bool isAck)
+{
+   STxFrame* frame = queue.alloc();
+   frame->data[0] = tag;
+   frame->len = 1;
+   frame->isAck = isAck;
+   queue.push(frame);
+   return frame;
+}
+
+
+BOOST_AUTO_TEST_CASE(ackTemplateMatchesEncoder)
+{
+   // types with and without special characters
+   const uint8_t types[] = { 20, 0x7D, 0x7E, 0xFF };
+   for (size_t t = 0; t < sizeof(types); t++) {
+      CAckTemplate ack(types[t]);
+      for (int seqNo = 0; seqNo < 256; seqNo++) {
+         std::vector<uint8_t> frame;
+         frame.push_back(3);
+         frame.push_back(types[t]);
+         frame.push_back((uint8_t)seqNo);
+         frame.push_back(1);
+         frame.push_back(0);
+         std::vector<uint8_t> expected = encodeHDLC(frame);
+
+         uint8_t encoded[CAckTemplate::MAX_ENCODED_LEN];
+         size_t len = ack.encode((uint8_t)seqNo, encoded);
+         BOOST_REQUIRE_EQUAL(len, expected.size());
+         BOOST_CHECK(std::equal(expected.begin(), expected.end(), encoded));
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(txQueueAcksFirst)
+{
+   CTxQueue queue(16);
+   BOOST_CHECK(queue.empty());
+   BOOST_CHECK(queue.pop() == NULL);
+
+   queueFrame(queue, 1, false);
+   queueFrame(queue, 2, false);
+   queueFrame(queue, 10, true);
+   queueFrame(queue, 3, false);
+   queueFrame(queue, 11, true);
+
+   // ACKs in order, then the other frames in order
+   const uint8_t expected[] = { 10, 11, 1, 2, 3 };
+   for (size_t i = 0; i < sizeof(expected); i++) {
+      STxFrame* frame = queue.pop();
+      BOOST_REQUIRE(frame != NULL);
+      BOOST_CHECK_EQUAL(frame->data[0], expected[i]);
+      queue.release(frame);
+   }
+   BOOST_CHECK(queue.empty());
+}
+
+BOOST_AUTO_TEST_CASE(txQueueRecyclesFrames)
+{
+   CTxQueue queue(16);
+   STxFrame* first = queueFrame(queue, 1, true);
+   queue.release(queue.pop());
+
+   // a released frame is reused and comes back cleared
+   STxFrame* second = queue.alloc();
+   BOOST_CHECK(second == first);
+   BOOST_CHECK_EQUAL(second->len, 0u);
+   BOOST_CHECK(!second->isAck);
+   BOOST_CHECK_EQUAL(second->data.size(), 16u);
+   queue.release(second);
+}
+
+BOOST_AUTO_TEST_CASE(ackLatencyHistogram)
+{
+   BOOST_CHECK_EQUAL(SAckStats::latencyBucket(0), 0);
+   BOOST_CHECK_EQUAL(SAckStats::latencyBucket(1), 0);
+   BOOST_CHECK_EQUAL(SAckStats::latencyBucket(2), 1);
+   BOOST_CHECK_EQUAL(SAckStats::latencyBucket(1023), 9);
+   BOOST_CHECK_EQUAL(SAckStats::latencyBucket(1024), 10);
+   BOOST_CHECK_EQUAL(SAckStats::latencyBucket(10000000), SAckStats::LATENCY_BUCKETS - 1);
+
+   SAckStats stats;
+   stats.record(100);
+   stats.record(300);
+   BOOST_CHECK_EQUAL(stats.acks, 2u);
+   BOOST_CHECK_EQUAL(stats.maxLatency, 300u);
+   BOOST_CHECK_CLOSE(stats.meanLatency(), 200.0, 0.001);
+   BOOST_CHECK_EQUAL(stats.latencyHistogram[6], 1u);
+   BOOST_CHECK_EQUAL(stats.latencyHistogram[8], 1u);
+}